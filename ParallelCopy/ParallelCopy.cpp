@@ -1,201 +1,976 @@
-// ParallelCopy.cpp : Defines the entry point for the console application.
-//
-
-#include "stdafx.h"
-
-#include <atomic>
-#include <tuple>
-
-#include "log.h"
-CLog g_log(CLog::eS_DEBUG, "output.log");
-
-#include "commandlineoptions.h"
-#include "jobsystem.h"
-
-volatile std::atomic_size_t failedToCopy = 0;
-volatile unsigned int MAX_RETRIES = 10;
-volatile DWORD RETRY_DELAY = 10000; // 10 second retry delay
-
-void copyFile(const std::string& source, const std::string& destination)
-{
-	size_t length = MultiByteToWideChar(CP_UTF8, 0, destination.c_str(), (int)destination.length(), nullptr, 0);
-	std::wstring path(length + 1, 0);
-	MultiByteToWideChar(CP_UTF8, 0, destination.c_str(), (int)destination.length(), &path[0], (int)path.length());
-	path[path.find_last_of(L"/\\")] = 0; // trim file from path
-
-	bool copied = false;
-	DWORD retries = MAX_RETRIES;
-
-	switch (SHCreateDirectoryEx(NULL, path.c_str(), nullptr))
-	{
-	case ERROR_ALREADY_EXISTS:
-	case ERROR_FILE_EXISTS:
-	case ERROR_SUCCESS:
-		while (!copied && retries)
-		{
-			if (CopyFileExA(source.c_str(), destination.c_str(), nullptr, nullptr, nullptr, 0/*COPY_FILE_NO_BUFFERING*/))
-			{
-				if (retries != MAX_RETRIES)
-				{
-					LOG_INFORMATION("Copied [%s] to [%s] after [%d] retries", source.c_str(), destination.c_str(), MAX_RETRIES - retries);
-				}
-				copied = true;
-			}
-			else
-			{
-				//LOG_ERROR("Failed to copy [%s] to [%s]; [%d] retries remaining: GetLastError() 0x%08X; sleeping before retry", source.c_str(), destination.c_str(), retries, GetLastError());
-				--retries;
-				Sleep(RETRY_DELAY);
-			}
-		}
-
-		if (!copied)
-		{
-			LOG_ERROR("Failed to copy [%s] to [%s] after [%d] retries: GetLastError() 0x%08X", source.c_str(), destination.c_str(), MAX_RETRIES, GetLastError());
-			++failedToCopy;
-		}
-
-		break;
-	case ERROR_BAD_PATHNAME:
-		LOG_ERROR("Bad pathname [%s]", path.c_str());
-		++failedToCopy;
-		break;
-	case ERROR_FILENAME_EXCED_RANGE:
-		LOG_ERROR("Pathname [%s] too long", path.c_str());
-		++failedToCopy;
-		break;
-	case ERROR_CANCELLED:
-		LOG_WARNING("User cancelled creating directory [%s]", path.c_str());
-		++failedToCopy;
-		break;
-	default:
-		LOG_INFORMATION("Failed to create parent directory for [%s]", destination.c_str());
-		++failedToCopy;
-		break;
-	}
-}
-
-void Help()
-{
-	LOG_INFORMATION("ParallelCopy.exe [-t <threads>] [-h] <manifest>");
-	LOG_INFORMATION("--threads  -t  number of threads to use (default is (2*<cores>)-1)");
-	LOG_INFORMATION("--max-retries  -r  maximum number of retries (default 10)");
-	LOG_INFORMATION("--retry-delay  -d  delay (in ms) between retries (default 10000)");
-	LOG_INFORMATION("--help     -h  help");
-	LOG_INFORMATION("<manifest>     a pipe seperated file list in the form src|dst, 1 entry per line");
-}
-
-int main(const int argc, const char* argv[])
-{
-#if defined(_DEBUG)
-	std::string commandLineArgs = "";
-	for (int index = 0; index < argc; ++index)
-	{
-		if (index > 0)
-		{
-			commandLineArgs += " ";
-		}
-		commandLineArgs += argv[index];
-	}
-	LOG_DEBUG("Command line [%s]", commandLineArgs.c_str());
-#endif // defined(_DEBUG)
-
-	struct SOptions
-	{
-		const char* m_fileList = nullptr;
-		int m_numThreads = 0; // default number of threads
-	} options;
-
-	CCommandLineOptions opts(argc, argv, [&](int argc, const char* argv[], int& index) -> bool {
-		options.m_fileList = argv[index];
-		return true;
-	});
-	opts.AddOption("threads", 't', [&](int argc, const char* argv[], int& index) -> bool {
-		options.m_numThreads = atoi(argv[++index]);
-		LOG_DEBUG("Threads [%s] => (%d)", argv[index], options.m_numThreads);
-		return true;
-	});
-	opts.AddOption("max-retries", 'r', [&](int argc, const char* argv[], int& index) -> bool {
-		MAX_RETRIES = atoi(argv[++index]);
-		LOG_DEBUG("Max retries [%s] => (%d)", argv[index], MAX_RETRIES);
-		return true;
-	});
-	opts.AddOption("retry-delay", 'd', [&](int argc, const char* argv[], int& index) -> bool {
-		RETRY_DELAY = atoi(argv[++index]);
-		LOG_DEBUG("Retry delay [%sms] => (%dms)", argv[index], RETRY_DELAY);
-		return true;
-	});
-	opts.AddOption("help", 'h', [&](int argc, const char* argv[], int& index) -> bool {
-		Help();
-		return false;
-	});
-
-	if (opts.Parse())
-	{
-		if (options.m_fileList != nullptr)
-		{
-			CJobSystem jobSystem(options.m_numThreads);
-			LOG_INFORMATION("Copying files in [%s] and using [%d] threads (max retries [%d], retry delay [%dms])", options.m_fileList, jobSystem.NumThreads(), MAX_RETRIES, RETRY_DELAY);
-
-			std::list<std::tuple<const std::string, const std::string>> files;
-			std::ifstream fileList(options.m_fileList);
-			std::string line;
-			size_t count = 0;
-			while (std::getline(fileList, line))
-			{
-				size_t sep = line.find('|');
-				if (sep == std::string::npos)
-				{
-					LOG_ERROR("Malformed line in [%s](%i) (should be 'src|dst' format)", options.m_fileList, count + 1);
-					break;
-				}
-
-				std::string source = line.substr(0, sep);
-				std::string destination = line.substr(sep + 1);
-				files.push_back(std::make_tuple(source, destination));
-				++count;
-			}
-
-			for (const std::tuple<const std::string, const std::string>& copyOperation : files)
-			{
-				const std::string source = std::get<0>(copyOperation);
-				const std::string destination = std::get<1>(copyOperation);
-				//LOG_INFORMATION("Copying [%s] to [%s]...", source.c_str(), destination.c_str());
-
-				jobSystem.AddJob([source, destination]() {
-					copyFile(source, destination);
-				});
-			}
-
-			size_t remaining = 0;
-			size_t running = 0;
-			DWORD sleepInterval = 50; // sleep interval of 50ms
-			DWORD logInterval = 2000 / sleepInterval; // log interval of 2s
-			DWORD logCounter = 0;
-		do
-			{
-				remaining = jobSystem.JobCount();
-				running = jobSystem.JobsRunning();
-				if (++logCounter == logInterval)
-				{
-					logCounter = 0;
-					LOG_INFORMATION("[%d] threads running; [%d] files remaining...", running, remaining);
-				}
-
-				jobSystem.Update();
-				Sleep(sleepInterval);
-		} while (remaining || running);
-
-			// Have to take local copies of atomics before passing to functions (can't access copy constructor)
-			size_t failed = failedToCopy;
-			LOG_INFORMATION("%d files copied, %d failed", count - failed, failed);
-		}
-		else
-		{
-			Help();
-		}
-	}
-
-	return 0;
-}
-
+// ParallelCopy.cpp : Defines the entry point for the console application.
+//
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <algorithm>
+
+#include "log.h"
+CLog g_log(CLog::eS_DEBUG, "output.log");
+
+#include "metrics.h"
+CMetrics g_metrics;
+
+#include "autotune.h"
+#include "bufferpool.h"
+#include "checksum.h"
+#include "commandlineoptions.h"
+#include "copybackend.h"
+#include "copyorder.h"
+#include "dedupe.h"
+#include "devicemap.h"
+#include "diskusage.h"
+#include "freespace.h"
+#include "jobsystem.h"
+#include "journal.h"
+#include "manifest.h"
+#include "retrypolicy.h"
+#include "treewalker.h"
+#include "uringengine.h"
+
+volatile std::atomic_size_t failedToCopy = 0;
+volatile unsigned int MAX_RETRIES = 10;
+volatile unsigned int RETRY_DELAY = 1000; // 1 second before the first retry, doubling for each one after
+volatile unsigned int MAX_RETRY_DELAY = 60000; // but never more than a minute
+volatile uint64_t CHUNK_THRESHOLD = 0; // files at least this big are split into ranges; 0 disables chunking
+volatile uint64_t CHUNK_SIZE = 64 * 1024 * 1024;
+volatile bool INCREMENTAL = false; // skip destinations whose size and modification time already match the source
+volatile uint64_t DELTA_THRESHOLD = 0; // when incremental, changed files at least this big only have their differing blocks rewritten; 0 disables
+std::unique_ptr<CCopyBackend> g_copyBackend;
+CRetryPolicy g_retryPolicy(RETRY_DELAY, MAX_RETRY_DELAY);
+std::unique_ptr<CJournal> g_journal;
+std::unique_ptr<CChecksumManifest> g_checksums;
+std::unique_ptr<CDedupe> g_dedupe;
+
+// The devices a manifest entry's copy was queued on with --device-limit, so that the jobs it goes on to make (its
+// ranges and retries) wait for room on them too, rather than getting round the limit
+struct SCopyDevices
+{
+	SCopyDevices() {}
+
+	SCopyDevices(uint64_t source, uint64_t destination)
+		: m_source{ source }
+		, m_destination{ destination }
+	{
+	}
+
+	inline bool Scheduled() const
+	{
+		return m_source != UNSCHEDULED;
+	}
+
+	static const uint64_t UNSCHEDULED = ~0ULL; // no device's id (NODEV), so no flag is needed alongside them
+	uint64_t m_source = UNSCHEDULED;
+	uint64_t m_destination = UNSCHEDULED;
+};
+
+// A copy's manifest line and attempt, packed together so that a retry's closure (two paths and the devices besides)
+// still fits in a CJob without allocating; --max-retries is capped to what m_attempt holds
+struct SAttempt
+{
+	SAttempt(size_t line, unsigned int attempt)
+		: m_line{ line }
+		, m_attempt{ attempt }
+	{
+	}
+
+	static const unsigned int MAX = 0xFFFF;
+	uint64_t m_line : 48;
+	uint64_t m_attempt : 16;
+};
+
+CJobSystem::CJobHandle createCopyJob(CJobSystem& jobSystem, const SCopyDevices& devices, CJob&& function)
+{
+	return devices.Scheduled() ? jobSystem.CreateDeviceJob(std::move(function), devices.m_source, devices.m_destination) : jobSystem.CreateJob(std::move(function));
+}
+
+// Runs function once delay has passed; for a scheduled copy, once its devices have room after that
+template<typename Rep, typename Period>
+void addDelayedCopyJob(CJobSystem& jobSystem, const SCopyDevices& devices, CJob&& function, const std::chrono::duration<Rep, Period>& delay)
+{
+	if (devices.Scheduled())
+	{
+		jobSystem.SubmitDelayed(createCopyJob(jobSystem, devices, std::move(function)), delay);
+	}
+	else
+	{
+		jobSystem.AddDelayedJob(std::move(function), delay);
+	}
+}
+
+struct SChunkedCopy
+{
+	SChunkedCopy(std::unique_ptr<CCopyBackend::CRangeCopy>&& ranges, size_t line, const CDedupe::SFile& file, const SCopyDevices& devices)
+		: m_ranges{ std::move(ranges) }
+		, m_line{ line }
+		, m_file(file)
+		, m_devices(devices)
+	{
+	}
+
+	std::unique_ptr<CCopyBackend::CRangeCopy> m_ranges;
+	std::atomic_int m_error{ 0 };
+	size_t m_line;
+	CDedupe::SFile m_file; // for --dedupe, once it's landed
+	SCopyDevices m_devices;
+};
+
+// A copy has landed at destination: it's done as far as the journal is concerned, and with --dedupe, later duplicates
+// of it can be linked to it
+void landed(size_t line, const std::string& destination, const CDedupe::SFile& file)
+{
+	g_journal->Complete(line, destination);
+	if (g_dedupe)
+	{
+		g_dedupe->Landed(destination, file);
+	}
+}
+
+void copyFile(CJobSystem& jobSystem, size_t line, const std::string& source, const std::string& destination, const SCopyDevices& devices = SCopyDevices(), unsigned int attempt = 1);
+
+// Failed ranges are retried from the timer wheel rather than by sleeping here, so the worker goes straight back to
+// other work.  finish is the job that finalises the file once every range has landed; a retry takes over this range's
+// place among the jobs it waits for.
+void copyRange(CJobSystem& jobSystem, const std::shared_ptr<SChunkedCopy>& copy, const CJobSystem::CJobHandle& finish, uint64_t offset, uint64_t length, unsigned int attempt = 1)
+{
+	int error = 0;
+	if (copy->m_error == 0) // no point carrying on once another range has failed
+	{
+		if (copy->m_ranges->CopyRange(offset, length, error))
+		{
+			g_retryPolicy.Succeeded(copy->m_ranges->Destination());
+		}
+		else if (attempt < MAX_RETRIES)
+		{
+			g_metrics.Error();
+			g_metrics.Retried();
+			std::chrono::milliseconds delay = g_retryPolicy.Failed(copy->m_ranges->Destination(), attempt);
+			LOG_DEBUG("Failed to copy range [%llu] of [%s]: error 0x%08X; retrying in [%dms]", offset, copy->m_ranges->Destination().c_str(), error, static_cast<int>(delay.count()));
+			CJobSystem::CJobHandle retry = createCopyJob(jobSystem, copy->m_devices, [&jobSystem, copy, finish, offset, length, attempt]() {
+				copyRange(jobSystem, copy, finish, offset, length, attempt + 1);
+			});
+			jobSystem.AddDependency(finish, retry); // while finish is still waiting on this range
+			jobSystem.SubmitDelayed(retry, delay);
+			return;
+		}
+		else
+		{
+			g_metrics.Error();
+			copy->m_error = error;
+		}
+	}
+}
+
+// Runs once every range has landed (or given up): closes the file and, with --verify, reads it back, as a job of its own
+void finishChunked(CJobSystem& jobSystem, const std::shared_ptr<SChunkedCopy>& copy)
+{
+	int error = 0;
+	if (!g_copyBackend->FinishRanges(*copy->m_ranges, copy->m_error == 0, error))
+	{
+		if ((copy->m_error == 0) && (error == CCopyBackend::VERIFY_ERROR) && (MAX_RETRIES > 1))
+		{
+			// Every range copied but the file didn't read back the same; go again with the file as a whole
+			const std::string& source = copy->m_ranges->Source();
+			const std::string& destination = copy->m_ranges->Destination();
+			g_metrics.Error();
+			g_metrics.Retried();
+			std::chrono::milliseconds delay = g_retryPolicy.Failed(destination, 1);
+			size_t line = copy->m_line;
+			const SCopyDevices& devices = copy->m_devices;
+			addDelayedCopyJob(jobSystem, devices, [&jobSystem, line, source, destination, devices]() {
+				copyFile(jobSystem, line, source, destination, devices, 2);
+			}, delay);
+			return;
+		}
+
+		LOG_ERROR("Failed to copy [%s] to [%s] in chunks: error 0x%08X", copy->m_ranges->Source().c_str(), copy->m_ranges->Destination().c_str(), (copy->m_error != 0) ? (int)copy->m_error : error);
+		if (copy->m_error == 0) // a range that gave up has counted its error already
+		{
+			g_metrics.Error();
+		}
+		++failedToCopy;
+	}
+	else
+	{
+		landed(copy->m_line, copy->m_ranges->Destination(), copy->m_file);
+	}
+}
+
+// Splits a large file into CHUNK_SIZE ranges, each copied by its own job, and a job depending on all of them to finish
+// the file; returns false if the file should be copied whole
+bool copyChunked(CJobSystem& jobSystem, size_t line, const std::string& source, const std::string& destination, const CDedupe::SFile& file, const SCopyDevices& devices)
+{
+	std::unique_ptr<CCopyBackend::CRangeCopy> ranges = g_copyBackend->OpenRanges(source, destination, CHUNK_THRESHOLD);
+	if (ranges == nullptr)
+	{
+		return false;
+	}
+
+	uint64_t size = ranges->Size();
+	uint64_t chunkSize = CHUNK_SIZE;
+	size_t chunks = ranges->Cloned() ? 0 : static_cast<size_t>((size + chunkSize - 1) / chunkSize);
+	if (chunks == 0)
+	{
+		int error = 0;
+		if (!g_copyBackend->FinishRanges(*ranges, true, error))
+		{
+			LOG_ERROR("Failed to copy [%s] to [%s]: error 0x%08X", source.c_str(), destination.c_str(), error);
+			g_metrics.Error();
+			++failedToCopy;
+		}
+		else
+		{
+			landed(line, destination, file);
+		}
+		return true;
+	}
+
+	std::shared_ptr<SChunkedCopy> copy = std::make_shared<SChunkedCopy>(std::move(ranges), line, file, devices);
+	CJobSystem::CJobHandle finish = createCopyJob(jobSystem, devices, [&jobSystem, copy]() {
+		finishChunked(jobSystem, copy);
+	});
+	for (size_t chunk = 0; chunk < chunks; ++chunk)
+	{
+		uint64_t offset = chunk * chunkSize;
+		uint64_t length = std::min(chunkSize, size - offset);
+		CJobSystem::CJobHandle range = createCopyJob(jobSystem, devices, [&jobSystem, copy, finish, offset, length]() {
+			copyRange(jobSystem, copy, finish, offset, length);
+		});
+		jobSystem.AddDependency(finish, range);
+		jobSystem.Submit(range);
+	}
+	jobSystem.Submit(finish);
+
+	return true;
+}
+
+// line is the manifest line the copy came from, for the journal.  attempt counts from 1; a failed attempt is rescheduled
+// on the job system's timer wheel with a backoff from the retry policy, rather than sleeping on the worker
+void copyFile(CJobSystem& jobSystem, size_t line, const std::string& source, const std::string& destination, const SCopyDevices& devices, unsigned int attempt)
+{
+	CDedupe::SFile file; // only known on the first attempt; a retried copy isn't offered to later duplicates
+	if (attempt == 1)
+	{
+		uint64_t size = 0;
+		CCopyBackend::EDifference difference = CCopyBackend::eD_MISSING;
+		if (INCREMENTAL)
+		{
+			difference = g_copyBackend->Compare(source, destination, size);
+			if (difference == CCopyBackend::eD_SAME)
+			{
+				g_copyBackend->RecordSkipped(size);
+				g_journal->Complete(line, destination);
+				return;
+			}
+		}
+
+		if (!g_copyBackend->CreateParentDirectory(destination))
+		{
+			++failedToCopy;
+			return;
+		}
+
+		// Ahead of a delta update, which would otherwise write through a destination hardlinked by an earlier run
+		if (g_dedupe && g_dedupe->Link(source, destination, file))
+		{
+			g_journal->Complete(line, destination);
+			return;
+		}
+
+		int error = 0;
+		if ((difference == CCopyBackend::eD_DIFFERENT) && (DELTA_THRESHOLD > 0) && (size >= DELTA_THRESHOLD) && g_copyBackend->Update(source, destination, error))
+		{
+			landed(line, destination, file);
+			return;
+		}
+
+		if ((CHUNK_THRESHOLD > 0) && copyChunked(jobSystem, line, source, destination, file, devices))
+		{
+			return;
+		}
+	}
+
+	int error = 0;
+	if (g_copyBackend->Copy(source, destination, error))
+	{
+		if (attempt > 1)
+		{
+			LOG_INFORMATION("Copied [%s] to [%s] after [%d] retries", source.c_str(), destination.c_str(), attempt - 1);
+		}
+		g_retryPolicy.Succeeded(destination);
+		landed(line, destination, file);
+	}
+	else if (attempt < MAX_RETRIES)
+	{
+		g_metrics.Error();
+		g_metrics.Retried();
+		std::chrono::milliseconds delay = g_retryPolicy.Failed(destination, attempt);
+		LOG_DEBUG("Failed to copy [%s] to [%s]: error 0x%08X; retrying in [%dms]", source.c_str(), destination.c_str(), error, static_cast<int>(delay.count()));
+		SAttempt next(line, attempt + 1);
+		addDelayedCopyJob(jobSystem, devices, [&jobSystem, next, source, destination, devices]() {
+			copyFile(jobSystem, next.m_line, source, destination, devices, next.m_attempt);
+		}, delay);
+	}
+	else
+	{
+		LOG_ERROR("Failed to copy [%s] to [%s] after [%d] retries: error 0x%08X", source.c_str(), destination.c_str(), attempt - 1, error);
+		g_metrics.Error();
+		++failedToCopy;
+	}
+}
+
+// The job only holds the entry's views into the mapped manifest, which is all the path storage it needs; the paths are
+// copied out into buffers of the worker's own, which stop growing once they've held the longest path
+void copyEntry(CJobSystem& jobSystem, const CManifest::SEntry& entry, const SCopyDevices& devices)
+{
+	thread_local std::string source;
+	thread_local std::string destination;
+	source.assign(entry.m_source, entry.m_sourceLength);
+	destination.assign(entry.m_destination, entry.m_destinationLength);
+	copyFile(jobSystem, entry.m_line, source, destination, devices);
+}
+
+void Help()
+{
+	LOG_INFORMATION("ParallelCopy.exe [-t <threads>] [-h] <manifest>");
+	LOG_INFORMATION("ParallelCopy.exe [-t <threads>] [-h] -s <source directory> -o <destination directory>");
+	LOG_INFORMATION("--source  -s  directory to copy, walked in parallel instead of reading a manifest (with --destination; regular files only)");
+	LOG_INFORMATION("--destination  -o  directory --source is copied into; checksums go to '<destination>.crc32c'");
+	LOG_INFORMATION("--threads  -t  number of threads to use (default is (2*<cores>)-1); with --autotune, the number to start with");
+	LOG_INFORMATION("--autotune  -a  adjust the number of threads while copying to whatever gives the best throughput, up to this many (0 for 8*<cores>)");
+	LOG_INFORMATION("--autotune-interval  -T  how often (in ms) --autotune measures the throughput and adjusts (default 1000)");
+	LOG_INFORMATION("--device-limit  -L  copy at most this many files at once from or to any one device (volume); or '<path>=<n>' for the device holding <path> (repeatable; default no limit)");
+	LOG_INFORMATION("--order  -p  order to copy a manifest's entries in: 'manifest' (default, as listed), 'largest' (biggest first, to finish sooner),");
+	LOG_INFORMATION("               'inode' or 'physical' (by where the sources are on disk, for rotational disks); all but 'manifest' read the whole manifest and stat every source first");
+	LOG_INFORMATION("--preflight  -P  'warn' or 'refuse': before copying a manifest, check each destination filesystem has room for the sources copied to it, and warn or refuse to start if not");
+	LOG_INFORMATION("--free-space  -F  report the size and free space of the filesystem holding this path and exit (repeatable; the paths are queried in parallel)");
+	LOG_INFORMATION("--disk-usage  -g  report the space used under this directory, and the directories using the most, and exit (stays on the one filesystem; hardlinked files count once)");
+	LOG_INFORMATION("--top  -N  number of directories --disk-usage lists, and of changes --compare lists (default 20)");
+	LOG_INFORMATION("--snapshot  -S  with --disk-usage, save every directory's totals to this file for a later --compare");
+	LOG_INFORMATION("--compare  -C  with --disk-usage, report what's changed since this --snapshot (before any new --snapshot is saved)");
+	LOG_INFORMATION("--query-timeout  -Q  how long (in ms) to wait for --free-space or --preflight to hear back from a filesystem before giving up on it (default 5000)");
+	LOG_INFORMATION("--max-retries  -r  maximum number of retries (default 10, at most 65535)");
+	LOG_INFORMATION("--retry-delay  -d  delay (in ms) before the first retry, doubling for each after it (default 1000)");
+	LOG_INFORMATION("--max-retry-delay  -D  longest delay (in ms) between retries (default 60000)");
+	LOG_INFORMATION("--chunk-threshold  -c  split files of at least this many MB into ranges copied in parallel (default 0, disabled)");
+	LOG_INFORMATION("--chunk-size  -k  size (in MB) of each range when splitting files (default 64)");
+	LOG_INFORMATION("--incremental  -i  skip files whose destination already has the same size and modification time");
+	LOG_INFORMATION("--delta  -b  with --incremental, rewrite only the blocks that differ in changed files of at least this many MB (default 0, disabled)");
+	LOG_INFORMATION("--verify  -v  checksum (crc32c) the data as it's copied, then re-read each destination to check it; checksums go to '<manifest>.crc32c'");
+	LOG_INFORMATION("--verify-direct  -V  as --verify, but re-read the destination bypassing the cache");
+	LOG_INFORMATION("--direct  -n  copy bypassing the page cache (O_DIRECT / unbuffered I/O) through a pool of aligned buffers; not used by --io-uring");
+	LOG_INFORMATION("--hugepages  -H  with --direct, back the buffers with huge (large) pages if the system has them available");
+	LOG_INFORMATION("--dedupe  -e  'hardlink' or 'reflink': link files identical to one already copied (same size, crc32c and bytes) to it rather than writing them again; not used by --io-uring");
+	LOG_INFORMATION("               hardlinked files share one set of attributes, and only runs with --dedupe know to unlink them before overwriting");
+	LOG_INFORMATION("--checksum-benchmark  -K  measure the checksum's throughput and exit");
+	LOG_INFORMATION("--io-uring  -u  copy using this many io_uring threads instead of the thread pool (Linux only; default 0, disabled)");
+	LOG_INFORMATION("--io-uring-files  -f  number of files in flight on each io_uring thread (default 256)");
+	LOG_INFORMATION("--max-in-flight  -m  maximum number of manifest entries (or files found by a walk) queued or copying at once (default 65536)");
+	LOG_INFORMATION("--metrics  -M  write throughput and latency metrics to '<path>.prom' (Prometheus text format) and '<path>.json' while copying");
+	LOG_INFORMATION("--metrics-interval  -I  how often (in ms) to write the metrics (default 1000)");
+	LOG_INFORMATION("--resume  -R  skip the entries the journal ('<manifest>.journal') says an earlier run already copied");
+	LOG_INFORMATION("--log-drop  -l  drop log messages rather than stall when the log can't keep up (default is to wait)");
+	LOG_INFORMATION("--help     -h  help");
+	LOG_INFORMATION("<manifest>     a pipe seperated file list in the form src|dst, 1 entry per line");
+}
+
+int main(const int argc, const char* argv[])
+{
+#if defined(_DEBUG)
+	std::string commandLineArgs = "";
+	for (int index = 0; index < argc; ++index)
+	{
+		if (index > 0)
+		{
+			commandLineArgs += " ";
+		}
+		commandLineArgs += argv[index];
+	}
+	LOG_DEBUG("Command line [%s]", commandLineArgs.c_str());
+#endif // defined(_DEBUG)
+
+	struct SOptions
+	{
+		const char* m_fileList = nullptr;
+		const char* m_source = nullptr; // walked instead of reading a manifest
+		const char* m_destination = nullptr;
+		int m_numThreads = 0; // default number of threads
+		int m_autotune = -1; // maximum number of threads when tuning; -1 is a fixed thread count
+		unsigned int m_autotuneInterval = 1000;
+		bool m_deviceScheduling = false;
+		size_t m_deviceLimit = 0; // 0 for no limit
+		std::vector<std::pair<std::string, size_t>> m_deviceLimits; // per path
+		size_t m_maxInFlight = 64 * 1024;
+		int m_uringThreads = 0;
+		int m_uringFiles = 256;
+		bool m_resume = false;
+		const char* m_metrics = nullptr;
+		unsigned int m_metricsInterval = 1000;
+		CCopyBackend::EVerify m_verify = CCopyBackend::eV_NONE;
+		bool m_direct = false;
+		bool m_hugePages = false;
+		CCopyOrder::EPolicy m_order = CCopyOrder::eP_MANIFEST;
+		CFreeSpace::EPreflight m_preflight = CFreeSpace::eP_NONE;
+		std::vector<std::string> m_freeSpace;
+		unsigned int m_queryTimeout = 5000;
+		const char* m_diskUsage = nullptr;
+		size_t m_top = 20;
+		const char* m_snapshot = nullptr;
+		const char* m_compare = nullptr;
+		bool m_dedupe = false;
+		CCopyBackend::ELink m_link = CCopyBackend::eL_HARDLINK;
+	} options;
+
+	CCommandLineOptions opts(argc, argv, [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_fileList = argv[index];
+		return true;
+	});
+	opts.AddOption("threads", 't', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_numThreads = atoi(argv[++index]);
+		LOG_DEBUG("Threads [%s] => (%d)", argv[index], options.m_numThreads);
+		return true;
+	});
+	opts.AddOption("autotune", 'a', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_autotune = std::max(atoi(argv[++index]), 0);
+		LOG_DEBUG("Autotune up to [%s] => (%d) threads", argv[index], options.m_autotune);
+		return true;
+	});
+	opts.AddOption("autotune-interval", 'T', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_autotuneInterval = static_cast<unsigned int>(std::max(atoi(argv[++index]), 1));
+		LOG_DEBUG("Autotune interval [%sms] => (%dms)", argv[index], options.m_autotuneInterval);
+		return true;
+	});
+	opts.AddOption("device-limit", 'L', [&](int argc, const char* argv[], int& index) -> bool {
+		const char* limit = argv[++index];
+		const char* equals = strrchr(limit, '=');
+		if (equals != nullptr)
+		{
+			options.m_deviceLimits.emplace_back(std::string(limit, equals - limit), static_cast<size_t>(std::max(atoi(equals + 1), 0)));
+		}
+		else
+		{
+			options.m_deviceLimit = static_cast<size_t>(std::max(atoi(limit), 0));
+		}
+		options.m_deviceScheduling = true;
+		LOG_DEBUG("Device limit [%s]", limit);
+		return true;
+	});
+	opts.AddOption("source", 's', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_source = argv[++index];
+		LOG_DEBUG("Source [%s]", options.m_source);
+		return true;
+	});
+	opts.AddOption("destination", 'o', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_destination = argv[++index];
+		LOG_DEBUG("Destination [%s]", options.m_destination);
+		return true;
+	});
+	opts.AddOption("order", 'p', [&](int argc, const char* argv[], int& index) -> bool {
+		if (!CCopyOrder::Parse(argv[++index], options.m_order))
+		{
+			LOG_ERROR("Unknown --order [%s] (should be 'manifest', 'largest', 'inode' or 'physical')", argv[index]);
+			return false;
+		}
+		LOG_DEBUG("Order [%s]", argv[index]);
+		return true;
+	});
+	opts.AddOption("preflight", 'P', [&](int argc, const char* argv[], int& index) -> bool {
+		const char* preflight = argv[++index];
+		if (strcmp(preflight, "warn") == 0)
+		{
+			options.m_preflight = CFreeSpace::eP_WARN;
+		}
+		else if (strcmp(preflight, "refuse") == 0)
+		{
+			options.m_preflight = CFreeSpace::eP_REFUSE;
+		}
+		else
+		{
+			LOG_ERROR("Unknown --preflight [%s] (should be 'warn' or 'refuse')", preflight);
+			return false;
+		}
+		LOG_DEBUG("Preflight [%s]", preflight);
+		return true;
+	});
+	opts.AddOption("free-space", 'F', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_freeSpace.emplace_back(argv[++index]);
+		LOG_DEBUG("Free space [%s]", argv[index]);
+		return true;
+	});
+	opts.AddOption("disk-usage", 'g', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_diskUsage = argv[++index];
+		LOG_DEBUG("Disk usage [%s]", options.m_diskUsage);
+		return true;
+	});
+	opts.AddOption("top", 'N', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_top = static_cast<size_t>(std::max(atoi(argv[++index]), 0));
+		LOG_DEBUG("Top [%s] => (%d)", argv[index], options.m_top);
+		return true;
+	});
+	opts.AddOption("snapshot", 'S', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_snapshot = argv[++index];
+		LOG_DEBUG("Snapshot [%s]", options.m_snapshot);
+		return true;
+	});
+	opts.AddOption("compare", 'C', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_compare = argv[++index];
+		LOG_DEBUG("Compare [%s]", options.m_compare);
+		return true;
+	});
+	opts.AddOption("query-timeout", 'Q', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_queryTimeout = static_cast<unsigned int>(std::max(atoi(argv[++index]), 1));
+		LOG_DEBUG("Query timeout [%sms] => (%dms)", argv[index], options.m_queryTimeout);
+		return true;
+	});
+	opts.AddOption("max-retries", 'r', [&](int argc, const char* argv[], int& index) -> bool {
+		MAX_RETRIES = std::min<unsigned int>(atoi(argv[++index]), static_cast<unsigned int>(SAttempt::MAX));
+		LOG_DEBUG("Max retries [%s] => (%d)", argv[index], MAX_RETRIES);
+		return true;
+	});
+	opts.AddOption("retry-delay", 'd', [&](int argc, const char* argv[], int& index) -> bool {
+		RETRY_DELAY = atoi(argv[++index]);
+		LOG_DEBUG("Retry delay [%sms] => (%dms)", argv[index], RETRY_DELAY);
+		return true;
+	});
+	opts.AddOption("max-retry-delay", 'D', [&](int argc, const char* argv[], int& index) -> bool {
+		MAX_RETRY_DELAY = atoi(argv[++index]);
+		LOG_DEBUG("Max retry delay [%sms] => (%dms)", argv[index], MAX_RETRY_DELAY);
+		return true;
+	});
+	opts.AddOption("chunk-threshold", 'c', [&](int argc, const char* argv[], int& index) -> bool {
+		CHUNK_THRESHOLD = strtoull(argv[++index], nullptr, 10) * 1024 * 1024;
+		LOG_DEBUG("Chunk threshold [%sMB] => (%lluB)", argv[index], CHUNK_THRESHOLD);
+		return true;
+	});
+	opts.AddOption("chunk-size", 'k', [&](int argc, const char* argv[], int& index) -> bool {
+		CHUNK_SIZE = std::max<uint64_t>(strtoull(argv[++index], nullptr, 10), 1) * 1024 * 1024;
+		LOG_DEBUG("Chunk size [%sMB] => (%lluB)", argv[index], CHUNK_SIZE);
+		return true;
+	});
+	opts.AddOption("incremental", 'i', [&](int argc, const char* argv[], int& index) -> bool {
+		INCREMENTAL = true;
+		LOG_DEBUG("Incremental");
+		return true;
+	});
+	opts.AddOption("delta", 'b', [&](int argc, const char* argv[], int& index) -> bool {
+		DELTA_THRESHOLD = std::max<uint64_t>(strtoull(argv[++index], nullptr, 10), 1) * 1024 * 1024;
+		LOG_DEBUG("Delta threshold [%sMB] => (%lluB)", argv[index], DELTA_THRESHOLD);
+		return true;
+	});
+	opts.AddOption("verify", 'v', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_verify = CCopyBackend::eV_CACHED;
+		LOG_DEBUG("Verify");
+		return true;
+	});
+	opts.AddOption("verify-direct", 'V', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_verify = CCopyBackend::eV_DIRECT;
+		LOG_DEBUG("Verify bypassing the cache");
+		return true;
+	});
+	opts.AddOption("direct", 'n', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_direct = true;
+		LOG_DEBUG("Direct");
+		return true;
+	});
+	opts.AddOption("hugepages", 'H', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_hugePages = true;
+		LOG_DEBUG("Huge pages");
+		return true;
+	});
+	opts.AddOption("dedupe", 'e', [&](int argc, const char* argv[], int& index) -> bool {
+		const char* link = argv[++index];
+		if (strcmp(link, "hardlink") == 0)
+		{
+			options.m_link = CCopyBackend::eL_HARDLINK;
+		}
+		else if (strcmp(link, "reflink") == 0)
+		{
+			options.m_link = CCopyBackend::eL_REFLINK;
+		}
+		else
+		{
+			LOG_ERROR("Unknown --dedupe link [%s] (should be 'hardlink' or 'reflink')", link);
+			return false;
+		}
+		options.m_dedupe = true;
+		LOG_DEBUG("Dedupe [%s]", link);
+		return true;
+	});
+	opts.AddOption("checksum-benchmark", 'K', [&](int argc, const char* argv[], int& index) -> bool {
+		CCrc32c::Benchmark();
+		return false;
+	});
+	opts.AddOption("io-uring", 'u', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_uringThreads = atoi(argv[++index]);
+		LOG_DEBUG("io_uring threads [%s] => (%d)", argv[index], options.m_uringThreads);
+		return true;
+	});
+	opts.AddOption("io-uring-files", 'f', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_uringFiles = std::min(std::max(atoi(argv[++index]), 1), 4096);
+		LOG_DEBUG("io_uring files [%s] => (%d)", argv[index], options.m_uringFiles);
+		return true;
+	});
+	opts.AddOption("max-in-flight", 'm', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_maxInFlight = std::max(atoi(argv[++index]), 1);
+		LOG_DEBUG("Max in flight [%s] => (%d)", argv[index], options.m_maxInFlight);
+		return true;
+	});
+	opts.AddOption("metrics", 'M', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_metrics = argv[++index];
+		LOG_DEBUG("Metrics [%s]", options.m_metrics);
+		return true;
+	});
+	opts.AddOption("metrics-interval", 'I', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_metricsInterval = static_cast<unsigned int>(std::max(atoi(argv[++index]), 1));
+		LOG_DEBUG("Metrics interval [%sms] => (%dms)", argv[index], options.m_metricsInterval);
+		return true;
+	});
+	opts.AddOption("resume", 'R', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_resume = true;
+		LOG_DEBUG("Resuming from journal");
+		return true;
+	});
+	opts.AddOption("log-drop", 'l', [&](int argc, const char* argv[], int& index) -> bool {
+		g_log.SetOverflowPolicy(CLog::eO_DROP);
+		LOG_DEBUG("Dropping log messages on overflow");
+		return true;
+	});
+	opts.AddOption("help", 'h', [&](int argc, const char* argv[], int& index) -> bool {
+		Help();
+		return false;
+	});
+
+	if (opts.Parse())
+	{
+		// A report on its own, needing no manifest
+		if (!options.m_freeSpace.empty())
+		{
+			CFreeSpace freeSpace;
+			return freeSpace.Report(options.m_freeSpace, std::chrono::milliseconds(options.m_queryTimeout)) ? 0 : 1;
+		}
+
+		if (options.m_diskUsage != nullptr)
+		{
+			CJobSystem jobSystem(options.m_numThreads);
+			CDiskUsage usage(jobSystem);
+			LOG_INFORMATION("Measuring the disk usage of [%s] using [%d] threads", options.m_diskUsage, jobSystem.NumThreads());
+			if (!usage.Walk(options.m_diskUsage))
+			{
+				return 1;
+			}
+
+			while (!jobSystem.WaitForIdle(std::chrono::seconds(2)))
+			{
+				LOG_INFORMATION("[%d] directories read, [%d] files found...", usage.Directories(), usage.Files());
+				jobSystem.Update();
+			}
+			jobSystem.Update();
+
+			usage.Report(options.m_top);
+			bool ok = (options.m_compare == nullptr) || usage.Compare(options.m_compare, options.m_top);
+			ok = ((options.m_snapshot == nullptr) || usage.Save(options.m_snapshot)) && ok;
+			return ok ? 0 : 1;
+		}
+
+		// Walking a tree has no manifest, and so no journal to resume from (one that isn't opened ignores completions)
+		bool walking = (options.m_fileList == nullptr) && (options.m_source != nullptr) && (options.m_destination != nullptr);
+		if ((options.m_fileList != nullptr) || walking)
+		{
+			std::string name(walking ? CTreeWalker::Trim(options.m_destination) : options.m_fileList);
+			std::unique_ptr<CManifest> manifest;
+			g_journal.reset(new CJournal(name.c_str()));
+			if (!walking)
+			{
+				manifest.reset(new CManifest(options.m_fileList));
+				if (!manifest->IsOpen())
+				{
+					return 1;
+				}
+
+				// Written as entries complete, so an interrupted run can be picked up with --resume
+				g_journal->Open(options.m_resume, manifest->Size(), manifest->Modified());
+				if (g_journal->Resumed() > 0)
+				{
+					LOG_INFORMATION("Resuming; [%s] has [%d] entries already copied", g_journal->Name(), g_journal->Resumed());
+				}
+			}
+
+			g_copyBackend = CCopyBackend::Create();
+			if (options.m_verify != CCopyBackend::eV_NONE)
+			{
+				g_checksums.reset(new CChecksumManifest(name.c_str()));
+				g_checksums->Open(options.m_resume);
+				g_copyBackend->SetVerify(options.m_verify, g_checksums.get());
+				LOG_INFORMATION("Verifying copies%s (crc32c %s); checksums written to [%s]", (options.m_verify == CCopyBackend::eV_DIRECT) ? " bypassing the cache" : "", CCrc32c::HardwareSupported() ? "using sse4.2" : "in software", g_checksums->Name());
+			}
+			if (options.m_dedupe)
+			{
+				g_dedupe.reset(new CDedupe(*g_copyBackend, options.m_link));
+				LOG_INFORMATION("Deduplicating: files identical to one already copied are %s to it", (options.m_link == CCopyBackend::eL_HARDLINK) ? "hardlinked" : "reflinked");
+			}
+			g_retryPolicy.SetDelays(RETRY_DELAY, MAX_RETRY_DELAY);
+			// When tuning, the pool is created at the maximum size and the workers not in use are parked
+			bool autotuning = (options.m_autotune >= 0);
+			size_t maxThreads = (options.m_autotune > 0) ? options.m_autotune : std::thread::hardware_concurrency() * 8;
+			std::unique_ptr<CBufferPool> buffers; // outlives the workers using it
+			CJobSystem jobSystem(autotuning ? maxThreads : options.m_numThreads);
+			if (autotuning)
+			{
+				jobSystem.SetActiveThreads((options.m_numThreads > 0) ? options.m_numThreads : std::thread::hardware_concurrency());
+			}
+			if (walking)
+			{
+				LOG_INFORMATION("Copying [%s] to [%s] and using [%d] threads (max retries [%d], retry delay [%d-%dms], max in flight [%d])", options.m_source, options.m_destination, jobSystem.ActiveThreads(), MAX_RETRIES, RETRY_DELAY, MAX_RETRY_DELAY, options.m_maxInFlight);
+			}
+			else
+			{
+				LOG_INFORMATION("Copying files in [%s] and using [%d] threads (max retries [%d], retry delay [%d-%dms], max in flight [%d])", options.m_fileList, jobSystem.ActiveThreads(), MAX_RETRIES, RETRY_DELAY, MAX_RETRY_DELAY, options.m_maxInFlight);
+			}
+			if (options.m_direct)
+			{
+				// A worker holds at most one pair of buffers at a time, so one each means nobody ever waits for them
+				buffers.reset(new CBufferPool(1024 * 1024, jobSystem.NumThreads(), options.m_hugePages));
+				if (!buffers->IsOpen())
+				{
+					return 1;
+				}
+				g_copyBackend->SetDirect(buffers.get());
+				LOG_INFORMATION("Copying bypassing the page cache with [%d] pairs of [%d]KB buffers%s", jobSystem.NumThreads(), buffers->BufferSize() / 1024, buffers->HugePages() ? " in huge pages" : "");
+			}
+			std::unique_ptr<CAutotune> autotune;
+			if (autotuning)
+			{
+				autotune.reset(new CAutotune(jobSystem, g_metrics, 1, options.m_autotuneInterval));
+				LOG_INFORMATION("Autotuning between [1] and [%d] threads every [%dms]", jobSystem.NumThreads(), options.m_autotuneInterval);
+			}
+
+			// Copies are queued per source and destination device, each device running no more than its limit at once
+			CDeviceMap devices;
+			if (options.m_deviceScheduling && !walking)
+			{
+				jobSystem.SetDeviceLimit(options.m_deviceLimit);
+				for (const std::pair<std::string, size_t>& limit : options.m_deviceLimits)
+				{
+					uint64_t device = devices.Device(limit.first.c_str());
+					jobSystem.SetDeviceLimit(device, limit.second);
+					LOG_INFORMATION("Device [%llx] ([%s]) limited to [%d] files at once", device, limit.first.c_str(), limit.second);
+				}
+				LOG_INFORMATION("Scheduling copies per device, [%d] at once on each by default (0 is unlimited)", options.m_deviceLimit);
+			}
+			if (options.m_metrics != nullptr)
+			{
+				g_metrics.AddGauge("jobs_held", "Copy jobs waiting for their device to have room", [&jobSystem]() { return static_cast<double>(jobSystem.JobsHeld()); });
+				g_metrics.AddGauge("threads_active", "Workers taking copy jobs", [&jobSystem]() { return static_cast<double>(jobSystem.ActiveThreads()); });
+				g_metrics.AddGauge("jobs_running", "Copy jobs running", [&jobSystem]() { return static_cast<double>(jobSystem.JobsRunning()); });
+				g_metrics.AddGauge("jobs_queued", "Copy jobs waiting for a worker", [&jobSystem]() { return static_cast<double>(jobSystem.JobCount()); });
+				g_metrics.AddGauge("jobs_delayed", "Copies waiting to be retried", [&jobSystem]() { return static_cast<double>(jobSystem.JobsDelayed()); });
+				g_metrics.StartExporter(options.m_metrics, options.m_metricsInterval);
+				LOG_INFORMATION("Writing metrics to [%s.prom] and [%s.json] every [%dms]", options.m_metrics, options.m_metrics, options.m_metricsInterval);
+			}
+
+#if !defined(_WIN32)
+			// Files the rings fail on go through the thread pool, which has the retry logic
+			std::unique_ptr<CUringCopyEngine> uring;
+			if ((options.m_uringThreads > 0) && !walking)
+			{
+				uring.reset(new CUringCopyEngine(*g_copyBackend, options.m_uringThreads, options.m_uringFiles, INCREMENTAL, [&jobSystem](std::string&& source, std::string&& destination, size_t line) {
+					jobSystem.AddJob([source, destination, line, &jobSystem]() {
+						copyFile(jobSystem, line, source, destination);
+					});
+				}, [](size_t line, const std::string& destination) {
+					g_journal->Complete(line, destination);
+				}));
+				if (uring->IsOpen())
+				{
+					LOG_INFORMATION("Using [%d] io_uring threads with [%d] files in flight each", options.m_uringThreads, options.m_uringFiles);
+				}
+				else
+				{
+					uring.reset();
+				}
+			}
+#endif // !defined(_WIN32)
+
+			// Stream entries straight from the mapped manifest into the job system, stalling whenever the workers fall
+			// m_maxInFlight entries behind so memory use is bounded however big the manifest is
+			size_t count = 0;
+			size_t skipped = 0;
+			auto queue = [&](const CManifest::SEntry& entry) {
+#if !defined(_WIN32)
+				if (uring)
+				{
+					while (!uring->WaitForCapacity(options.m_maxInFlight, std::chrono::seconds(2)))
+					{
+						LOG_INFORMATION("[%d] files copied by io_uring; [%d] entries read...", uring->FilesCopied(), count);
+						jobSystem.Update();
+					}
+
+					uring->Add(std::string(entry.m_source, entry.m_sourceLength), std::string(entry.m_destination, entry.m_destinationLength), entry.m_line);
+					++count;
+					return;
+				}
+#endif // !defined(_WIN32)
+
+				while (!jobSystem.WaitForCapacity(options.m_maxInFlight, std::chrono::seconds(2)))
+				{
+					LOG_INFORMATION("[%d] threads running; [%d] files queued; [%d] waiting for a device; [%d] waiting to retry; [%d] entries read...", jobSystem.JobsRunning(), jobSystem.JobCount(), jobSystem.JobsHeld(), jobSystem.JobsDelayed(), count);
+					jobSystem.Update();
+				}
+
+				if (options.m_deviceScheduling)
+				{
+					SCopyDevices copyDevices(devices.Device(entry.m_source, entry.m_sourceLength), devices.Device(entry.m_destination, entry.m_destinationLength));
+					jobSystem.AddDeviceJob([entry, copyDevices, &jobSystem]() {
+						copyEntry(jobSystem, entry, copyDevices);
+					}, copyDevices.m_source, copyDevices.m_destination);
+				}
+				else
+				{
+					jobSystem.AddJob([entry, &jobSystem]() {
+						copyEntry(jobSystem, entry, SCopyDevices());
+					});
+				}
+				++count;
+			};
+
+			// Manifest order streams; any other order, or checking there's room first, needs every entry (as views into the
+			// mapping) up front
+			CManifest::SEntry entry;
+			CManifest::EResult result = CManifest::eR_END;
+			std::vector<CManifest::SEntry> entries;
+			while (manifest && ((result = manifest->Next(entry)) == CManifest::eR_OK))
+			{
+				if (g_journal->IsComplete(entry.m_line))
+				{
+					++skipped;
+				}
+				else if ((options.m_order != CCopyOrder::eP_MANIFEST) || (options.m_preflight != CFreeSpace::eP_NONE))
+				{
+					entries.push_back(entry);
+				}
+				else
+				{
+					queue(entry);
+				}
+			}
+
+			if (!entries.empty() && (options.m_preflight != CFreeSpace::eP_NONE))
+			{
+				CFreeSpace freeSpace;
+				if (!freeSpace.Preflight(jobSystem, entries, std::chrono::milliseconds(options.m_queryTimeout)) && (options.m_preflight == CFreeSpace::eP_REFUSE))
+				{
+					LOG_ERROR("Not copying: the destination doesn't have room (--preflight refuse)");
+					g_metrics.StopExporter(); // before the job system its gauges refer to goes
+					return 1;
+				}
+			}
+
+			if (!entries.empty())
+			{
+				if (options.m_order != CCopyOrder::eP_MANIFEST)
+				{
+					CCopyOrder::Sort(jobSystem, options.m_order, entries);
+				}
+				for (const CManifest::SEntry& ordered : entries)
+				{
+					queue(ordered);
+				}
+			}
+
+			if (result == CManifest::eR_MALFORMED)
+			{
+				LOG_ERROR("Malformed line in [%s](%i) (should be 'src|dst' format)", options.m_fileList, entry.m_line);
+			}
+
+			// The walk queues the copies itself as it finds the files, from the workers reading each directory
+			std::unique_ptr<CTreeWalker> walker;
+			if (walking)
+			{
+				walker.reset(new CTreeWalker(jobSystem, options.m_maxInFlight, [&jobSystem](const std::string& source, const std::string& destination) {
+					copyFile(jobSystem, 0, source, destination);
+				}));
+				if (!walker->Walk(options.m_source, options.m_destination))
+				{
+					g_metrics.StopExporter(); // before the job system its gauges refer to goes
+					return 1;
+				}
+			}
+
+#if !defined(_WIN32)
+			if (uring)
+			{
+				while (!uring->WaitForIdle(std::chrono::seconds(2)))
+				{
+					LOG_INFORMATION("[%d] files copied by io_uring; [%d] entries read...", uring->FilesCopied(), count);
+					jobSystem.Update();
+				}
+				LOG_INFORMATION("%d files copied using [io_uring], %d handed back to the thread pool", uring->FilesCopied(), uring->FilesFallenBack());
+			}
+#endif // !defined(_WIN32)
+
+			// Wakes as soon as the last job finishes; the timeout is only there for progress logging
+			while (!jobSystem.WaitForIdle(std::chrono::seconds(2)))
+			{
+				if (walker && !walker->Finished())
+				{
+					LOG_INFORMATION("[%d] threads running; [%d] directories walked, [%d] files found; [%d] jobs queued; [%d] waiting to retry...", jobSystem.JobsRunning(), walker->Directories(), walker->Files(), jobSystem.JobCount(), jobSystem.JobsDelayed());
+				}
+				else
+				{
+					LOG_INFORMATION("[%d] threads running; [%d] files remaining; [%d] waiting for a device; [%d] waiting to retry...", jobSystem.JobsRunning(), jobSystem.JobCount() + jobSystem.JobsHeld(), jobSystem.JobsHeld(), jobSystem.JobsDelayed());
+				}
+				jobSystem.Update();
+			}
+			jobSystem.Update();
+			if (walker)
+			{
+				count = walker->Files();
+			}
+			if (autotune)
+			{
+				autotune.reset();
+				LOG_INFORMATION("Autotune finished with [%d] threads", jobSystem.ActiveThreads());
+			}
+
+			if (options.m_deviceScheduling)
+			{
+				LOG_INFORMATION("Copied between [%d] devices", devices.Count());
+			}
+
+			// Have to take local copies of atomics before passing to functions (can't access copy constructor)
+			size_t failed = failedToCopy;
+			size_t unchanged = g_copyBackend->FilesSkipped();
+			LOG_INFORMATION("%d files copied, %d unchanged, %d failed", count - failed - unchanged, unchanged, failed);
+			if (skipped > 0)
+			{
+				LOG_INFORMATION("%d files skipped as already copied by an earlier run", skipped);
+			}
+			g_journal.reset(); // flushed and synced
+			g_checksums.reset();
+			g_metrics.StopExporter(); // writes a final snapshot; the gauges refer to the job system
+			g_copyBackend->Report();
+			if (g_dedupe)
+			{
+				g_dedupe->Report();
+			}
+			if (buffers)
+			{
+				buffers->Report();
+			}
+			g_metrics.Report();
+			g_retryPolicy.Report();
+			if (g_log.Dropped() > 0)
+			{
+				LOG_WARNING("%llu log messages were dropped", static_cast<unsigned long long>(g_log.Dropped()));
+			}
+		}
+		else
+		{
+			Help();
+		}
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,181 @@
+#pragma once
+
+// Adaptive concurrency: grows or shrinks the number of active job system workers while copying, as no fixed thread
+// count suits both a spinning disk (where extra threads just thrash the heads) and an NVMe array or a high latency
+// network mount (where far more are needed to keep it busy).
+//
+// Every interval it measures the copy rate at the current thread count and hill climbs: a move that raised the rate is
+// repeated, one that lowered it is reversed, and threads that bought nothing are given back.  When adding threads
+// lowers the rate and the time per file rises with them the device is queueing, so it backs off multiplicatively
+// rather than a step at a time (AIMD).  Surplus workers are parked rather than destroyed, so moves are cheap.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "jobsystem.h"
+#include "log.h"
+#include "metrics.h"
+#include "thread.h"
+
+class CAutotune
+{
+public:
+	// Tunes between minThreads and the job system's NumThreads(), starting from however many are active now
+	CAutotune(CJobSystem& jobSystem, CMetrics& metrics, size_t minThreads, unsigned int intervalMs)
+		: m_jobSystem{ jobSystem }
+		, m_metrics{ metrics }
+		, m_minThreads{ std::min(std::max<size_t>(minThreads, 1), jobSystem.NumThreads()) }
+		, m_maxThreads{ jobSystem.NumThreads() }
+		, m_step{ std::max<size_t>(jobSystem.NumThreads() / 16, 1) }
+		, m_intervalMs{ std::max(intervalMs, 100u) }
+	{
+		std::string name("AutotuneThread");
+		m_thread.reset(new CThread(name));
+		m_thread->Start([this]() { this->Main(); });
+	}
+
+	~CAutotune()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_terminate = true;
+		}
+		m_wake.notify_one();
+		m_thread->Join();
+	}
+
+private:
+	static const uint64_t MIN_FILES = 8;		// files to complete before a sample is trusted; otherwise it's extended
+	static const unsigned int MAX_INTERVALS = 8;	// ...for up to this many intervals (huge files complete slowly)
+
+	// Rate changes within this fraction are noise
+	static double Tolerance() { return 0.05; }
+	// The time per file rising by more than this fraction alongside a falling rate means the device is saturated
+	static double LatencyTolerance() { return 0.25; }
+
+	struct SSample
+	{
+		uint64_t m_bytes = 0;
+		uint64_t m_files = 0;
+		uint64_t m_microseconds = 0;
+		CMetrics::Clock::time_point m_time;
+	};
+
+	void Main()
+	{
+		LOG_VERBOSE("[%d] CAutotune::Main() starting", std::this_thread::get_id());
+		SSample start = Sample();
+		unsigned int intervals = 0;
+		bool busy = false;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_wake.wait_for(lock, std::chrono::milliseconds(m_intervalMs), [this]() { return m_terminate; }))
+		{
+			lock.unlock();
+			// Only a pool that's had more work than workers says anything about the thread count; if the manifest reader
+			// or the retry timers can't keep the workers busy, more threads wouldn't have helped
+			busy = busy || (m_jobSystem.JobCount() > 0) || (m_jobSystem.JobsRunning() >= m_jobSystem.ActiveThreads());
+			SSample end = Sample();
+			uint64_t files = end.m_files - start.m_files;
+			if ((files >= MIN_FILES) || (++intervals >= MAX_INTERVALS))
+			{
+				if (busy && (files > 0))
+				{
+					double seconds = std::max(std::chrono::duration<double>(end.m_time - start.m_time).count(), 1e-3);
+					Adjust((end.m_bytes - start.m_bytes) / seconds, static_cast<double>(end.m_microseconds - start.m_microseconds) / files);
+				}
+				start = end;
+				intervals = 0;
+				busy = false;
+			}
+			lock.lock();
+		}
+	}
+
+	SSample Sample()
+	{
+		SSample sample;
+		m_metrics.Progress(sample.m_bytes, sample.m_files, sample.m_microseconds);
+		sample.m_time = CMetrics::Clock::now();
+		return sample;
+	}
+
+	void Adjust(double rate, double latency)
+	{
+		size_t threads = m_jobSystem.ActiveThreads();
+		size_t target = threads;
+		const char* reason = "";
+		if (m_previousRate <= 0.0)
+		{
+			target = threads + m_step;
+			reason = "probing";
+		}
+		else if (rate > m_previousRate * (1.0 + Tolerance()))
+		{
+			// The last move helped; keep going the same way
+			target = (m_direction > 0) ? threads + m_step : threads - std::min(threads, m_step);
+			reason = (m_direction > 0) ? "rate rose with more threads" : "rate rose with fewer threads";
+		}
+		else if (rate < m_previousRate * (1.0 - Tolerance()))
+		{
+			if ((m_direction > 0) && (latency > m_previousLatency * (1.0 + LatencyTolerance())))
+			{
+				target = std::min(threads - std::min(threads, m_step), (threads * 3) / 4);
+				m_direction = -1;
+				reason = "device saturated, backing off";
+			}
+			else
+			{
+				m_direction = -m_direction;
+				target = (m_direction > 0) ? threads + m_step : threads - std::min(threads, m_step);
+				reason = "rate fell, reversing";
+			}
+		}
+		else if (m_direction > 0)
+		{
+			// The extra threads bought nothing, so give them back
+			m_direction = -1;
+			target = threads - std::min(threads, m_step);
+			reason = "no gain from more threads";
+		}
+		else
+		{
+			// Fewer threads did as well; keep shedding them until the rate drops, then the reversal above climbs back
+			target = threads - std::min(threads, m_step);
+			reason = "no loss from fewer threads";
+		}
+
+		target = std::min(std::max(target, m_minThreads), m_maxThreads);
+		if ((target == threads) && (m_previousRate > 0.0))
+		{
+			// Pinned at a limit, so probe back the other way next time rather than sitting against it
+			m_direction = (threads >= m_maxThreads) ? -1 : 1;
+		}
+		else if (target != threads)
+		{
+			m_direction = (target > threads) ? 1 : -1;
+			m_jobSystem.SetActiveThreads(target);
+		}
+
+		LOG_INFORMATION("Autotune: [%.1f]MB/s, [%.0f]us per file with [%d] threads (was [%.1f]MB/s, [%.0f]us); %s: [%d] threads", rate / (1024 * 1024), latency, threads, m_previousRate / (1024 * 1024), m_previousLatency, reason, target);
+		m_previousRate = rate;
+		m_previousLatency = latency;
+	}
+
+	CJobSystem& m_jobSystem;
+	CMetrics& m_metrics;
+	const size_t m_minThreads;
+	const size_t m_maxThreads;
+	const size_t m_step;
+	const unsigned int m_intervalMs;
+	double m_previousRate = 0.0;
+	double m_previousLatency = 0.0;
+	int m_direction = 1;
+	std::unique_ptr<CThread> m_thread;
+	bool m_terminate = false;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+};
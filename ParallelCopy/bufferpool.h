@@ -0,0 +1,206 @@
+#pragma once
+
+// Preallocated arena of I/O buffers aligned for unbuffered I/O (O_DIRECT / FILE_FLAG_NO_BUFFERING), optionally backed by
+// huge pages.  Each entry is a pair of buffers, so a copy can be reading into one while the other is being written, and
+// a worker never needs more than one entry at a time.  Entries are handed out from a lock-free free list so workers never
+// allocate (or take a lock) per file.
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "log.h"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif // !defined(_WIN32)
+
+class CBufferPool
+{
+public:
+	// Covers the logical block size of everything we're likely to meet, including 4K sector drives
+	static const size_t ALIGNMENT = 4096;
+	static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	// count entries of two bufferSize buffers each; bufferSize is rounded up to the alignment (or to a huge page)
+	CBufferPool(size_t bufferSize, size_t count, bool hugePages)
+		: m_count{ std::max<size_t>(count, 1) }
+	{
+		size_t granularity = hugePages ? static_cast<size_t>(HUGE_PAGE_SIZE) : static_cast<size_t>(ALIGNMENT);
+		m_bufferSize = ((std::max<size_t>(bufferSize, 1) + granularity - 1) / granularity) * granularity;
+		m_size = m_count * 2 * m_bufferSize;
+
+		// Memory is only committed as entries are first used, so a generous count costs nothing until it's needed
+#if defined(_WIN32)
+		if (hugePages)
+		{
+			// Needs SeLockMemoryPrivilege, which most accounts don't have
+			size_t large = GetLargePageMinimum();
+			if ((large > 0) && ((m_bufferSize % large) == 0))
+			{
+				m_arena = static_cast<char*>(VirtualAlloc(nullptr, m_size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE));
+			}
+			m_hugePages = (m_arena != nullptr);
+		}
+		if (m_arena == nullptr)
+		{
+			m_arena = static_cast<char*>(VirtualAlloc(nullptr, m_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+		}
+#else
+		void* arena = MAP_FAILED;
+		if (hugePages)
+		{
+			// Explicit huge pages have to have been reserved (vm.nr_hugepages); failing that, ask for transparent ones
+			arena = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			m_hugePages = (arena != MAP_FAILED);
+		}
+		if (arena == MAP_FAILED)
+		{
+			arena = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if ((arena != MAP_FAILED) && hugePages)
+			{
+				madvise(arena, m_size, MADV_HUGEPAGE);
+			}
+		}
+		m_arena = (arena != MAP_FAILED) ? static_cast<char*>(arena) : nullptr;
+#endif // defined(_WIN32)
+
+		if (m_arena == nullptr)
+		{
+			LOG_ERROR("Unable to allocate [%llu] bytes of I/O buffers", static_cast<unsigned long long>(m_size));
+			return;
+		}
+
+		if (hugePages && !m_hugePages)
+		{
+#if defined(_WIN32)
+			LOG_WARNING("Large pages aren't available for the I/O buffers (needs SeLockMemoryPrivilege); using normal pages");
+#else
+			LOG_WARNING("Huge pages aren't available for the I/O buffers (see vm.nr_hugepages); using transparent huge pages if enabled");
+#endif // defined(_WIN32)
+		}
+
+		// Every entry starts on the free list, linked in order
+		m_next.reset(new std::atomic<uint32_t>[m_count]);
+		for (size_t entry = 0; entry < m_count; ++entry)
+		{
+			m_next[entry] = static_cast<uint32_t>(entry + 2 <= m_count ? entry + 2 : 0);
+		}
+		m_head = 1;
+	}
+
+	~CBufferPool()
+	{
+		if (m_arena != nullptr)
+		{
+#if defined(_WIN32)
+			VirtualFree(m_arena, 0, MEM_RELEASE);
+#else
+			munmap(m_arena, m_size);
+#endif // defined(_WIN32)
+		}
+	}
+
+	inline bool IsOpen() const
+	{
+		return m_arena != nullptr;
+	}
+
+	inline size_t BufferSize() const
+	{
+		return m_bufferSize;
+	}
+
+	inline bool HugePages() const
+	{
+		return m_hugePages;
+	}
+
+	// Takes an entry (2 * BufferSize() bytes), waiting for one to be released if they're all in use
+	char* Acquire()
+	{
+		uint32_t entry;
+		while ((entry = Pop()) == 0)
+		{
+			if (m_waits++ == 0)
+			{
+				LOG_WARNING("All [%d] I/O buffers are in use; waiting for one to be released", m_count);
+			}
+			std::this_thread::yield();
+		}
+		return m_arena + ((entry - 1) * 2 * m_bufferSize);
+	}
+
+	void Release(char* buffers)
+	{
+		Push(static_cast<uint32_t>((buffers - m_arena) / (2 * m_bufferSize)) + 1);
+	}
+
+	// Holds an entry for as long as it's in scope
+	class CLease
+	{
+	public:
+		CLease(CBufferPool& pool) : m_pool(pool), m_buffers{ pool.Acquire() } {}
+		~CLease() { m_pool.Release(m_buffers); }
+
+		inline char* Buffer(int index) const { return m_buffers + (index * m_pool.BufferSize()); }
+
+	private:
+		CLease(const CLease&) = delete;
+		CLease& operator=(const CLease&) = delete;
+
+		CBufferPool& m_pool;
+		char* const m_buffers;
+	};
+
+	void Report()
+	{
+		LOG_INFORMATION("[%d] pairs of [%d]KB I/O buffers%s; waited for one [%llu] times", m_count, m_bufferSize / 1024, m_hugePages ? " in huge pages" : "", static_cast<unsigned long long>(m_waits.load()));
+	}
+
+private:
+	// Treiber stack of 1 based entry numbers (0 is the end of the list).  The head carries a count of the changes made to it
+	// in its top 32 bits, so a pop that was overtaken by a pop and push of the same entry (ABA) fails its exchange.
+	uint32_t Pop()
+	{
+		uint64_t head = m_head.load(std::memory_order_acquire);
+		while (true)
+		{
+			uint32_t entry = static_cast<uint32_t>(head);
+			if (entry == 0)
+			{
+				return 0;
+			}
+
+			uint64_t next = ((head >> 32) + 1) << 32 | m_next[entry - 1].load(std::memory_order_relaxed);
+			if (m_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+			{
+				return entry;
+			}
+		}
+	}
+
+	void Push(uint32_t entry)
+	{
+		uint64_t head = m_head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			m_next[entry - 1].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+			uint64_t next = ((head >> 32) + 1) << 32 | entry;
+			if (m_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed))
+			{
+				return;
+			}
+		}
+	}
+
+	const size_t m_count;
+	size_t m_bufferSize = 0;
+	size_t m_size = 0;
+	char* m_arena = nullptr;
+	bool m_hugePages = false;
+	std::unique_ptr<std::atomic<uint32_t>[]> m_next;
+	std::atomic<uint64_t> m_head{ 0 };
+	std::atomic<uint64_t> m_waits{ 0 };
+};
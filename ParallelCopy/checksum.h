@@ -0,0 +1,385 @@
+#pragma once
+
+// CRC32C (Castagnoli) of file data, computed as it streams through the copy buffers so verifying a copy only costs
+// re-reading the destination.  Uses the SSE4.2 crc32 instruction where the CPU has it, running three independent
+// streams to hide its latency, and a slicing-by-8 table otherwise.  Checksums of ranges copied separately can be
+// combined into the checksum of the whole file.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "log.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif // defined(_MSC_VER)
+#endif // defined(__x86_64__) || defined(_M_X64)
+
+class CCrc32c
+{
+public:
+	typedef uint32_t(*Function)(uint32_t crc, const void* data, size_t length);
+
+	// Continues crc (0 to start) over data; crc(A + B) == Update(Update(0, A), B)
+	static uint32_t Update(uint32_t crc, const void* data, size_t length)
+	{
+		static const Function update = HardwareSupported() ? UpdateHardware : UpdateScalar;
+		return update(crc, data, length);
+	}
+
+	// crc(A + B) from crc(A), crc(B) and the length of B
+	static uint32_t Combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+	{
+		return MultiplyModP(Tables().Power(length2), crc1) ^ crc2;
+	}
+
+	// Continues crc over length zero bytes without reading any (e.g. the holes of a sparse file), by combining the crcs of
+	// runs of 2^n zeros
+	static uint32_t UpdateZeros(uint32_t crc, uint64_t length)
+	{
+		static const unsigned char zero = 0;
+		uint32_t zeros = 0;
+		uint32_t run = Update(0, &zero, 1);
+		for (uint64_t bit = 1; (bit != 0) && (bit <= length); bit <<= 1)
+		{
+			if ((length & bit) != 0)
+			{
+				zeros = Combine(zeros, run, bit);
+			}
+			run = Combine(run, run, bit);
+		}
+		return Combine(crc, zeros, length);
+	}
+
+	static bool HardwareSupported()
+	{
+#if defined(CRC32C_HARDWARE)
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		return __builtin_cpu_supports("sse4.2") != 0;
+#endif // defined(_MSC_VER)
+#else
+		return false;
+#endif // defined(CRC32C_HARDWARE)
+	}
+
+	static uint32_t UpdateScalar(uint32_t crc, const void* data, size_t length)
+	{
+		const STables& tables = Tables();
+		const unsigned char* next = static_cast<const unsigned char*>(data);
+		uint32_t state = ~crc;
+		while ((length > 0) && ((reinterpret_cast<uintptr_t>(next) & 7) != 0))
+		{
+			state = tables.m_slice[0][(state ^ *next++) & 0xFF] ^ (state >> 8);
+			--length;
+		}
+
+		for (; length >= 8; next += 8, length -= 8)
+		{
+			uint32_t low;
+			uint32_t high;
+			memcpy(&low, next, sizeof(low));
+			memcpy(&high, next + 4, sizeof(high));
+			low ^= state; // little endian
+			state = tables.m_slice[7][low & 0xFF] ^ tables.m_slice[6][(low >> 8) & 0xFF] ^ tables.m_slice[5][(low >> 16) & 0xFF] ^ tables.m_slice[4][low >> 24] ^
+				tables.m_slice[3][high & 0xFF] ^ tables.m_slice[2][(high >> 8) & 0xFF] ^ tables.m_slice[1][(high >> 16) & 0xFF] ^ tables.m_slice[0][high >> 24];
+		}
+
+		while (length-- > 0)
+		{
+			state = tables.m_slice[0][(state ^ *next++) & 0xFF] ^ (state >> 8);
+		}
+		return ~state;
+	}
+
+#if defined(CRC32C_HARDWARE)
+	CRC32C_TARGET static uint32_t UpdateHardware(uint32_t crc, const void* data, size_t length)
+	{
+		const STables& tables = Tables();
+		const unsigned char* next = static_cast<const unsigned char*>(data);
+		uint64_t state0 = ~crc & 0xFFFFFFFF;
+		while ((length > 0) && ((reinterpret_cast<uintptr_t>(next) & 7) != 0))
+		{
+			state0 = _mm_crc32_u8(static_cast<uint32_t>(state0), *next++);
+			--length;
+		}
+
+		// crc32 has a latency of 3 cycles but a throughput of 1, so run three streams over adjacent blocks and fold them
+		// together by shifting the earlier ones past the blocks that follow them
+		static const size_t blockSizes[] = { LONG_BLOCK, SHORT_BLOCK };
+		for (size_t size = 0; size < 2; ++size)
+		{
+			const size_t blockSize = blockSizes[size];
+			const uint32_t(*shift)[256] = (size == 0) ? tables.m_long : tables.m_short;
+			for (; length >= 3 * blockSize; next += 3 * blockSize, length -= 3 * blockSize)
+			{
+				uint64_t state1 = 0;
+				uint64_t state2 = 0;
+				for (size_t offset = 0; offset < blockSize; offset += 8)
+				{
+					state0 = _mm_crc32_u64(state0, Load(next + offset));
+					state1 = _mm_crc32_u64(state1, Load(next + blockSize + offset));
+					state2 = _mm_crc32_u64(state2, Load(next + 2 * blockSize + offset));
+				}
+				state0 = Shift(shift, static_cast<uint32_t>(state0)) ^ state1;
+				state0 = Shift(shift, static_cast<uint32_t>(state0)) ^ state2;
+			}
+		}
+
+		for (; length >= 8; next += 8, length -= 8)
+		{
+			state0 = _mm_crc32_u64(state0, Load(next));
+		}
+		while (length-- > 0)
+		{
+			state0 = _mm_crc32_u8(static_cast<uint32_t>(state0), *next++);
+		}
+		return ~static_cast<uint32_t>(state0);
+	}
+#else
+	static uint32_t UpdateHardware(uint32_t crc, const void* data, size_t length)
+	{
+		return UpdateScalar(crc, data, length);
+	}
+#endif // defined(CRC32C_HARDWARE)
+
+	// Checks Combine() and UpdateZeros() against running Update() over that many zeros, at lengths either side of 2^29
+	// bytes (2^32 bits), where a power table that wraps goes wrong
+	static bool SelfTest()
+	{
+		static const uint64_t lengths[] = { 1, 4096, 1024 * 1024 + 1, 1ULL << 29, (1ULL << 29) + 1000, 768ULL * 1024 * 1024 };
+		static const char check[] = "123456789";
+		const uint32_t start = Update(0, check, 9);
+		std::vector<unsigned char> zeros(1024 * 1024, 0);
+		uint32_t expected = start;
+		uint32_t zerosOnly = 0;
+		uint64_t done = 0;
+		bool ok = (start == 0xE3069283);
+		for (uint64_t length : lengths)
+		{
+			for (; done < length; )
+			{
+				size_t size = static_cast<size_t>(std::min<uint64_t>(zeros.size(), length - done));
+				expected = Update(expected, zeros.data(), size);
+				zerosOnly = Update(zerosOnly, zeros.data(), size);
+				done += size;
+			}
+
+			uint32_t combined = Combine(start, zerosOnly, length);
+			uint32_t skipped = UpdateZeros(start, length);
+			if ((combined != expected) || (skipped != expected))
+			{
+				LOG_ERROR("crc32c over [%llu] zeros: combined %08x, skipped %08x, expected %08x", length, combined, skipped, expected);
+				ok = false;
+			}
+		}
+		return ok;
+	}
+
+	// Throughput of each implementation over a cached buffer, in GB/s
+	static void Benchmark()
+	{
+		static const char check[] = "123456789";
+		LOG_INFORMATION("crc32c(\"%s\") = %08x scalar, %08x hardware (expected e3069283)", check, UpdateScalar(0, check, 9), UpdateHardware(0, check, 9));
+		LOG_INFORMATION("crc32c combining and skipping zeros: %s", SelfTest() ? "ok" : "FAILED");
+
+		static const size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+		std::vector<unsigned char> buffer(sizes[3]);
+		uint32_t seed = 0x12345678;
+		for (unsigned char& byte : buffer)
+		{
+			seed = seed * 1103515245 + 12345;
+			byte = static_cast<unsigned char>(seed >> 16);
+		}
+
+		for (size_t size : sizes)
+		{
+			double scalar = Throughput(UpdateScalar, buffer.data(), size);
+			double hardware = Throughput(UpdateHardware, buffer.data(), size);
+			LOG_INFORMATION("crc32c over [%d]KB buffers: scalar [%.2f]GB/s, %s [%.2f]GB/s (x%.1f)", size / 1024, scalar, HardwareSupported() ? "sse4.2" : "scalar (no sse4.2)", hardware, hardware / scalar);
+		}
+	}
+
+private:
+	static const uint32_t POLY = 0x82F63B78; // reflected
+	static const size_t LONG_BLOCK = 8192;
+	static const size_t SHORT_BLOCK = 256;
+
+	struct STables
+	{
+		STables()
+		{
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				uint32_t crc = n;
+				for (int bit = 0; bit < 8; ++bit)
+				{
+					crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+				}
+				m_slice[0][n] = crc;
+			}
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				for (int slice = 1; slice < 8; ++slice)
+				{
+					m_slice[slice][n] = (m_slice[slice - 1][n] >> 8) ^ m_slice[0][m_slice[slice - 1][n] & 0xFF];
+				}
+			}
+
+			for (uint32_t n = 0; n < POWERS; ++n)
+			{
+				m_powers[n] = (n == 0) ? (1u << 30) : MultiplyModP(m_powers[n - 1], m_powers[n - 1]); // x^(2^n)
+			}
+			ShiftTable(m_long, LONG_BLOCK);
+			ShiftTable(m_short, SHORT_BLOCK);
+		}
+
+		// x^(8 * bytes) modulo the polynomial; multiplying a crc by it is the same as running the crc over that many zeros
+		uint32_t Power(uint64_t bytes) const
+		{
+			uint32_t power = 1u << 31;
+			for (uint32_t k = 3; bytes != 0; bytes >>= 1, ++k)
+			{
+				if (bytes & 1)
+				{
+					power = MultiplyModP(m_powers[k], power);
+				}
+			}
+			return power;
+		}
+
+		// The same multiplication a byte of the crc at a time
+		void ShiftTable(uint32_t(&table)[4][256], size_t bytes)
+		{
+			uint32_t power = Power(bytes);
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				for (uint32_t byte = 0; byte < 4; ++byte)
+				{
+					table[byte][n] = MultiplyModP(power, n << (8 * byte));
+				}
+			}
+		}
+
+		uint32_t m_slice[8][256];
+		// x^(2^n) for every bit of a length in bits; unlike zlib's crc32, CRC32C's powers don't repeat every 32
+		static const uint32_t POWERS = 64 + 3;
+		uint32_t m_powers[POWERS];
+		uint32_t m_long[4][256];
+		uint32_t m_short[4][256];
+	};
+
+	static const STables& Tables()
+	{
+		static const STables tables;
+		return tables;
+	}
+
+	// a * b modulo the polynomial, in the reflected bit order
+	static uint32_t MultiplyModP(uint32_t a, uint32_t b)
+	{
+		uint32_t product = 0;
+		for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1)
+		{
+			if (a & bit)
+			{
+				product ^= b;
+				if ((a & (bit - 1)) == 0)
+				{
+					break;
+				}
+			}
+			b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+		}
+		return product;
+	}
+
+	static inline uint32_t Shift(const uint32_t(*table)[256], uint32_t crc)
+	{
+		return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+	}
+
+	static inline uint64_t Load(const unsigned char* data)
+	{
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	static double Throughput(Function function, const unsigned char* data, size_t size)
+	{
+		static const uint64_t BYTES = 1024ULL * 1024 * 1024;
+		volatile uint32_t crc = 0;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (uint64_t done = 0; done < BYTES; done += size)
+		{
+			crc = function(crc, data, size);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		return (BYTES / seconds) / 1e9;
+	}
+};
+
+// The '<manifest>.crc32c' sidecar listing the checksum of every destination verified, one '<crc32c>  <destination>'
+// line each, in completion order
+class CChecksumManifest
+{
+public:
+	CChecksumManifest(const char* manifest)
+		: m_name{ std::string(manifest) + ".crc32c" }
+	{
+	}
+
+	~CChecksumManifest()
+	{
+		if (m_file != nullptr)
+		{
+			fclose(m_file);
+		}
+	}
+
+	// A resumed run appends, so the sidecar still covers the files the earlier run copied
+	bool Open(bool append)
+	{
+		m_file = fopen(m_name.c_str(), append ? "ab" : "wb");
+		if (m_file == nullptr)
+		{
+			LOG_ERROR("Unable to open checksum manifest [%s]", m_name.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	inline const char* Name() const
+	{
+		return m_name.c_str();
+	}
+
+	void Add(const std::string& destination, uint32_t checksum)
+	{
+		if (m_file != nullptr)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			fprintf(m_file, "%08x  %s\n", checksum, destination.c_str());
+		}
+	}
+
+private:
+	const std::string m_name;
+	std::mutex m_mutex;
+	FILE* m_file = nullptr;
+};
@@ -0,0 +1,1957 @@
+#pragma once
+
+// Copy backends: the platform specific parts of copying a single file (creating the destination directory and moving the data)
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "bufferpool.h"
+#include "checksum.h"
+#include "directorycache.h"
+#include "log.h"
+#include "metrics.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "uring.h"
+#endif // !defined(_WIN32)
+
+class CCopyBackend
+{
+public:
+	// The path a file took through the backend, fastest first
+	enum ECopyMethod : char
+	{
+		eCM_REFLINK,					// FICLONE; destination shares the source extents, no data is copied
+		eCM_COPY_FILE_RANGE,	// in-kernel copy; may be offloaded to the filesystem or server
+		eCM_SENDFILE,					// in-kernel copy through the page cache
+		eCM_BUFFERED,					// userspace read/write loop
+		eCM_DIRECT,						// userspace read/write loop through pooled buffers, bypassing the page cache
+		eCM_SPARSE,						// only the source's data extents (SEEK_DATA/SEEK_HOLE), leaving its holes as holes
+		eCM_COPYFILEEX,				// CopyFileEx(); the method is chosen by Windows
+		eCM_CHUNKED,					// split into ranges copied by several workers at once
+		eCM_IO_URING,					// read/write pairs queued on an io_uring by CUringCopyEngine
+		eCM_DELTA,						// only the blocks that differ from the existing destination were rewritten
+		eCM_HARDLINK,					// --dedupe; a second name for an identical file already copied
+		eCM_DEDUPE_REFLINK,		// --dedupe; FICLONE from an identical file already copied
+		eCM_COUNT,
+	};
+
+	// How an existing destination compares with its source, for incremental copies
+	enum EDifference : char
+	{
+		eD_SAME,			// same size and modification time; nothing to do
+		eD_DIFFERENT,	// exists but has changed
+		eD_MISSING,		// no destination yet
+		eD_ERROR,			// couldn't stat the source; copy anyway and let that report the error
+	};
+
+	// How --dedupe makes a duplicate share the data of an identical file already copied
+	enum ELink : char
+	{
+		eL_HARDLINK,	// the same file under a second name, attributes and all
+		eL_REFLINK,		// a file of its own sharing the other's extents (copy on write), on filesystems that can
+	};
+
+	// Whether copies are checked by re-reading the destination
+	enum EVerify : char
+	{
+		eV_NONE,
+		eV_CACHED,	// re-read through the page cache, which catches anything that went wrong on the way there
+		eV_DIRECT,	// re-read bypassing the cache, from what actually reached the disk
+	};
+
+	// The error a copy fails with when its destination doesn't read back the same as the data written to it
+#if defined(_WIN32)
+	static const int VERIFY_ERROR = ERROR_CRC;
+#else
+	static const int VERIFY_ERROR = EBADMSG;
+#endif // defined(_WIN32)
+
+	CCopyBackend()
+	{
+		for (std::atomic_size_t& count : m_methodCount)
+		{
+			count = 0;
+		}
+	}
+
+	virtual ~CCopyBackend() {}
+
+	// Returns the default backend for the platform we're built for
+	static std::unique_ptr<CCopyBackend> Create();
+
+	virtual const char* Name() const = 0;
+
+	// Ensure the directory that will contain destination exists
+	virtual bool CreateParentDirectory(const std::string& destination) = 0;
+
+	// Copy source to destination, recording which method was used; on failure error holds the platform error code
+	bool Copy(const std::string& source, const std::string& destination, int& error)
+	{
+		ECopyMethod method = eCM_COUNT;
+		uint64_t size = 0;
+		uint32_t checksum = 0;
+		uint64_t holes = 0;
+		error = 0;
+		if (DoCopy(source, destination, method, size, holes, checksum, error) && ((m_verify == eV_NONE) || Verify(destination, size, checksum, error)))
+		{
+			LOG_DEBUG("Copied [%s] to [%s] using [%s]", source.c_str(), destination.c_str(), MethodToString(method));
+			RecordCopied(method, size);
+			if (holes > 0)
+			{
+				RecordSparse(holes);
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	// Size and modification time check, as used by incremental runs to skip files that are already up to date; size is
+	// the source size whenever it could be read
+	virtual EDifference Compare(const std::string& source, const std::string& destination, uint64_t& size) = 0;
+
+	// Brings an existing destination up to date by rewriting only the blocks that differ from source.  Returns false
+	// with error == 0 if the backend can't do that, in which case the file should be copied whole.
+	bool Update(const std::string& source, const std::string& destination, int& error)
+	{
+		uint64_t written = 0;
+		uint64_t size = 0;
+		uint32_t checksum = 0;
+		error = 0;
+		if (DoUpdate(source, destination, written, size, checksum, error) && ((m_verify == eV_NONE) || Verify(destination, size, checksum, error)))
+		{
+			LOG_DEBUG("Updated [%s] from [%s], rewriting [%llu] of [%llu] bytes", destination.c_str(), source.c_str(), written, size);
+			RecordCopied(eCM_DELTA, written);
+			m_bytesSkipped += size - written;
+			return true;
+		}
+
+		return false;
+	}
+
+	// Makes destination a link to target, an already copied file identical to source (checksum and size being the crc32c
+	// and length of both), instead of copying source again.  On failure the file should be copied as usual.
+	bool Link(const std::string& source, const std::string& target, const std::string& destination, ELink link, uint32_t checksum, uint64_t size, int& error)
+	{
+		error = 0;
+		if (DoLink(source, target, destination, link, error))
+		{
+			ECopyMethod method = (link == eL_HARDLINK) ? eCM_HARDLINK : eCM_DEDUPE_REFLINK;
+			LOG_DEBUG("Linked [%s] to [%s] (a duplicate of [%s], [%llu] bytes) using [%s]", destination.c_str(), target.c_str(), source.c_str(), size, MethodToString(method));
+			RecordCopied(method, 0);
+			if ((m_verify != eV_NONE) && (m_checksums != nullptr))
+			{
+				m_checksums->Add(destination, checksum); // compared byte for byte with the source on the way
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	// Length of path, without opening it
+	virtual bool Size(const std::string& path, uint64_t& size) = 0;
+
+	// crc32c and length of the whole of path
+	inline bool Checksum(const std::string& path, uint32_t& checksum, uint64_t& size, int& error)
+	{
+		return ReadChecksum(path, false, checksum, size, error);
+	}
+
+	// Byte for byte comparison of two files
+	virtual bool Identical(const std::string& path1, const std::string& path2) = 0;
+
+	// Removes destination if it's one of several hardlinks to the same file (left by an earlier --dedupe run), so
+	// overwriting it can't change the others
+	virtual void Detach(const std::string& destination) = 0;
+
+	inline void RecordCopied(ECopyMethod method, uint64_t bytes)
+	{
+		++m_methodCount[method];
+		m_bytesCopied += bytes;
+		g_metrics.Copied(bytes);
+	}
+
+	// A sparse file of which holes bytes weren't transferred (the file's size is counted by RecordCopied())
+	inline void RecordSparse(uint64_t holes)
+	{
+		++m_filesSparse;
+		m_bytesHoles += holes;
+	}
+
+	inline void RecordSkipped(uint64_t bytes)
+	{
+		++m_filesSkipped;
+		m_bytesSkipped += bytes;
+		g_metrics.Skipped();
+	}
+
+	inline size_t FilesSkipped() const
+	{
+		return m_filesSkipped;
+	}
+
+	// With verification on, every copy checksums the data as it goes through (so the zero-copy paths are passed over)
+	// and then re-reads the destination to check it; checksums that match are written to the checksum manifest
+	void SetVerify(EVerify verify, CChecksumManifest* checksums)
+	{
+		m_verify = verify;
+		m_checksums = checksums;
+	}
+
+	inline EVerify Verifying() const
+	{
+		return m_verify;
+	}
+
+	// With buffers, data is copied with unbuffered I/O (O_DIRECT / FILE_FLAG_NO_BUFFERING) through them, so a bulk copy
+	// doesn't evict everything else from the page cache; where a filesystem can't do that, what the copy cached is dropped
+	// after it
+	void SetDirect(CBufferPool* buffers)
+	{
+		m_buffers = buffers;
+	}
+
+	inline CBufferPool* DirectBuffers() const
+	{
+		return m_buffers;
+	}
+
+	// Checks destination reads back with checksum, the checksum of the size bytes written to it.  A destination that
+	// doesn't is removed, so a later incremental run can't mistake it for being up to date, and error is VERIFY_ERROR.
+	bool Verify(const std::string& destination, uint64_t size, uint32_t checksum, int& error)
+	{
+		uint32_t actual = 0;
+		uint64_t read = 0;
+		if (!ReadChecksum(destination, m_verify == eV_DIRECT, actual, read, error))
+		{
+			LOG_WARNING("Unable to read back [%s] to verify it: error 0x%08X", destination.c_str(), error);
+			return false;
+		}
+
+		if ((actual != checksum) || (read != size))
+		{
+			LOG_WARNING("[%s] doesn't match what was written to it: crc32c [%08x] over [%llu] bytes, expected [%08x] over [%llu]", destination.c_str(), actual, read, checksum, size);
+			++m_verifyFailures;
+			remove(destination.c_str());
+			error = VERIFY_ERROR;
+			return false;
+		}
+
+		++m_filesVerified;
+		m_bytesVerified += size;
+		if (m_checksums != nullptr)
+		{
+			m_checksums->Add(destination, checksum);
+		}
+		return true;
+	}
+
+	// A single large file being copied as a set of ranges, so that several workers can share it
+	class CRangeCopy
+	{
+	public:
+		CRangeCopy(const std::string& source, const std::string& destination, uint64_t size)
+			: m_source{ source }
+			, m_destination{ destination }
+			, m_size{ size }
+			, m_opened{ CMetrics::Clock::now() }
+		{
+		}
+
+		virtual ~CRangeCopy() {}
+
+		inline const std::string& Source() const { return m_source; }
+		inline const std::string& Destination() const { return m_destination; }
+		inline uint64_t Size() const { return m_size; }
+
+		// True if the backend managed to share the source extents when opening, in which case there's nothing to copy
+		inline bool Cloned() const { return m_cloned; }
+
+		// Copy [offset, offset + length); may be called concurrently for disjoint ranges
+		virtual bool CopyRange(uint64_t offset, uint64_t length, int& error) = 0;
+
+		// Checksum of the whole file from those of its ranges, once they've all been copied
+		uint32_t Checksum()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::sort(m_checksums.begin(), m_checksums.end(), [](const SChecksum& a, const SChecksum& b) { return a.m_offset < b.m_offset; });
+			uint32_t checksum = 0;
+			for (const SChecksum& range : m_checksums)
+			{
+				checksum = CCrc32c::Combine(checksum, range.m_checksum, range.m_length);
+			}
+			return checksum;
+		}
+
+	protected:
+		friend class CCopyBackend;
+
+		struct SChecksum
+		{
+			uint64_t m_offset;
+			uint64_t m_length;
+			uint32_t m_checksum;
+		};
+
+		void AddChecksum(uint64_t offset, uint64_t length, uint32_t checksum)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_checksums.push_back(SChecksum{ offset, length, checksum });
+		}
+
+		// Apply the source attributes and close both files; removes the destination if success is false
+		virtual bool Finish(bool success, int& error) = 0;
+
+		const std::string m_source;
+		const std::string m_destination;
+		const uint64_t m_size;
+		const CMetrics::Clock::time_point m_opened;
+		bool m_cloned = false;
+		std::atomic<uint64_t> m_holes{ 0 }; // of a sparse file, skipped by the ranges
+		std::mutex m_mutex;
+		std::vector<SChecksum> m_checksums;
+	};
+
+	// Opens source and a preallocated destination for copying as ranges.  Returns nullptr if the source is smaller than
+	// threshold, the backend can't copy ranges, or the files couldn't be opened; the file should then be copied whole.
+	virtual std::unique_ptr<CRangeCopy> OpenRanges(const std::string& source, const std::string& destination, uint64_t threshold)
+	{
+		return nullptr;
+	}
+
+	// Called once, after the last range has been copied (or has failed)
+	bool FinishRanges(CRangeCopy& ranges, bool success, int& error)
+	{
+		error = 0;
+		CMetrics::Clock::time_point finishing = CMetrics::Clock::now();
+		g_metrics.Latency(CMetrics::eP_COPY, ranges.Size(), finishing - ranges.m_opened);
+		bool finished = ranges.Finish(success, error);
+		g_metrics.Latency(CMetrics::eP_CLOSE, ranges.Size(), CMetrics::Clock::now() - finishing);
+		if (finished && success && ((m_verify == eV_NONE) || ranges.Cloned() || Verify(ranges.Destination(), ranges.Size(), ranges.Checksum(), error)))
+		{
+			ECopyMethod method = ranges.Cloned() ? eCM_REFLINK : eCM_CHUNKED;
+			LOG_DEBUG("Copied [%s] to [%s] using [%s]", ranges.Source().c_str(), ranges.Destination().c_str(), MethodToString(method));
+			RecordCopied(method, ranges.Size());
+			if (ranges.m_holes > 0)
+			{
+				RecordSparse(ranges.m_holes);
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	// Log how many files went through each method, so it's obvious when the fast paths are being missed
+	void Report()
+	{
+		size_t transferred = 0;
+		for (int method = 0; method < eCM_COUNT; ++method)
+		{
+			size_t count = m_methodCount[method];
+			if (count > 0)
+			{
+				LOG_INFORMATION("[%s] %d files copied using [%s]", Name(), count, MethodToString(static_cast<ECopyMethod>(method)));
+				transferred += count;
+			}
+		}
+
+		uint64_t bytesCopied = m_bytesCopied;
+		uint64_t bytesSkipped = m_bytesSkipped;
+		size_t skipped = m_filesSkipped;
+		LOG_INFORMATION("[%s] %d files (%llu bytes) transferred; %d files unchanged; %llu bytes skipped", Name(), transferred, bytesCopied, skipped, bytesSkipped);
+		size_t sparse = m_filesSparse;
+		if (sparse > 0)
+		{
+			uint64_t holes = m_bytesHoles;
+			LOG_INFORMATION("[%s] %llu logical bytes copied, %llu physically transferred; %d sparse files had %llu bytes of holes left as holes", Name(), bytesCopied, bytesCopied - holes, sparse, holes);
+		}
+		if (m_verify != eV_NONE)
+		{
+			size_t verified = m_filesVerified;
+			uint64_t bytesVerified = m_bytesVerified;
+			size_t failures = m_verifyFailures;
+			LOG_INFORMATION("[%s] %d files (%llu bytes) verified%s; %d didn't match", Name(), verified, bytesVerified, (m_verify == eV_DIRECT) ? " bypassing the cache" : "", failures);
+		}
+	}
+
+	static const char* MethodToString(ECopyMethod method)
+	{
+		const char* ret = nullptr;
+		switch (method)
+		{
+		case eCM_REFLINK:
+			ret = "reflink";
+			break;
+		case eCM_COPY_FILE_RANGE:
+			ret = "copy_file_range";
+			break;
+		case eCM_SENDFILE:
+			ret = "sendfile";
+			break;
+		case eCM_BUFFERED:
+			ret = "buffered";
+			break;
+		case eCM_DIRECT:
+			ret = "direct";
+			break;
+		case eCM_SPARSE:
+			ret = "sparse";
+			break;
+		case eCM_COPYFILEEX:
+			ret = "CopyFileEx";
+			break;
+		case eCM_CHUNKED:
+			ret = "chunked";
+			break;
+		case eCM_IO_URING:
+			ret = "io_uring";
+			break;
+		case eCM_DELTA:
+			ret = "delta";
+			break;
+		case eCM_HARDLINK:
+			ret = "hardlink to a duplicate";
+			break;
+		case eCM_DEDUPE_REFLINK:
+			ret = "reflink to a duplicate";
+			break;
+		default:
+			ret = "???";
+			break;
+		}
+		return ret;
+	}
+
+protected:
+	// size is the number of bytes the copy wrote, of which holes were left as holes rather than transferred; when
+	// verifying, checksum is the crc32c of them
+	virtual bool DoCopy(const std::string& source, const std::string& destination, ECopyMethod& method, uint64_t& size, uint64_t& holes, uint32_t& checksum, int& error) = 0;
+
+	virtual bool DoUpdate(const std::string& source, const std::string& destination, uint64_t& written, uint64_t& size, uint32_t& checksum, int& error)
+	{
+		return false;
+	}
+
+	virtual bool DoLink(const std::string& source, const std::string& target, const std::string& destination, ELink link, int& error) = 0;
+
+	// crc32c and length of the whole of path, optionally reading around the cache
+	virtual bool ReadChecksum(const std::string& path, bool direct, uint32_t& checksum, uint64_t& size, int& error) = 0;
+
+	// Filesystems differ in how finely they store timestamps; if either side has no sub-second part, only compare
+	// whole seconds
+	static bool SameTime(int64_t seconds1, uint32_t nanoseconds1, int64_t seconds2, uint32_t nanoseconds2)
+	{
+		return (seconds1 == seconds2) && ((nanoseconds1 == nanoseconds2) || (nanoseconds1 == 0) || (nanoseconds2 == 0));
+	}
+
+private:
+	std::atomic_size_t m_methodCount[eCM_COUNT];
+	std::atomic_size_t m_filesSkipped{ 0 };
+	std::atomic<uint64_t> m_bytesCopied{ 0 };
+	std::atomic<uint64_t> m_bytesSkipped{ 0 };
+	std::atomic_size_t m_filesSparse{ 0 };
+	std::atomic<uint64_t> m_bytesHoles{ 0 };
+	EVerify m_verify = eV_NONE;
+	CChecksumManifest* m_checksums = nullptr;
+	CBufferPool* m_buffers = nullptr;
+	std::atomic_size_t m_filesVerified{ 0 };
+	std::atomic<uint64_t> m_bytesVerified{ 0 };
+	std::atomic_size_t m_verifyFailures{ 0 };
+};
+
+#if defined(_WIN32)
+
+class CWindowsCopyBackend : public CCopyBackend
+{
+public:
+	virtual const char* Name() const override { return "Windows"; }
+
+	virtual bool CreateParentDirectory(const std::string& destination) override
+	{
+		std::string parent(destination, 0, destination.find_last_of("/\\"));
+		if (m_directories.Contains(parent))
+		{
+			return true;
+		}
+
+		size_t length = MultiByteToWideChar(CP_UTF8, 0, destination.c_str(), (int)destination.length(), nullptr, 0);
+		std::wstring path(length + 1, 0);
+		MultiByteToWideChar(CP_UTF8, 0, destination.c_str(), (int)destination.length(), &path[0], (int)path.length());
+		path[path.find_last_of(L"/\\")] = 0; // trim file from path
+
+		bool created = false;
+		switch (SHCreateDirectoryEx(NULL, path.c_str(), nullptr))
+		{
+		case ERROR_ALREADY_EXISTS:
+		case ERROR_FILE_EXISTS:
+		case ERROR_SUCCESS:
+			m_directories.Insert(parent);
+			created = true;
+			break;
+		case ERROR_BAD_PATHNAME:
+			LOG_ERROR("Bad pathname [%s]", parent.c_str());
+			break;
+		case ERROR_FILENAME_EXCED_RANGE:
+			LOG_ERROR("Pathname [%s] too long", parent.c_str());
+			break;
+		case ERROR_CANCELLED:
+			LOG_WARNING("User cancelled creating directory [%s]", parent.c_str());
+			break;
+		default:
+			LOG_INFORMATION("Failed to create parent directory for [%s]", destination.c_str());
+			break;
+		}
+
+		return created;
+	}
+
+	virtual EDifference Compare(const std::string& source, const std::string& destination, uint64_t& size) override
+	{
+		WIN32_FILE_ATTRIBUTE_DATA sourceInfo;
+		WIN32_FILE_ATTRIBUTE_DATA destinationInfo;
+		if (!GetFileAttributesExA(source.c_str(), GetFileExInfoStandard, &sourceInfo))
+		{
+			return eD_ERROR;
+		}
+
+		size = (static_cast<uint64_t>(sourceInfo.nFileSizeHigh) << 32) | sourceInfo.nFileSizeLow;
+		if (!GetFileAttributesExA(destination.c_str(), GetFileExInfoStandard, &destinationInfo))
+		{
+			return eD_MISSING;
+		}
+
+		bool same = (sourceInfo.nFileSizeHigh == destinationInfo.nFileSizeHigh) && (sourceInfo.nFileSizeLow == destinationInfo.nFileSizeLow) && (CompareFileTime(&sourceInfo.ftLastWriteTime, &destinationInfo.ftLastWriteTime) == 0);
+		return same ? eD_SAME : eD_DIFFERENT;
+	}
+
+	virtual bool Size(const std::string& path, uint64_t& size) override
+	{
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info))
+		{
+			return false;
+		}
+
+		size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		return true;
+	}
+
+	// Reads both a half buffer at a time
+	virtual bool Identical(const std::string& path1, const std::string& path2) override
+	{
+		HANDLE file1 = CreateFileA(path1.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		HANDLE file2 = CreateFileA(path2.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		bool identical = (file1 != INVALID_HANDLE_VALUE) && (file2 != INVALID_HANDLE_VALUE);
+		SBuffer& buffer = Buffer();
+		char* block1 = buffer.m_data;
+		char* block2 = buffer.m_data + (BUFFER_SIZE / 2);
+		while (identical)
+		{
+			DWORD read1 = 0;
+			DWORD read2 = 0;
+			identical = ReadFile(file1, block1, BUFFER_SIZE / 2, &read1, nullptr) && ReadFile(file2, block2, BUFFER_SIZE / 2, &read2, nullptr) && (read1 == read2) && (memcmp(block1, block2, read1) == 0);
+			if (read1 == 0)
+			{
+				break;
+			}
+		}
+
+		if (file1 != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file1);
+		}
+		if (file2 != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file2);
+		}
+		return identical;
+	}
+
+	virtual void Detach(const std::string& destination) override
+	{
+		HANDLE file = CreateFileA(destination.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+
+		BY_HANDLE_FILE_INFORMATION info;
+		bool linked = GetFileInformationByHandle(file, &info) && (info.nNumberOfLinks > 1);
+		CloseHandle(file);
+		if (linked)
+		{
+			DeleteFileA(destination.c_str());
+		}
+	}
+
+protected:
+	virtual bool DoCopy(const std::string& source, const std::string& destination, ECopyMethod& method, uint64_t& size, uint64_t& holes, uint32_t& checksum, int& error) override
+	{
+		if (Verifying() != eV_NONE)
+		{
+			// CopyFileEx() never lets us see the data, so copy it ourselves to checksum it on the way through
+			method = (DirectBuffers() != nullptr) ? eCM_DIRECT : eCM_BUFFERED;
+			return StreamCopy(source, destination, size, checksum, error);
+		}
+
+		// CopyFileEx() opens, copies and closes in one go, so it's all timed as the copy
+		method = eCM_COPYFILEEX;
+		CMetrics::Clock::time_point start = CMetrics::Clock::now();
+		if (CopyFileExA(source.c_str(), destination.c_str(), CountBytes, &size, nullptr, (DirectBuffers() != nullptr) ? COPY_FILE_NO_BUFFERING : 0))
+		{
+			g_metrics.Latency(CMetrics::eP_COPY, size, CMetrics::Clock::now() - start);
+			return true;
+		}
+
+		error = (int)GetLastError();
+		return false;
+	}
+
+	virtual bool ReadChecksum(const std::string& path, bool direct, uint32_t& checksum, uint64_t& size, int& error) override
+	{
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, direct ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			error = (int)GetLastError();
+			return false;
+		}
+
+		SBuffer& buffer = Buffer();
+		checksum = 0;
+		size = 0;
+		DWORD bytesRead = 0;
+		bool ok = true;
+		while ((ok = (ReadFile(file, buffer.m_data, BUFFER_SIZE, &bytesRead, nullptr) != 0)) && (bytesRead > 0))
+		{
+			checksum = CCrc32c::Update(checksum, buffer.m_data, bytesRead);
+			size += bytesRead;
+		}
+
+		if (!ok)
+		{
+			error = (int)GetLastError();
+		}
+		CloseHandle(file);
+		return ok;
+	}
+
+	// Block cloning (FSCTL_DUPLICATE_EXTENTS_TO_FILE) is ReFS only, so duplicates are only ever hardlinked here
+	virtual bool DoLink(const std::string& source, const std::string& target, const std::string& destination, ELink link, int& error) override
+	{
+		if (link != eL_HARDLINK)
+		{
+			error = ERROR_NOT_SUPPORTED;
+			return false;
+		}
+
+		DeleteFileA(destination.c_str());
+		if (!CreateHardLinkA(destination.c_str(), target.c_str(), nullptr))
+		{
+			error = (int)GetLastError();
+			return false;
+		}
+		return true;
+	}
+
+private:
+	static const DWORD BUFFER_SIZE = 1024 * 1024;
+
+	// VirtualAlloc()ed, so it's aligned well enough for FILE_FLAG_NO_BUFFERING
+	struct SBuffer
+	{
+		SBuffer() : m_data{ static_cast<char*>(VirtualAlloc(nullptr, BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) } {}
+		~SBuffer() { VirtualFree(m_data, 0, MEM_RELEASE); }
+
+		char* m_data;
+	};
+
+	static SBuffer& Buffer()
+	{
+		thread_local SBuffer buffer;
+		return buffer;
+	}
+
+	// A ReadFile()/WriteFile() loop that checksums as it goes, then carries the attributes and timestamps across the way
+	// CopyFileEx() would
+	bool StreamCopy(const std::string& source, const std::string& destination, uint64_t& size, uint32_t& checksum, int& error)
+	{
+		CBufferPool* buffers = DirectBuffers();
+		DWORD flags = (buffers != nullptr) ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED : FILE_FLAG_SEQUENTIAL_SCAN;
+		HANDLE in = CreateFileA(source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+		BY_HANDLE_FILE_INFORMATION info;
+		if ((in == INVALID_HANDLE_VALUE) || !GetFileInformationByHandle(in, &info))
+		{
+			error = (int)GetLastError();
+			if (in != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(in);
+			}
+			return false;
+		}
+
+		HANDLE out = CreateFileA(destination.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | flags, nullptr);
+		if (out == INVALID_HANDLE_VALUE)
+		{
+			error = (int)GetLastError();
+			CloseHandle(in);
+			return false;
+		}
+
+		SBuffer& buffer = Buffer();
+		checksum = 0;
+		size = 0;
+		DWORD bytesRead = 0;
+		bool ok = true;
+		if (buffers != nullptr)
+		{
+			ok = DirectCopy(*buffers, in, out, size, checksum);
+		}
+		else
+		{
+			while ((ok = (ReadFile(in, buffer.m_data, BUFFER_SIZE, &bytesRead, nullptr) != 0)) && (bytesRead > 0))
+			{
+				checksum = CCrc32c::Update(checksum, buffer.m_data, bytesRead);
+				DWORD bytesWritten = 0;
+				for (DWORD written = 0; ok && (written < bytesRead); written += bytesWritten)
+				{
+					ok = (WriteFile(out, buffer.m_data + written, bytesRead - written, &bytesWritten, nullptr) != 0);
+				}
+				if (!ok)
+				{
+					break;
+				}
+				size += bytesRead;
+			}
+		}
+
+		if (ok)
+		{
+			ok = (SetFileTime(out, &info.ftCreationTime, &info.ftLastAccessTime, &info.ftLastWriteTime) != 0);
+		}
+		if (!ok)
+		{
+			error = (int)GetLastError();
+		}
+
+		CloseHandle(in);
+		CloseHandle(out);
+		if (ok)
+		{
+			SetFileAttributesA(destination.c_str(), info.dwFileAttributes);
+		}
+		else
+		{
+			DeleteFileA(destination.c_str());
+		}
+		return ok;
+	}
+
+	// Unbuffered, overlapped copy through a pair of pooled buffers, writing each block while the next is read.  Writes have
+	// to be whole sectors, so the tail is padded out and the end of file set back afterwards.
+	static bool DirectCopy(CBufferPool& buffers, HANDLE in, HANDLE out, uint64_t& size, uint32_t& checksum)
+	{
+		const DWORD bufferSize = static_cast<DWORD>(buffers.BufferSize());
+		CBufferPool::CLease lease(buffers);
+		OVERLAPPED read = {};
+		OVERLAPPED write = {};
+		read.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		write.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		bool ok = (read.hEvent != nullptr) && (write.hEvent != nullptr);
+		int current = 0;
+		bool reading = false;
+		DWORD bytesRead = 0;
+		if (ok)
+		{
+			ok = Transfer(in, lease.Buffer(current), bufferSize, 0, read, false, reading);
+			ok = Complete(in, read, reading, bytesRead) && ok;
+		}
+
+		bool padded = false;
+		while (ok && (bytesRead > 0))
+		{
+			char* data = lease.Buffer(current);
+			checksum = CCrc32c::Update(checksum, data, bytesRead);
+			DWORD length = static_cast<DWORD>(((bytesRead + CBufferPool::ALIGNMENT - 1) / CBufferPool::ALIGNMENT) * CBufferPool::ALIGNMENT);
+			if (length > bytesRead)
+			{
+				memset(data + bytesRead, 0, length - bytesRead);
+				padded = true;
+			}
+
+			// A short read was the end of the file.  Both transfers have to finish before their buffers are reused, whatever
+			// happened to the other.
+			uint64_t next = size + bytesRead;
+			bool writing = false;
+			reading = false;
+			DWORD bytesWritten = 0;
+			ok = Transfer(out, data, length, size, write, true, writing);
+			if (ok && (bytesRead == bufferSize))
+			{
+				ok = Transfer(in, lease.Buffer(current ^ 1), bufferSize, next, read, false, reading);
+			}
+			ok = Complete(out, write, writing, bytesWritten) && ok;
+			ok = Complete(in, read, reading, bytesRead) && ok;
+			size = next;
+			current ^= 1;
+		}
+
+		if (ok && padded)
+		{
+			FILE_END_OF_FILE_INFO end;
+			end.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+			ok = (SetFileInformationByHandle(out, FileEndOfFileInfo, &end, sizeof(end)) != 0);
+		}
+
+		DWORD lastError = GetLastError();
+		if (read.hEvent != nullptr)
+		{
+			CloseHandle(read.hEvent);
+		}
+		if (write.hEvent != nullptr)
+		{
+			CloseHandle(write.hEvent);
+		}
+		SetLastError(lastError);
+		return ok;
+	}
+
+	// Starts an overlapped read or write of length bytes at offset; pending is set if there's a completion to wait for.
+	// A read starting at the end of the file fails straight away, which isn't an error.
+	static bool Transfer(HANDLE file, char* data, DWORD length, uint64_t offset, OVERLAPPED& overlapped, bool write, bool& pending)
+	{
+		overlapped.Offset = static_cast<DWORD>(offset);
+		overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		ResetEvent(overlapped.hEvent);
+		pending = true;
+		if (write ? WriteFile(file, data, length, nullptr, &overlapped) : ReadFile(file, data, length, nullptr, &overlapped))
+		{
+			return true; // completed already; the result is still collected by Complete()
+		}
+
+		DWORD lastError = GetLastError();
+		if (lastError == ERROR_IO_PENDING)
+		{
+			return true;
+		}
+		pending = false;
+		return !write && (lastError == ERROR_HANDLE_EOF);
+	}
+
+	static bool Complete(HANDLE file, OVERLAPPED& overlapped, bool pending, DWORD& bytes)
+	{
+		bytes = 0;
+		if (!pending || GetOverlappedResult(file, &overlapped, &bytes, TRUE))
+		{
+			return true;
+		}
+		bytes = 0;
+		return GetLastError() == ERROR_HANDLE_EOF;
+	}
+
+	static DWORD CALLBACK CountBytes(LARGE_INTEGER totalFileSize, LARGE_INTEGER totalBytesTransferred, LARGE_INTEGER streamSize, LARGE_INTEGER streamBytesTransferred, DWORD streamNumber, DWORD callbackReason, HANDLE sourceFile, HANDLE destinationFile, LPVOID data)
+	{
+		*static_cast<uint64_t*>(data) = static_cast<uint64_t>(totalBytesTransferred.QuadPart);
+		return PROGRESS_CONTINUE;
+	}
+
+	CDirectoryCache m_directories;
+};
+
+inline std::unique_ptr<CCopyBackend> CCopyBackend::Create()
+{
+	return std::unique_ptr<CCopyBackend>(new CWindowsCopyBackend());
+}
+#else
+// Tries each method in turn, from reflink down to a userspace loop, so data only passes through user memory when nothing else works
+class CLinuxCopyBackend : public CCopyBackend
+{
+public:
+	virtual const char* Name() const override { return "Linux"; }
+
+	virtual bool CreateParentDirectory(const std::string& destination) override
+	{
+		int fd;
+		const char* name;
+		if (!OpenParentDirectory(destination, fd, name))
+		{
+			LOG_ERROR("Failed to create parent directory for [%s]: [%s]", destination.c_str(), strerror(errno));
+			return false;
+		}
+
+		return true;
+	}
+
+	virtual EDifference Compare(const std::string& source, const std::string& destination, uint64_t& size) override
+	{
+		struct statx sourceInfo;
+		struct statx destinationInfo;
+		if (StatX(source.c_str(), sourceInfo) != 0)
+		{
+			return eD_ERROR;
+		}
+
+		size = sourceInfo.stx_size;
+		if (StatX(destination.c_str(), destinationInfo) != 0)
+		{
+			return eD_MISSING;
+		}
+
+		return Same(sourceInfo, destinationInfo) ? eD_SAME : eD_DIFFERENT;
+	}
+
+	virtual bool Size(const std::string& path, uint64_t& size) override
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+		{
+			return false;
+		}
+
+		size = static_cast<uint64_t>(info.st_size);
+		return true;
+	}
+
+	virtual bool Identical(const std::string& path1, const std::string& path2) override
+	{
+		int fd1 = open(path1.c_str(), O_RDONLY | O_CLOEXEC);
+		int fd2 = open(path2.c_str(), O_RDONLY | O_CLOEXEC);
+		bool identical = (fd1 >= 0) && (fd2 >= 0);
+		if (identical)
+		{
+			posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+
+		thread_local std::vector<char> buffer(2 * DELTA_BLOCK_SIZE);
+		char* block1 = buffer.data();
+		char* block2 = buffer.data() + DELTA_BLOCK_SIZE;
+		for (uint64_t offset = 0; identical; offset += DELTA_BLOCK_SIZE)
+		{
+			ssize_t read1 = ReadFully(fd1, block1, DELTA_BLOCK_SIZE, offset);
+			ssize_t read2 = ReadFully(fd2, block2, DELTA_BLOCK_SIZE, offset);
+			identical = (read1 >= 0) && (read1 == read2) && (memcmp(block1, block2, static_cast<size_t>(read1)) == 0);
+			if (read1 < static_cast<ssize_t>(DELTA_BLOCK_SIZE))
+			{
+				break;
+			}
+		}
+
+		if (fd1 >= 0)
+		{
+			close(fd1);
+		}
+		if (fd2 >= 0)
+		{
+			close(fd2);
+		}
+		return identical;
+	}
+
+	virtual void Detach(const std::string& destination) override
+	{
+		struct stat info;
+		if ((lstat(destination.c_str(), &info) == 0) && S_ISREG(info.st_mode) && (info.st_nlink > 1))
+		{
+			unlink(destination.c_str());
+		}
+	}
+
+	// For callers with their own statx results (i.e. the io_uring engine)
+	static bool Same(const struct statx& source, const struct statx& destination)
+	{
+		return (source.stx_size == destination.stx_size) && SameTime(source.stx_mtime.tv_sec, source.stx_mtime.tv_nsec, destination.stx_mtime.tv_sec, destination.stx_mtime.tv_nsec);
+	}
+
+protected:
+	virtual bool DoCopy(const std::string& source, const std::string& destination, ECopyMethod& method, uint64_t& size, uint64_t& holes, uint32_t& checksum, int& error) override
+	{
+		CMetrics::Clock::time_point start = CMetrics::Clock::now();
+		bool direct = (DirectBuffers() != nullptr);
+		int in = open(source.c_str(), O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+		if ((in < 0) && direct && (errno == EINVAL))
+		{
+			// Not supported by the source filesystem
+			direct = false;
+			in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		}
+		if (in < 0)
+		{
+			error = errno;
+			return false;
+		}
+
+		struct stat info;
+		if (fstat(in, &info) != 0)
+		{
+			error = errno;
+			close(in);
+			return false;
+		}
+
+		// Only the data extents of a sparse file are copied, through the page cache; O_DIRECT would need every extent
+		// aligned, and bypassing the cache matters less when most of the file is never read
+		bool sparse = Sparse(info);
+		if (sparse && direct)
+		{
+			direct = false;
+			ClearDirect(in);
+		}
+
+		int out = OpenDestination(destination, info.st_mode & 07777, direct ? O_DIRECT : 0);
+		if ((out < 0) && direct && (errno == EINVAL))
+		{
+			direct = false;
+			ClearDirect(in);
+			out = OpenDestination(destination, info.st_mode & 07777, 0);
+		}
+		if (out < 0)
+		{
+			error = errno;
+			close(in);
+			return false;
+		}
+
+		CMetrics::Clock::time_point opened = CMetrics::Clock::now();
+		bool copied = false;
+		off_t offset = 0;
+		holes = 0;
+		if (Verifying() != eV_NONE)
+		{
+			// The data has to come through here to be checksummed
+			checksum = 0;
+			if (sparse)
+			{
+				method = eCM_SPARSE;
+				copied = SparseCopy(in, out, info.st_size, offset, error, holes, &checksum);
+			}
+			else if (direct && DirectCopy(*DirectBuffers(), in, out, info.st_size, offset, error, &checksum))
+			{
+				method = eCM_DIRECT;
+				copied = true;
+			}
+			else if (error == 0)
+			{
+				posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+				method = eCM_BUFFERED;
+				copied = Buffered(in, out, info.st_size, offset, error, &checksum);
+			}
+		}
+		else if (ioctl(out, FICLONE, in) == 0)
+		{
+			method = eCM_REFLINK;
+			copied = true;
+		}
+		else if (sparse)
+		{
+			method = eCM_SPARSE;
+			copied = SparseCopy(in, out, info.st_size, offset, error, holes);
+		}
+		else if (direct && DirectCopy(*DirectBuffers(), in, out, info.st_size, offset, error))
+		{
+			method = eCM_DIRECT;
+			copied = true;
+		}
+		else if ((error == 0) && CopyFileRange(in, out, info.st_size, offset, error))
+		{
+			method = eCM_COPY_FILE_RANGE;
+			copied = true;
+		}
+		else if ((error == 0) && SendFile(in, out, info.st_size, offset, error))
+		{
+			method = eCM_SENDFILE;
+			copied = true;
+		}
+		else if (error == 0)
+		{
+			LOG_INFORMATION("No zero-copy path from [%s] to [%s] (stopped at offset [%lld]); using buffered copy", source.c_str(), destination.c_str(), (long long)offset);
+			method = eCM_BUFFERED;
+			copied = Buffered(in, out, info.st_size, offset, error);
+		}
+
+		if (copied && (DirectBuffers() != nullptr) && (method != eCM_DIRECT) && (method != eCM_REFLINK))
+		{
+			DropCache(in, out, 0, info.st_size);
+		}
+
+		if (copied && (method == eCM_SPARSE) && (ftruncate(out, info.st_size) != 0))
+		{
+			error = errno;
+			copied = false;
+		}
+
+		CMetrics::Clock::time_point written = CMetrics::Clock::now();
+		if (copied)
+		{
+			// Match CopyFileEx(), which carries the attributes and timestamps across
+			struct timespec times[2] = { info.st_atim, info.st_mtim };
+			fchmod(out, info.st_mode & 07777);
+			futimens(out, times);
+			size = static_cast<uint64_t>(info.st_size);
+		}
+
+		close(in);
+		if ((close(out) != 0) && copied)
+		{
+			error = errno;
+			copied = false;
+		}
+
+		if (copied)
+		{
+			g_metrics.Latency(CMetrics::eP_OPEN, size, opened - start);
+			g_metrics.Latency(CMetrics::eP_COPY, size, written - opened);
+			g_metrics.Latency(CMetrics::eP_CLOSE, size, CMetrics::Clock::now() - written);
+		}
+
+		if (!copied)
+		{
+			unlink(destination.c_str());
+		}
+
+		return copied;
+	}
+
+	// Reads both files a block at a time and rewrites just the blocks that differ.  Both ends are local paths, so comparing
+	// the blocks directly costs the same reads a checksum would while never being fooled by a collision.
+	virtual bool DoUpdate(const std::string& source, const std::string& destination, uint64_t& written, uint64_t& size, uint32_t& checksum, int& error) override
+	{
+		int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0)
+		{
+			return false;
+		}
+
+		int out = open(destination.c_str(), O_RDWR | O_CLOEXEC);
+		struct stat info;
+		struct stat existing;
+		if ((out < 0) || (fstat(in, &info) != 0) || (fstat(out, &existing) != 0))
+		{
+			close(in);
+			if (out >= 0)
+			{
+				close(out);
+			}
+			return false;
+		}
+
+		posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(out, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		thread_local std::vector<char> buffer(2 * DELTA_BLOCK_SIZE);
+		char* sourceBlock = buffer.data();
+		char* destinationBlock = buffer.data() + DELTA_BLOCK_SIZE;
+		size = static_cast<uint64_t>(info.st_size);
+		written = 0;
+		checksum = 0;
+		bool ok = true;
+		for (uint64_t offset = 0; ok && (offset < size); offset += DELTA_BLOCK_SIZE)
+		{
+			size_t length = static_cast<size_t>(std::min(static_cast<uint64_t>(DELTA_BLOCK_SIZE), size - offset));
+			ssize_t sourceRead = ReadFully(in, sourceBlock, length, offset);
+			ssize_t destinationRead = ReadFully(out, destinationBlock, length, offset);
+			if ((sourceRead != static_cast<ssize_t>(length)) || (destinationRead < 0))
+			{
+				error = (sourceRead < 0) || (destinationRead < 0) ? errno : EIO; // EIO: source shrank underneath us
+				ok = false;
+			}
+			else
+			{
+				checksum = CCrc32c::Update(checksum, sourceBlock, length);
+				if ((destinationRead != sourceRead) || (memcmp(sourceBlock, destinationBlock, length) != 0))
+				{
+					ok = WriteFully(out, sourceBlock, length, offset, error);
+					written += length;
+				}
+			}
+		}
+
+		if (ok && (existing.st_size != info.st_size) && (ftruncate(out, info.st_size) != 0))
+		{
+			error = errno;
+			ok = false;
+		}
+
+		if (ok)
+		{
+			struct timespec times[2] = { info.st_atim, info.st_mtim };
+			fchmod(out, info.st_mode & 07777);
+			futimens(out, times);
+		}
+
+		close(in);
+		if ((close(out) != 0) && ok)
+		{
+			error = errno;
+			ok = false;
+		}
+
+		return ok;
+	}
+
+	// O_DIRECT needs the buffer, offsets and lengths aligned; the final short read is fine.  Filesystems that don't support
+	// it (tmpfs, some FUSE) fall back to dropping what they can of the file from the cache and reading it normally.
+	virtual bool ReadChecksum(const std::string& path, bool direct, uint32_t& checksum, uint64_t& size, int& error) override
+	{
+		int fd = direct ? open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT) : -1;
+		if (fd < 0)
+		{
+			fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				error = errno;
+				return false;
+			}
+
+			posix_fadvise(fd, 0, 0, direct ? POSIX_FADV_DONTNEED : POSIX_FADV_SEQUENTIAL);
+		}
+
+		thread_local std::unique_ptr<char, decltype(&free)> buffer(AlignedBuffer(), &free);
+		if (!buffer)
+		{
+			close(fd);
+			error = ENOMEM;
+			return false;
+		}
+
+		checksum = 0;
+		size = 0;
+		bool ok = true;
+		while (true)
+		{
+			ssize_t bytesRead = pread(fd, buffer.get(), VERIFY_BUFFER_SIZE, static_cast<off_t>(size));
+			if (bytesRead == 0)
+			{
+				break;
+			}
+			else if (bytesRead < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				error = errno;
+				ok = false;
+				break;
+			}
+
+			checksum = CCrc32c::Update(checksum, buffer.get(), static_cast<size_t>(bytesRead));
+			size += static_cast<uint64_t>(bytesRead);
+		}
+
+		close(fd);
+		return ok;
+	}
+
+	// A hardlink replaces whatever destination was; a reflink gets the source's attributes, as a copy would
+	virtual bool DoLink(const std::string& source, const std::string& target, const std::string& destination, ELink link, int& error) override
+	{
+		int fd;
+		const char* name;
+		if (!OpenParentDirectory(destination, fd, name))
+		{
+			error = errno;
+			return false;
+		}
+
+		if (link == eL_HARDLINK)
+		{
+			if ((linkat(AT_FDCWD, target.c_str(), fd, name, 0) != 0) && ((errno != EEXIST) || (unlinkat(fd, name, 0) != 0) || (linkat(AT_FDCWD, target.c_str(), fd, name, 0) != 0)))
+			{
+				error = errno;
+				return false;
+			}
+			return true;
+		}
+
+		struct stat info;
+		int in = open(target.c_str(), O_RDONLY | O_CLOEXEC);
+		if ((in < 0) || (stat(source.c_str(), &info) != 0))
+		{
+			error = errno;
+			if (in >= 0)
+			{
+				close(in);
+			}
+			return false;
+		}
+
+		int out = OpenDestination(destination, info.st_mode & 07777, 0);
+		if (out < 0)
+		{
+			error = errno;
+			close(in);
+			return false;
+		}
+
+		bool cloned = (ioctl(out, FICLONE, in) == 0);
+		if (cloned)
+		{
+			struct timespec times[2] = { info.st_atim, info.st_mtim };
+			fchmod(out, info.st_mode & 07777);
+			futimens(out, times);
+		}
+		else
+		{
+			error = errno;
+		}
+
+		close(in);
+		if ((close(out) != 0) && cloned)
+		{
+			error = errno;
+			cloned = false;
+		}
+
+		if (!cloned)
+		{
+			unlinkat(fd, name, 0);
+		}
+		return cloned;
+	}
+
+	virtual std::unique_ptr<CRangeCopy> OpenRanges(const std::string& source, const std::string& destination, uint64_t threshold) override
+	{
+		struct stat info;
+		if ((stat(source.c_str(), &info) != 0) || (static_cast<uint64_t>(info.st_size) < threshold))
+		{
+			return nullptr;
+		}
+
+		CMetrics::Clock::time_point start = CMetrics::Clock::now();
+		bool sparse = Sparse(info);
+		CBufferPool* buffers = sparse ? nullptr : DirectBuffers(); // as in DoCopy(), sparse files go through the cache
+		int in = open(source.c_str(), O_RDONLY | O_CLOEXEC | ((buffers != nullptr) ? O_DIRECT : 0));
+		if ((in < 0) && (buffers != nullptr) && (errno == EINVAL))
+		{
+			buffers = nullptr;
+			in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		}
+		if (in < 0)
+		{
+			return nullptr;
+		}
+
+		int out = OpenDestination(destination, info.st_mode & 07777, (buffers != nullptr) ? O_DIRECT : 0);
+		if ((out < 0) && (buffers != nullptr) && (errno == EINVAL))
+		{
+			buffers = nullptr;
+			ClearDirect(in);
+			out = OpenDestination(destination, info.st_mode & 07777, 0);
+		}
+		if (out < 0)
+		{
+			close(in);
+			return nullptr;
+		}
+
+		bool checksum = (Verifying() != eV_NONE);
+		std::unique_ptr<CLinuxRangeCopy> ranges(new CLinuxRangeCopy(source, destination, in, out, info, checksum, buffers, DirectBuffers() != nullptr, sparse));
+		if (!checksum && (ioctl(out, FICLONE, in) == 0))
+		{
+			ranges->m_cloned = true;
+		}
+		else if (sparse)
+		{
+			// Sized but not allocated, so the holes the ranges skip stay holes
+			if (ftruncate(out, info.st_size) != 0)
+			{
+				LOG_DEBUG("Unable to size [%s]: [%s]", destination.c_str(), strerror(errno));
+			}
+		}
+		else if ((fallocate(out, 0, 0, info.st_size) != 0) && (ftruncate(out, info.st_size) != 0))
+		{
+			// Not fatal; the ranges will extend the file as they land
+			LOG_DEBUG("Unable to preallocate [%s]: [%s]", destination.c_str(), strerror(errno));
+		}
+
+		g_metrics.Latency(CMetrics::eP_OPEN, ranges->Size(), CMetrics::Clock::now() - start);
+		return ranges;
+	}
+
+private:
+	static const size_t DELTA_BLOCK_SIZE = 256 * 1024;
+	static const size_t VERIFY_BUFFER_SIZE = 1024 * 1024;
+
+	static char* AlignedBuffer()
+	{
+		void* buffer = nullptr;
+		return (posix_memalign(&buffer, 4096, VERIFY_BUFFER_SIZE) == 0) ? static_cast<char*>(buffer) : nullptr;
+	}
+
+	class CLinuxRangeCopy : public CRangeCopy
+	{
+	public:
+		CLinuxRangeCopy(const std::string& source, const std::string& destination, int in, int out, const struct stat& info, bool checksum, CBufferPool* buffers, bool uncached, bool sparse)
+			: CRangeCopy{ source, destination, static_cast<uint64_t>(info.st_size) }
+			, m_info(info)
+			, m_in{ in }
+			, m_out{ out }
+			, m_checksum{ checksum }
+			, m_uncached{ uncached }
+			, m_sparse{ sparse }
+			, m_buffers{ buffers }
+		{
+		}
+
+		~CLinuxRangeCopy()
+		{
+			if (m_in >= 0)
+			{
+				close(m_in);
+			}
+			if (m_out >= 0)
+			{
+				close(m_out);
+			}
+		}
+
+		virtual bool CopyRange(uint64_t offset, uint64_t length, int& error) override
+		{
+			off_t position = static_cast<off_t>(offset);
+			off_t end = static_cast<off_t>(offset + length);
+			error = 0;
+			CBufferPool* buffers = m_buffers;
+			if (buffers != nullptr)
+			{
+				// Ranges are whole MB, so each starts aligned and ends aligned or at the end of the file
+				uint32_t checksum = 0;
+				if (DirectCopy(*buffers, m_in, m_out, end, position, error, m_checksum ? &checksum : nullptr))
+				{
+					if (m_checksum)
+					{
+						AddChecksum(offset, static_cast<uint64_t>(position) - offset, checksum);
+					}
+					return true;
+				}
+				else if (error != 0)
+				{
+					return false;
+				}
+
+				// The filesystem doesn't do O_DIRECT after all, and both files are now buffered; copy normally from here on
+				m_buffers = nullptr;
+			}
+
+			if (m_sparse)
+			{
+				uint64_t holes = 0;
+				uint32_t checksum = 0;
+				bool copied = SparseCopy(m_in, m_out, end, position, error, holes, m_checksum ? &checksum : nullptr);
+				m_holes += holes;
+				if (copied && m_checksum)
+				{
+					AddChecksum(offset, static_cast<uint64_t>(position) - offset, checksum);
+				}
+				return copied;
+			}
+
+			if (m_checksum)
+			{
+				uint32_t checksum = 0;
+				if (!Buffered(m_in, m_out, end, position, error, &checksum))
+				{
+					return false;
+				}
+				AddChecksum(offset, static_cast<uint64_t>(position) - offset, checksum);
+				return true;
+			}
+
+			if (m_copyFileRange)
+			{
+				if (CopyFileRange(m_in, m_out, end, position, error))
+				{
+					return true;
+				}
+				else if (error != 0)
+				{
+					return false;
+				}
+
+				// Carry on from wherever copy_file_range got to, and don't try it again for this file
+				m_copyFileRange = false;
+			}
+
+			return Buffered(m_in, m_out, end, position, error);
+		}
+
+	protected:
+		virtual bool Finish(bool success, int& error) override
+		{
+			if (success && m_uncached && !Cloned() && (m_buffers == nullptr))
+			{
+				DropCache(m_in, m_out, 0, m_info.st_size);
+			}
+
+			if (success)
+			{
+				struct timespec times[2] = { m_info.st_atim, m_info.st_mtim };
+				fchmod(m_out, m_info.st_mode & 07777);
+				futimens(m_out, times);
+			}
+
+			close(m_in);
+			m_in = -1;
+			if ((close(m_out) != 0) && success)
+			{
+				error = errno;
+				success = false;
+			}
+			m_out = -1;
+
+			if (!success)
+			{
+				unlink(m_destination.c_str());
+			}
+
+			return success;
+		}
+
+	private:
+		friend class CLinuxCopyBackend;
+
+		const struct stat m_info;
+		int m_in;
+		int m_out;
+		const bool m_checksum; // copy through a buffer and checksum each range, for verifying the whole file afterwards
+		const bool m_uncached; // direct mode, so keep the file out of the page cache even if O_DIRECT isn't supported
+		const bool m_sparse; // copy only the source's data extents
+		std::atomic<CBufferPool*> m_buffers; // set while the ranges are being copied with O_DIRECT
+		volatile std::atomic_bool m_copyFileRange{ true };
+	};
+
+	// Finds (creating if need be) the cached directory that will hold destination; name is then what to pass to the *at()
+	// calls alongside fd, which is the full path if the cache isn't holding an fd for the directory
+	bool OpenParentDirectory(const std::string& destination, int& fd, const char*& name)
+	{
+		fd = AT_FDCWD;
+		name = destination.c_str();
+		size_t sep = destination.find_last_of('/');
+		if (sep == std::string::npos)
+		{
+			return true; // relative to the current directory
+		}
+
+		if (!m_directories.Open(std::string(destination, 0, (sep == 0) ? 1 : sep), fd))
+		{
+			return false;
+		}
+
+		if (fd != AT_FDCWD)
+		{
+			name = destination.c_str() + sep + 1;
+		}
+		return true;
+	}
+
+	int OpenDestination(const std::string& destination, mode_t mode, int flags)
+	{
+		int fd;
+		const char* name;
+		if (!OpenParentDirectory(destination, fd, name))
+		{
+			return -1;
+		}
+
+		return openat(fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | flags, mode);
+	}
+
+	// Puts a file opened with O_DIRECT back to going through the page cache
+	static void ClearDirect(int fd)
+	{
+		int flags = fcntl(fd, F_GETFL);
+		if ((flags >= 0) && ((flags & O_DIRECT) != 0))
+		{
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+		}
+	}
+
+	// For direct copies that had to go through the page cache anyway: writes the destination back, then drops both files'
+	// pages so the copy still doesn't push everything else out
+	static void DropCache(int in, int out, off_t offset, off_t length)
+	{
+		sync_file_range(out, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(out, offset, length, POSIX_FADV_DONTNEED);
+		posix_fadvise(in, offset, length, POSIX_FADV_DONTNEED);
+	}
+
+	static int StatX(const char* path, struct statx& info)
+	{
+		return static_cast<int>(syscall(__NR_statx, AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_SIZE | STATX_MTIME, &info));
+	}
+
+	static ssize_t ReadFully(int fd, char* buffer, size_t length, uint64_t offset)
+	{
+		size_t total = 0;
+		while (total < length)
+		{
+			ssize_t bytes = pread(fd, buffer + total, length - total, static_cast<off_t>(offset + total));
+			if (bytes > 0)
+			{
+				total += bytes;
+			}
+			else if (bytes == 0)
+			{
+				break; // end of file
+			}
+			else if (errno != EINTR)
+			{
+				return -1;
+			}
+		}
+		return static_cast<ssize_t>(total);
+	}
+
+	static bool WriteFully(int fd, const char* buffer, size_t length, uint64_t offset, int& error)
+	{
+		size_t total = 0;
+		while (total < length)
+		{
+			ssize_t bytes = pwrite(fd, buffer + total, length - total, static_cast<off_t>(offset + total));
+			if (bytes >= 0)
+			{
+				total += bytes;
+			}
+			else if (errno != EINTR)
+			{
+				error = errno;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Errors that mean "this method can't be used for these two files" rather than "the copy failed"
+	static bool Unsupported(int error)
+	{
+		return (error == EXDEV) || (error == ENOSYS) || (error == EOPNOTSUPP) || (error == EINVAL) || (error == ETXTBSY);
+	}
+
+	// Each of the following copies from offset to size, advancing offset as it goes.  They return false with error == 0
+	// when the method isn't available, leaving offset where the next method should pick up.
+	static bool CopyFileRange(int in, int out, off_t size, off_t& offset, int& error)
+	{
+		while (offset < size)
+		{
+			loff_t inOffset = offset;
+			loff_t outOffset = offset;
+			ssize_t copied = copy_file_range(in, &inOffset, out, &outOffset, size - offset, 0);
+			if (copied > 0)
+			{
+				offset += copied;
+			}
+			else if (copied == 0)
+			{
+				break; // source was truncated underneath us
+			}
+			else if (errno != EINTR)
+			{
+				error = Unsupported(errno) ? 0 : errno;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	static bool SendFile(int in, int out, off_t size, off_t& offset, int& error)
+	{
+		if (lseek(out, offset, SEEK_SET) < 0)
+		{
+			error = errno;
+			return false;
+		}
+
+		while (offset < size)
+		{
+			ssize_t copied = sendfile(out, in, &offset, size - offset);
+			if (copied == 0)
+			{
+				break;
+			}
+			else if ((copied < 0) && (errno != EINTR))
+			{
+				error = Unsupported(errno) ? 0 : errno;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Has fewer blocks allocated than its size needs, so it has holes worth not copying
+	static bool Sparse(const struct stat& info)
+	{
+		return (static_cast<uint64_t>(info.st_blocks) * 512) < static_cast<uint64_t>(info.st_size);
+	}
+
+	// Copies each data extent of [offset, size) with the methods above, skipping the holes between them, which are left
+	// unwritten and so stay holes in the destination (which the caller has to extend to the full size, in case the file
+	// ends in a hole).  holes counts the bytes skipped; checksum, if given, is continued over everything, the holes' zeros
+	// included.
+	static bool SparseCopy(int in, int out, off_t size, off_t& offset, int& error, uint64_t& holes, uint32_t* checksum = nullptr)
+	{
+		while (offset < size)
+		{
+			off_t data = lseek(in, offset, SEEK_DATA);
+			if (data < 0)
+			{
+				// ENXIO: nothing but hole from here to the end; anything else means the filesystem can't say, so copy it all
+				data = (errno == ENXIO) ? size : offset;
+			}
+			data = std::min(data, size);
+			if (data > offset)
+			{
+				holes += static_cast<uint64_t>(data - offset);
+				if (checksum != nullptr)
+				{
+					*checksum = CCrc32c::UpdateZeros(*checksum, static_cast<uint64_t>(data - offset));
+				}
+				offset = data;
+				continue;
+			}
+
+			off_t hole = lseek(in, offset, SEEK_HOLE);
+			hole = (hole <= offset) ? size : std::min(hole, size);
+			bool copied = (checksum != nullptr) ? Buffered(in, out, hole, offset, error, checksum) : (CopyFileRange(in, out, hole, offset, error) || ((error == 0) && SendFile(in, out, hole, offset, error)) || ((error == 0) && Buffered(in, out, hole, offset, error)));
+			if (!copied)
+			{
+				return false;
+			}
+			else if (offset < hole)
+			{
+				break; // source was truncated underneath us
+			}
+		}
+
+		return true;
+	}
+
+	// checksum, if given, is continued over the data copied
+	static bool Buffered(int in, int out, off_t size, off_t& offset, int& error, uint32_t* checksum = nullptr)
+	{
+		static const size_t BUFFER_SIZE = 1024 * 1024;
+		thread_local std::vector<char> buffer(BUFFER_SIZE);
+		while (offset < size)
+		{
+			// Never past size, which may be the end of a range or extent rather than of the file
+			ssize_t bytesRead = pread(in, buffer.data(), static_cast<size_t>(std::min<off_t>(BUFFER_SIZE, size - offset)), offset);
+			if (bytesRead == 0)
+			{
+				break;
+			}
+			else if (bytesRead < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				error = errno;
+				return false;
+			}
+
+			if (checksum != nullptr)
+			{
+				*checksum = CCrc32c::Update(*checksum, buffer.data(), static_cast<size_t>(bytesRead));
+			}
+
+			for (ssize_t written = 0; written < bytesRead; )
+			{
+				ssize_t bytesWritten = pwrite(out, buffer.data() + written, bytesRead - written, offset + written);
+				if (bytesWritten < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					error = errno;
+					return false;
+				}
+				written += bytesWritten;
+			}
+
+			offset += bytesRead;
+		}
+
+		return true;
+	}
+
+	// O_DIRECT copy through a pair of pooled buffers, writing each block while the next is read so neither file waits on the
+	// other.  offset has to be aligned, as does size unless it's the end of the file: the tail is written padded out to a
+	// whole block and the file truncated back afterwards.  If the filesystem turns out not to support O_DIRECT, both files
+	// are switched back to buffered I/O before anything is copied.
+	static bool DirectCopy(CBufferPool& buffers, int in, int out, off_t size, off_t& offset, int& error, uint32_t* checksum = nullptr)
+	{
+		const size_t alignment = CBufferPool::ALIGNMENT;
+		if ((offset % alignment) != 0)
+		{
+			ClearDirect(in);
+			ClearDirect(out);
+			return false;
+		}
+
+		thread_local std::unique_ptr<CUring> ring(new CUring(4));
+		CBufferPool::CLease lease(buffers);
+		const size_t bufferSize = buffers.BufferSize();
+		int current = 0;
+		ssize_t bytesRead = DirectRead(in, lease.Buffer(current), DirectLength(offset, size, bufferSize), offset);
+		if (bytesRead < 0)
+		{
+			if (errno == EINVAL)
+			{
+				ClearDirect(in);
+				ClearDirect(out);
+			}
+			else
+			{
+				error = errno;
+			}
+			return false;
+		}
+
+		bool padded = false;
+		while ((bytesRead > 0) && (offset < size))
+		{
+			char* data = lease.Buffer(current);
+			size_t valid = static_cast<size_t>(std::min<off_t>(bytesRead, size - offset));
+			if (checksum != nullptr)
+			{
+				*checksum = CCrc32c::Update(*checksum, data, valid);
+			}
+
+			size_t length = ((valid + alignment - 1) / alignment) * alignment;
+			if (length > valid)
+			{
+				memset(data + valid, 0, length - valid);
+				padded = true;
+			}
+
+			// A short read was the end of the file (or where it was truncated underneath us)
+			off_t next = offset + static_cast<off_t>(valid);
+			size_t nextLength = ((valid == bufferSize) && (next < size)) ? DirectLength(next, size, bufferSize) : 0;
+			if (!Overlap(ring, in, out, data, length, offset, lease.Buffer(current ^ 1), nextLength, next, bytesRead, error))
+			{
+				return false;
+			}
+
+			offset = next;
+			current ^= 1;
+		}
+
+		if (padded && (ftruncate(out, offset) != 0))
+		{
+			error = errno;
+			return false;
+		}
+		return true;
+	}
+
+	// Writes length bytes of data at offset while reading up to readLength bytes at readOffset into next: both in flight
+	// together on the thread's ring, or one after the other if there isn't one
+	static bool Overlap(std::unique_ptr<CUring>& ring, int in, int out, const char* data, size_t length, off_t offset, char* next, size_t readLength, off_t readOffset, ssize_t& bytesRead, int& error)
+	{
+		ssize_t written = -EAGAIN;
+		bytesRead = (readLength > 0) ? -EAGAIN : 0;
+		if (ring && ring->IsOpen())
+		{
+			unsigned int count = (readLength > 0) ? 2 : 1;
+			struct io_uring_sqe* sqe = ring->GetSqe();
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = out;
+			sqe->addr = reinterpret_cast<uint64_t>(data);
+			sqe->len = static_cast<uint32_t>(length);
+			sqe->off = static_cast<uint64_t>(offset);
+			sqe->user_data = 0;
+			if (readLength > 0)
+			{
+				sqe = ring->GetSqe();
+				sqe->opcode = IORING_OP_READ;
+				sqe->fd = in;
+				sqe->addr = reinterpret_cast<uint64_t>(next);
+				sqe->len = static_cast<uint32_t>(readLength);
+				sqe->off = static_cast<uint64_t>(readOffset);
+				sqe->user_data = 1;
+			}
+
+			unsigned int completed = 0;
+			for (unsigned int waitFor = count; completed < count; waitFor = count - completed)
+			{
+				if (ring->Submit(waitFor) < 0)
+				{
+					// Can't tell what became of the requests, so stop using the ring and redo them below
+					LOG_WARNING("io_uring_enter() failed: [%s]; copying synchronously", strerror(errno));
+					ring.reset();
+					break;
+				}
+				completed += ring->Reap([&](const struct io_uring_cqe& cqe) { ((cqe.user_data == 0) ? written : bytesRead) = cqe.res; });
+			}
+
+			if ((written == -EINVAL) || (bytesRead == -EINVAL))
+			{
+				// Possibly a kernel without IORING_OP_READ/WRITE; the redo below reports it if not
+				ring.reset();
+			}
+		}
+
+		// Anything the ring didn't complete is done (or redone, to get its errno) synchronously
+		if (written < 0)
+		{
+			written = 0;
+		}
+		if ((static_cast<size_t>(written) < length) && !WriteFully(out, data + written, length - written, offset + written, error))
+		{
+			return false;
+		}
+		if ((bytesRead < 0) && ((bytesRead = DirectRead(in, next, readLength, readOffset)) < 0))
+		{
+			error = errno;
+			return false;
+		}
+		return true;
+	}
+
+	static ssize_t DirectRead(int fd, char* buffer, size_t length, off_t offset)
+	{
+		ssize_t bytesRead;
+		do
+		{
+			bytesRead = pread(fd, buffer, length, offset);
+		} while ((bytesRead < 0) && (errno == EINTR));
+		return bytesRead;
+	}
+
+	// The next block to read from offset, rounded up to the alignment at the end of the file
+	static size_t DirectLength(off_t offset, off_t size, size_t bufferSize)
+	{
+		uint64_t remaining = static_cast<uint64_t>(size - offset);
+		uint64_t aligned = ((remaining + CBufferPool::ALIGNMENT - 1) / CBufferPool::ALIGNMENT) * CBufferPool::ALIGNMENT;
+		return static_cast<size_t>(std::min<uint64_t>(aligned, bufferSize));
+	}
+
+	CDirectoryCache m_directories;
+};
+
+inline std::unique_ptr<CCopyBackend> CCopyBackend::Create()
+{
+	return std::unique_ptr<CCopyBackend>(new CLinuxCopyBackend());
+}
+#endif // defined(_WIN32)
@@ -0,0 +1,225 @@
+#pragma once
+
+// Orders for queueing a manifest's entries other than as listed (--order).  Each policy reduces an entry to a key taken
+// from its source's metadata; the keys are gathered in parallel on the job system, a batch of entries per job, and the
+// entries then sorted by them (stably, so ties keep their manifest order).  The workers take queued jobs roughly in the
+// order they were queued, so the copies start in that order too.
+//
+// - largest: longest-processing-time first.  The biggest files start first and the small ones fill in around them, rather
+//   than one big file near the end of the manifest leaving a single worker copying long after the rest have finished.
+// - inode: by device and inode number, which on most filesystems roughly follows where files were allocated.
+// - physical: by device and the physical offset of each file's first extent (FIEMAP / FSCTL_GET_RETRIEVAL_POINTERS), so
+//   reads sweep across a rotational disk rather than seeking back and forth.  Files with no extents to map (empty, or
+//   stored inline in their metadata) go first.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "jobsystem.h"
+#include "log.h"
+#include "manifest.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CCopyOrder
+{
+public:
+	enum EPolicy : char
+	{
+		eP_MANIFEST,	// as listed, streamed straight from the manifest
+		eP_LARGEST,
+		eP_INODE,
+		eP_PHYSICAL,
+	};
+
+	static bool Parse(const char* name, EPolicy& policy)
+	{
+		for (int index = eP_MANIFEST; index <= eP_PHYSICAL; ++index)
+		{
+			if (strcmp(name, Name(static_cast<EPolicy>(index))) == 0)
+			{
+				policy = static_cast<EPolicy>(index);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static const char* Name(EPolicy policy)
+	{
+		const char* ret = nullptr;
+		switch (policy)
+		{
+		case eP_MANIFEST:
+			ret = "manifest";
+			break;
+		case eP_LARGEST:
+			ret = "largest";
+			break;
+		case eP_INODE:
+			ret = "inode";
+			break;
+		case eP_PHYSICAL:
+			ret = "physical";
+			break;
+		default:
+			ret = "???";
+			break;
+		}
+		return ret;
+	}
+
+	// Sorts entries by policy, reading their sources' metadata on jobSystem's workers; waits for them to finish
+	static void Sort(CJobSystem& jobSystem, EPolicy policy, std::vector<CManifest::SEntry>& entries)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<SKey> keys(entries.size());
+		std::atomic_size_t unknown{ 0 };
+		for (size_t first = 0; first < entries.size(); first += BATCH_SIZE)
+		{
+			size_t last = std::min(first + BATCH_SIZE, entries.size());
+			jobSystem.AddJob([policy, &entries, &keys, &unknown, first, last]() {
+				std::string source;
+				for (size_t index = first; index < last; ++index)
+				{
+					source.assign(entries[index].m_source, entries[index].m_sourceLength);
+					keys[index].m_index = index;
+					if (!Key(policy, source, keys[index]))
+					{
+						++unknown;
+					}
+				}
+			});
+		}
+
+		while (!jobSystem.WaitForIdle(std::chrono::seconds(2)))
+		{
+			LOG_INFORMATION("Reading the sources' metadata to order them [%s]...", Name(policy));
+			jobSystem.Update();
+		}
+
+		// Largest first; otherwise lowest first, grouped by device
+		if (policy == eP_LARGEST)
+		{
+			std::stable_sort(keys.begin(), keys.end(), [](const SKey& a, const SKey& b) { return a.m_offset > b.m_offset; });
+		}
+		else
+		{
+			std::stable_sort(keys.begin(), keys.end(), [](const SKey& a, const SKey& b) { return (a.m_device < b.m_device) || ((a.m_device == b.m_device) && (a.m_offset < b.m_offset)); });
+		}
+
+		std::vector<CManifest::SEntry> sorted;
+		sorted.reserve(entries.size());
+		for (const SKey& key : keys)
+		{
+			sorted.push_back(entries[key.m_index]);
+		}
+		entries.swap(sorted);
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		LOG_INFORMATION("Ordered [%d] entries [%s] in [%.1fs]; [%d] couldn't be read and go %s", entries.size(), Name(policy), seconds, unknown.load(), (policy == eP_LARGEST) ? "last" : "first");
+	}
+
+private:
+	static const size_t BATCH_SIZE = 256;
+
+	struct SKey
+	{
+		uint64_t m_device = 0;
+		uint64_t m_offset = 0; // size, inode number or physical offset, depending on the policy
+		size_t m_index = 0;
+	};
+
+#if defined(_WIN32)
+	static bool Key(EPolicy policy, const std::string& source, SKey& key)
+	{
+		HANDLE file = CreateFileA(source.c_str(), (policy == eP_PHYSICAL) ? GENERIC_READ : 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+		BY_HANDLE_FILE_INFORMATION info;
+		if ((file == INVALID_HANDLE_VALUE) || !GetFileInformationByHandle(file, &info))
+		{
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+			}
+			return false;
+		}
+
+		key.m_device = info.dwVolumeSerialNumber;
+		if (policy == eP_LARGEST)
+		{
+			key.m_offset = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		}
+		else
+		{
+			key.m_offset = (policy == eP_INODE) ? (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow : 0;
+			if (policy == eP_PHYSICAL)
+			{
+				// Only the first extent is wanted, so a buffer too small for the rest (ERROR_MORE_DATA) is fine
+				STARTING_VCN_INPUT_BUFFER input = {};
+				RETRIEVAL_POINTERS_BUFFER output;
+				DWORD bytes = 0;
+				if ((DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &output, sizeof(output), &bytes, nullptr) || (GetLastError() == ERROR_MORE_DATA)) && (output.ExtentCount > 0) && (output.Extents[0].Lcn.QuadPart >= 0))
+				{
+					key.m_offset = static_cast<uint64_t>(output.Extents[0].Lcn.QuadPart);
+				}
+			}
+		}
+
+		CloseHandle(file);
+		return true;
+	}
+#else
+	static bool Key(EPolicy policy, const std::string& source, SKey& key)
+	{
+		if (policy != eP_PHYSICAL)
+		{
+			struct stat info;
+			if (stat(source.c_str(), &info) != 0)
+			{
+				return false;
+			}
+
+			key.m_device = static_cast<uint64_t>(info.st_dev);
+			key.m_offset = (policy == eP_LARGEST) ? static_cast<uint64_t>(info.st_size) : static_cast<uint64_t>(info.st_ino);
+			return true;
+		}
+
+		int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info;
+		if ((fd < 0) || (fstat(fd, &info) != 0))
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			return false;
+		}
+
+		key.m_device = static_cast<uint64_t>(info.st_dev);
+
+		// Just the first extent.  No FIEMAP_FLAG_SYNC: flushing dirty data to get its final location isn't worth the wait.
+		uint64_t buffer[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)] = {};
+		struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer);
+		map->fm_length = FIEMAP_MAX_OFFSET;
+		map->fm_extent_count = 1;
+		if ((ioctl(fd, FS_IOC_FIEMAP, map) == 0) && (map->fm_mapped_extents > 0) && ((map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0))
+		{
+			key.m_offset = map->fm_extents[0].fe_physical;
+		}
+
+		close(fd);
+		return true;
+	}
+#endif // defined(_WIN32)
+};
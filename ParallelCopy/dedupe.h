@@ -0,0 +1,206 @@
+#pragma once
+
+// Content deduplication at the destination (--dedupe).  Files are grouped by size first: the first file of each size is
+// copied without being read twice, and only once another file of that size turns up is anything hashed (the newcomer's
+// source, and the landed copies of that size, once each).  A file whose crc32c matches a landed copy is compared with it
+// byte for byte, so a collision can never link the wrong data, and if identical is hardlinked or reflinked to it rather
+// than written again.  Hashing happens on the workers, in parallel; the table is split into shards by size, each with its
+// own lock, which is only held for lookups and inserts and never while reading files.
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "copybackend.h"
+#include "log.h"
+
+class CDedupe
+{
+public:
+	// What Link() learned about a source, for Landed() once it's been copied
+	struct SFile
+	{
+		uint64_t m_size = 0;
+		uint32_t m_checksum = 0;
+		bool m_hashed = false;
+	};
+
+	CDedupe(CCopyBackend& backend, CCopyBackend::ELink link)
+		: m_backend(backend)
+		, m_link{ link }
+	{
+	}
+
+	// True if destination is now a link to an identical file already copied; otherwise source should be copied as usual,
+	// and passed to Landed() with file once it has been.  Called before the copy, with destination's parent created.
+	bool Link(const std::string& source, const std::string& destination, SFile& file)
+	{
+		m_backend.Detach(destination);
+		if (!m_backend.Size(source, file.m_size) || (file.m_size == 0))
+		{
+			file.m_size = 0; // empty (or missing) files aren't worth linking; let the copy deal with them
+			return false;
+		}
+
+		SShard& shard = Shard(file.m_size);
+		std::vector<std::string> unhashed;
+		{
+			std::lock_guard<std::mutex> lock(shard.m_mutex);
+			auto it = shard.m_sizes.find(file.m_size);
+			if (it == shard.m_sizes.end())
+			{
+				// First of its size, so there's nothing it could be a duplicate of yet
+				shard.m_sizes.emplace(file.m_size, std::vector<std::string>());
+				return false;
+			}
+			unhashed.swap(it->second);
+		}
+
+		// Landed copies of this size that nothing has needed hashed until now
+		for (const std::string& landed : unhashed)
+		{
+			uint32_t checksum = 0;
+			if (Hash(landed, file.m_size, checksum))
+			{
+				std::lock_guard<std::mutex> lock(shard.m_mutex);
+				shard.m_digests.emplace(SKey{ file.m_size, checksum }, landed);
+			}
+		}
+
+		if (!Hash(source, file.m_size, file.m_checksum))
+		{
+			return false;
+		}
+		file.m_hashed = true;
+
+		std::string target;
+		{
+			std::lock_guard<std::mutex> lock(shard.m_mutex);
+			auto it = shard.m_digests.find(SKey{ file.m_size, file.m_checksum });
+			if (it == shard.m_digests.end())
+			{
+				return false;
+			}
+			target = it->second;
+		}
+
+		if (target == destination)
+		{
+			return false;
+		}
+
+		if (!m_backend.Identical(source, target))
+		{
+			++m_collisions;
+			LOG_DEBUG("[%s] has the same size and crc32c as [%s] but different contents", source.c_str(), target.c_str());
+			return false;
+		}
+
+		int error = 0;
+		if (!m_backend.Link(source, target, destination, m_link, file.m_checksum, file.m_size, error))
+		{
+			if (m_linkFailures++ == 0)
+			{
+				LOG_WARNING("Unable to %s [%s] to its duplicate [%s]: error 0x%08X; copying instead (and whenever linking fails)", (m_link == CCopyBackend::eL_HARDLINK) ? "hardlink" : "reflink", destination.c_str(), target.c_str(), error);
+			}
+			return false;
+		}
+
+		++m_filesLinked;
+		m_bytesSaved += file.m_size;
+		return true;
+	}
+
+	// destination has been copied from the source Link() described in file, and can be linked to by later duplicates
+	void Landed(const std::string& destination, const SFile& file)
+	{
+		if (file.m_size == 0)
+		{
+			return;
+		}
+
+		SShard& shard = Shard(file.m_size);
+		std::lock_guard<std::mutex> lock(shard.m_mutex);
+		if (file.m_hashed)
+		{
+			shard.m_digests.emplace(SKey{ file.m_size, file.m_checksum }, destination);
+		}
+		else
+		{
+			shard.m_sizes[file.m_size].push_back(destination);
+		}
+	}
+
+	void Report()
+	{
+		uint64_t saved = m_bytesSaved;
+		uint64_t hashed = m_bytesHashed;
+		size_t linked = m_filesLinked;
+		size_t filesHashed = m_filesHashed;
+		size_t collisions = m_collisions;
+		size_t failures = m_linkFailures;
+		LOG_INFORMATION("Deduplicated [%d] files with [%s]s, saving [%llu] bytes; hashed [%d] files ([%llu] bytes) to find them; [%d] crc32c collisions, [%d] failed links", linked, (m_link == CCopyBackend::eL_HARDLINK) ? "hardlink" : "reflink", saved, filesHashed, hashed, collisions, failures);
+	}
+
+private:
+	static const size_t SHARDS = 64;
+
+	struct SKey
+	{
+		uint64_t m_size;
+		uint32_t m_checksum;
+
+		inline bool operator==(const SKey& other) const
+		{
+			return (m_size == other.m_size) && (m_checksum == other.m_checksum);
+		}
+	};
+
+	struct SKeyHash
+	{
+		inline size_t operator()(const SKey& key) const
+		{
+			return std::hash<uint64_t>()((key.m_size * 0x9E3779B97F4A7C15ULL) ^ key.m_checksum);
+		}
+	};
+
+	struct SShard
+	{
+		std::mutex m_mutex;
+		std::unordered_map<uint64_t, std::vector<std::string>> m_sizes; // every size seen, with its landed copies not yet hashed
+		std::unordered_map<SKey, std::string, SKeyHash> m_digests; // the first landed copy of each content
+	};
+
+	inline SShard& Shard(uint64_t size)
+	{
+		return m_shards[((size * 0x9E3779B97F4A7C15ULL) >> 32) % SHARDS];
+	}
+
+	bool Hash(const std::string& path, uint64_t size, uint32_t& checksum)
+	{
+		uint64_t read = 0;
+		int error = 0;
+		if (!m_backend.Checksum(path, checksum, read, error) || (read != size))
+		{
+			LOG_DEBUG("Unable to hash [%s] for deduplication: error 0x%08X", path.c_str(), error);
+			return false;
+		}
+
+		++m_filesHashed;
+		m_bytesHashed += size;
+		return true;
+	}
+
+	CCopyBackend& m_backend;
+	const CCopyBackend::ELink m_link;
+	SShard m_shards[SHARDS];
+	std::atomic_size_t m_filesLinked{ 0 };
+	std::atomic<uint64_t> m_bytesSaved{ 0 };
+	std::atomic_size_t m_filesHashed{ 0 };
+	std::atomic<uint64_t> m_bytesHashed{ 0 };
+	std::atomic_size_t m_collisions{ 0 };
+	std::atomic_size_t m_linkFailures{ 0 };
+};
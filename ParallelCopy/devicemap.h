@@ -0,0 +1,112 @@
+#pragma once
+
+// Maps manifest paths to the device (volume) they live on, for scheduling copies per device.  Looked up once per
+// directory rather than per file, and manifests tend to list a directory's files together, so the last directory is
+// checked before the map.  Only used from the thread reading the manifest.
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <sys/stat.h>
+#endif // !defined(_WIN32)
+
+class CDeviceMap
+{
+public:
+	// Device of the directory holding path; a destination directory that doesn't exist yet takes the device of its
+	// nearest existing ancestor, which is where it will be created
+	uint64_t Device(const char* path, size_t length)
+	{
+		size_t directoryLength = length;
+		while ((directoryLength > 0) && !IsSeparator(path[directoryLength - 1]))
+		{
+			--directoryLength;
+		}
+
+		if ((directoryLength == m_last.length()) && (memcmp(path, m_last.data(), directoryLength) == 0))
+		{
+			return m_lastDevice;
+		}
+
+		m_last.assign(path, directoryLength);
+		auto it = m_devices.find(m_last);
+		if (it != m_devices.end())
+		{
+			m_lastDevice = it->second;
+		}
+		else
+		{
+			m_lastDevice = Lookup(m_last);
+			m_devices.emplace(m_last, m_lastDevice);
+			m_seen.insert(m_lastDevice);
+		}
+		return m_lastDevice;
+	}
+
+	// Device of a path given on the command line, e.g. to set a limit for it
+	uint64_t Device(const char* path)
+	{
+		return Lookup(std::string(path));
+	}
+
+	// Number of distinct devices looked up
+	inline size_t Count() const
+	{
+		return m_seen.size();
+	}
+
+private:
+	static inline bool IsSeparator(char c)
+	{
+#if defined(_WIN32)
+		return (c == '\\') || (c == '/');
+#else
+		return c == '/';
+#endif // defined(_WIN32)
+	}
+
+	static uint64_t Lookup(std::string path)
+	{
+#if defined(_WIN32)
+		char volume[MAX_PATH];
+		DWORD serial = 0;
+		if (GetVolumePathNameA(path.empty() ? "." : path.c_str(), volume, sizeof(volume)) && GetVolumeInformationA(volume, nullptr, 0, &serial, nullptr, nullptr, nullptr, 0))
+		{
+			return serial;
+		}
+		return 0;
+#else
+		while (true)
+		{
+			struct stat info;
+			if (stat(path.empty() ? "." : path.c_str(), &info) == 0)
+			{
+				return static_cast<uint64_t>(info.st_dev);
+			}
+			if ((errno != ENOENT) || path.empty())
+			{
+				return 0;
+			}
+
+			// Up a level
+			while (!path.empty() && IsSeparator(path.back()))
+			{
+				path.pop_back();
+			}
+			while (!path.empty() && !IsSeparator(path.back()))
+			{
+				path.pop_back();
+			}
+		}
+#endif // defined(_WIN32)
+	}
+
+	std::unordered_map<std::string, uint64_t> m_devices;
+	std::unordered_set<uint64_t> m_seen;
+	std::string m_last{ "\n" }; // never a directory, so the first lookup misses
+	uint64_t m_lastDevice = 0;
+};
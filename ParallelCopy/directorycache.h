@@ -0,0 +1,212 @@
+#pragma once
+
+// Concurrent cache of the destination directories we've already created, so each one costs a single mkdir for the
+// whole run rather than one per file.  On Linux each directory is created by exactly one thread (anyone else asking for
+// it meanwhile waits) and we keep an O_PATH fd to it, so files and subdirectories are created with openat()/mkdirat()
+// relative to it instead of the kernel re-walking the full path every time.
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CDirectoryCache
+{
+public:
+	CDirectoryCache()
+	{
+#if !defined(_WIN32)
+		// Directory fds count against RLIMIT_NOFILE, so raise the soft limit as far as we can and keep half of it for
+		// the files being copied
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+		{
+			if (limit.rlim_cur < limit.rlim_max)
+			{
+				limit.rlim_cur = limit.rlim_max;
+				setrlimit(RLIMIT_NOFILE, &limit);
+				getrlimit(RLIMIT_NOFILE, &limit);
+			}
+			m_maxFds = (limit.rlim_cur == RLIM_INFINITY) ? 65536 : static_cast<size_t>(limit.rlim_cur / 2);
+		}
+#endif // !defined(_WIN32)
+	}
+
+	~CDirectoryCache()
+	{
+#if !defined(_WIN32)
+		for (SShard& shard : m_shards)
+		{
+			for (auto& directory : shard.m_directories)
+			{
+				if (directory.second.m_fd != AT_FDCWD)
+				{
+					close(directory.second.m_fd);
+				}
+			}
+		}
+#endif // !defined(_WIN32)
+	}
+
+	// True if path has already been created (or found to exist)
+	bool Contains(const std::string& path)
+	{
+		SShard& shard = Shard(path);
+		std::lock_guard<std::mutex> lock(shard.m_mutex);
+		auto it = shard.m_directories.find(path);
+		return (it != shard.m_directories.end()) && (it->second.m_state == eS_READY);
+	}
+
+	// Record that path exists, for platforms that create the whole path in one call
+	void Insert(const std::string& path)
+	{
+		SShard& shard = Shard(path);
+		std::lock_guard<std::mutex> lock(shard.m_mutex);
+		shard.m_directories[path].m_state = eS_READY;
+	}
+
+#if !defined(_WIN32)
+	// Makes sure path exists and returns an fd to create things relative to.  fd is AT_FDCWD when we aren't holding one
+	// for this directory (too many open already), in which case the caller should use the full path.  On failure errno
+	// is set by the syscall that failed.
+	bool Open(const std::string& path, int& fd)
+	{
+		fd = AT_FDCWD;
+		if (path.empty())
+		{
+			return true;
+		}
+
+		SShard& shard = Shard(path);
+		std::unique_lock<std::mutex> lock(shard.m_mutex);
+		while (true)
+		{
+			auto it = shard.m_directories.find(path);
+			if (it == shard.m_directories.end())
+			{
+				break;
+			}
+			else if (it->second.m_state == eS_READY)
+			{
+				fd = it->second.m_fd;
+				return true;
+			}
+
+			// Someone else is creating it; if they fail the entry is removed and we'll have a go ourselves
+			shard.m_created.wait(lock);
+		}
+
+		shard.m_directories.emplace(path, SDirectory());
+		lock.unlock();
+
+		int created = AT_FDCWD;
+		bool ok = Create(path, created);
+		int error = errno;
+
+		lock.lock();
+		if (ok)
+		{
+			SDirectory& directory = shard.m_directories[path];
+			directory.m_state = eS_READY;
+			directory.m_fd = created;
+			fd = created;
+		}
+		else
+		{
+			shard.m_directories.erase(path); // don't cache failures; they may be transient
+		}
+		shard.m_created.notify_all();
+
+		errno = error;
+		return ok;
+	}
+#endif // !defined(_WIN32)
+
+private:
+	static const size_t NUM_SHARDS = 64;
+
+	enum EState : char
+	{
+		eS_CREATING,
+		eS_READY,
+	};
+
+	struct SDirectory
+	{
+		EState m_state = eS_CREATING;
+#if !defined(_WIN32)
+		int m_fd = AT_FDCWD;
+#endif // !defined(_WIN32)
+	};
+
+	struct SShard
+	{
+		std::mutex m_mutex;
+		std::condition_variable m_created;
+		std::unordered_map<std::string, SDirectory> m_directories;
+	};
+
+	inline SShard& Shard(const std::string& path)
+	{
+		return m_shards[std::hash<std::string>()(path) % NUM_SHARDS];
+	}
+
+#if !defined(_WIN32)
+	// Creates path relative to its (recursively cached) parent
+	bool Create(const std::string& path, int& fd)
+	{
+		int parentFd = AT_FDCWD;
+		const char* name = path.c_str();
+		size_t sep = path.find_last_of('/');
+		if ((sep != std::string::npos) && (sep + 1 < path.length()))
+		{
+			size_t end = sep;
+			while ((end > 0) && (path[end - 1] == '/'))
+			{
+				--end;
+			}
+
+			if (!Open((end == 0) ? std::string("/") : path.substr(0, end), parentFd))
+			{
+				return false;
+			}
+
+			if (parentFd != AT_FDCWD)
+			{
+				name = path.c_str() + sep + 1;
+			}
+		}
+
+		if ((mkdirat(parentFd, name, 0777) != 0) && (errno != EEXIST))
+		{
+			return false;
+		}
+
+		if (m_openFds < m_maxFds)
+		{
+			fd = openat(parentFd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				return false; // exists but isn't a directory
+			}
+			++m_openFds;
+		}
+
+		return true;
+	}
+
+	std::atomic_size_t m_openFds{ 0 };
+	size_t m_maxFds = 512;
+#endif // !defined(_WIN32)
+
+	SShard m_shards[NUM_SHARDS];
+};
@@ -0,0 +1,749 @@
+#pragma once
+
+// Parallel disk usage (--disk-usage): what's filling a volume, directory by directory.  Every directory is a job on the
+// job system, reading its entries in large batches and stat'ing each relative to the directory (fstatat()), or taking
+// the sizes straight from the listing on Windows.  The walk stays on the filesystem it starts on.
+//
+// Sizes are aggregated bottom-up without locks: each directory adds up its own files, then counts its subdirectories
+// still being walked; the last of them to finish adds its total to its parent's and so on up the tree, so every
+// directory's total is added to exactly one other and the root's is the volume's once the job system goes idle.  Files
+// with more than one link are counted once, the first time their (device, inode) is seen, in a set split into shards each
+// with its own lock.
+//
+// A snapshot of every directory's totals can be saved and a later run compared against it, to see what grew.  The file is
+// a header followed by one fixed size record per directory (and its name) in pre-order, each naming its parent by index,
+// so loading one is a single read and a pass to rebuild the paths.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "jobsystem.h"
+#include "log.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CDiskUsage
+{
+public:
+	CDiskUsage(CJobSystem& jobSystem)
+		: m_jobSystem(jobSystem)
+	{
+#if !defined(_WIN32)
+		// As CTreeWalker: past this many open directories, queued ones are opened by path when their job runs instead
+		struct rlimit limit;
+		if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY))
+		{
+			m_maxFds = std::max<size_t>(static_cast<size_t>(limit.rlim_cur / 2), 16);
+		}
+#endif // !defined(_WIN32)
+	}
+
+	// Queues the walk of root; returns false if it isn't a directory.  The totals are complete when the job system goes idle.
+	bool Walk(const std::string& root)
+	{
+		std::string path(root);
+		while ((path.length() > 1) && IsSeparator(path.back()))
+		{
+			path.pop_back();
+		}
+
+		int fd = -1;
+#if defined(_WIN32)
+		HANDLE directory = Open(path);
+		BY_HANDLE_FILE_INFORMATION info;
+		if ((directory == INVALID_HANDLE_VALUE) || !GetFileInformationByHandle(directory, &info) || ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0))
+		{
+			LOG_ERROR("[%s] isn't a directory", path.c_str());
+			if (directory != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(directory);
+			}
+			return false;
+		}
+		m_device = info.dwVolumeSerialNumber;
+		CloseHandle(directory);
+#else
+		fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat info;
+		if ((fd < 0) || (fstat(fd, &info) != 0))
+		{
+			LOG_ERROR("Unable to open directory [%s]: [%s]", path.c_str(), strerror(errno));
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			return false;
+		}
+		m_device = static_cast<uint64_t>(info.st_dev);
+		++m_openFds;
+#endif // defined(_WIN32)
+
+		m_root.reset(new SNode(nullptr, path));
+#if !defined(_WIN32)
+		m_root->m_allocated = static_cast<uint64_t>(info.st_blocks) * 512;
+		m_root->m_size = static_cast<uint64_t>(info.st_size);
+#endif // !defined(_WIN32)
+		m_start = std::chrono::steady_clock::now();
+		Queue(m_root.get(), fd);
+		return true;
+	}
+
+	inline size_t Directories() const
+	{
+		return m_directories.load();
+	}
+
+	inline size_t Files() const
+	{
+		return m_files.load();
+	}
+
+	inline size_t Errors() const
+	{
+		return m_errors.load();
+	}
+
+	// The totals and the n directories using the most space
+	void Report(size_t top) const
+	{
+		if (!m_root)
+		{
+			return;
+		}
+
+		double seconds = std::chrono::duration<double>(m_finish - m_start).count();
+		uint64_t total = m_root->m_allocated;
+		LOG_INFORMATION("[%s] uses %s (%s apparent) in [%d] files and [%d] directories; scanned in [%.1fs]", m_root->m_name.c_str(), Scaled(total).c_str(), Scaled(m_root->m_size).c_str(), m_root->m_files.load(), Directories(), seconds);
+		LOG_INFORMATION("[%d] hardlinked files counted once; [%d] mount points not crossed; [%d] entries unreadable", m_hardlinks.load(), m_mounts.load(), Errors());
+
+		std::vector<const SNode*> nodes;
+		Flatten(nodes);
+		std::vector<const SNode*> largest(nodes.begin() + 1, nodes.end()); // all but the root
+		size_t count = std::min(top, largest.size());
+		std::partial_sort(largest.begin(), largest.begin() + count, largest.end(), [](const SNode* a, const SNode* b) { return a->m_allocated.load() > b->m_allocated.load(); });
+		LOG_INFORMATION("Largest [%d] directories:", count);
+		for (size_t index = 0; index < count; ++index)
+		{
+			const SNode* node = largest[index];
+			double share = (total > 0) ? (100.0 * static_cast<double>(node->m_allocated.load())) / static_cast<double>(total) : 0.0;
+			LOG_INFORMATION("%10s %5.1f%% %10d files  [%s]", Scaled(node->m_allocated).c_str(), share, node->m_files.load(), Path(node).c_str());
+		}
+	}
+
+	// Writes every directory's totals to name, for a later run to Compare() against
+	bool Save(const char* name) const
+	{
+		std::vector<const SNode*> nodes;
+		Flatten(nodes);
+
+		FILE* file = fopen(name, "wb");
+		if (file == nullptr)
+		{
+			LOG_ERROR("Unable to create snapshot [%s]", name);
+			return false;
+		}
+
+		SHeader header;
+		InitHeader(header);
+		header.m_time = static_cast<uint64_t>(time(nullptr));
+		header.m_directories = static_cast<uint32_t>(nodes.size());
+		bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+		// Pre-order, so a directory's parent is always written (and so indexed) before it
+		std::unordered_map<const SNode*, uint32_t> indices;
+		indices.reserve(nodes.size());
+		for (size_t index = 0; ok && (index < nodes.size()); ++index)
+		{
+			const SNode* node = nodes[index];
+			indices.emplace(node, static_cast<uint32_t>(index));
+			SRecord record;
+			record.m_parent = (node->m_parent != nullptr) ? indices[node->m_parent] : NO_PARENT;
+			record.m_nameLength = (node->m_parent != nullptr) ? static_cast<uint32_t>(node->m_name.length()) : 0; // the root is ""
+			record.m_allocated = node->m_allocated;
+			record.m_size = node->m_size;
+			record.m_files = node->m_files;
+			ok = (fwrite(&record, sizeof(record), 1, file) == 1) && ((record.m_nameLength == 0) || (fwrite(node->m_name.data(), record.m_nameLength, 1, file) == 1));
+		}
+
+		ok = (fclose(file) == 0) && ok;
+		if (ok)
+		{
+			LOG_INFORMATION("Saved a snapshot of [%d] directories to [%s]", nodes.size(), name);
+		}
+		else
+		{
+			LOG_ERROR("Unable to write snapshot [%s]", name);
+		}
+		return ok;
+	}
+
+	// Reports what's changed since the snapshot in name: the totals, and the n directories that grew or shrank the most
+	bool Compare(const char* name, size_t top) const
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::unordered_map<std::string, SRecord> before;
+		uint64_t taken = 0;
+		if (!Load(name, before, taken))
+		{
+			return false;
+		}
+
+		struct SChange
+		{
+			std::string m_path;
+			int64_t m_delta;
+			uint64_t m_allocated;
+			char m_state; // '+' new, '-' gone, ' ' changed
+		};
+
+		// The root's change is the total's
+		auto root = before.find(std::string());
+		int64_t delta = static_cast<int64_t>(m_root->m_allocated.load() - ((root != before.end()) ? root->second.m_allocated : 0));
+
+		std::vector<SChange> changes;
+		std::vector<const SNode*> nodes;
+		Flatten(nodes);
+		size_t added = 0;
+		for (const SNode* node : nodes)
+		{
+			std::string path(Relative(node));
+			auto it = before.find(path);
+			uint64_t allocated = node->m_allocated;
+			if (it == before.end())
+			{
+				++added;
+				changes.push_back(SChange{ path, static_cast<int64_t>(allocated), allocated, '+' });
+			}
+			else
+			{
+				if (it->second.m_allocated != allocated)
+				{
+					changes.push_back(SChange{ path, static_cast<int64_t>(allocated - it->second.m_allocated), allocated, ' ' });
+				}
+				before.erase(it);
+			}
+		}
+
+		// What's left wasn't found this time
+		for (const std::pair<const std::string, SRecord>& gone : before)
+		{
+			changes.push_back(SChange{ gone.first, -static_cast<int64_t>(gone.second.m_allocated), 0, '-' });
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double age = difftime(time(nullptr), static_cast<time_t>(taken)) / 3600.0;
+		LOG_INFORMATION("Since [%s] ([%.1f] hours ago): %s%s in total; [%d] directories changed size, [%d] new, [%d] gone; compared in [%.1fs]", name, age, (delta < 0) ? "-" : "+", Scaled(static_cast<uint64_t>((delta < 0) ? -delta : delta)).c_str(), changes.size() - added - before.size(), added, before.size(), seconds);
+
+		size_t count = std::min(top, changes.size());
+		std::partial_sort(changes.begin(), changes.begin() + count, changes.end(), [](const SChange& a, const SChange& b) { return Magnitude(a.m_delta) > Magnitude(b.m_delta); });
+		LOG_INFORMATION("Largest [%d] changes:", count);
+		for (size_t index = 0; index < count; ++index)
+		{
+			const SChange& change = changes[index];
+			LOG_INFORMATION("%c%10s %c now %10s  [%s]", (change.m_delta < 0) ? '-' : '+', Scaled(Magnitude(change.m_delta)).c_str(), change.m_state, Scaled(change.m_allocated).c_str(), Absolute(change.m_path).c_str());
+		}
+		return true;
+	}
+
+private:
+	static const size_t BUFFER_SIZE = 256 * 1024; // getdents64() / directory listing batch
+	static const size_t SHARDS = 64;
+	static const uint32_t VERSION = 1;
+	static const uint32_t NO_PARENT = UINT32_MAX;
+#if defined(_WIN32)
+	static const char SEPARATOR = '\\';
+#else
+	static const char SEPARATOR = '/';
+#endif // defined(_WIN32)
+
+	struct SNode
+	{
+		SNode(SNode* parent, const std::string& name)
+			: m_parent{ parent }
+			, m_name{ name }
+		{
+		}
+
+		SNode* m_parent;
+		std::string m_name; // the full path for the root
+		std::vector<std::unique_ptr<SNode>> m_children; // only touched by this directory's own job
+		// This directory and everything under it, once m_pending is 0; until then, what's been added so far
+		std::atomic<uint64_t> m_allocated{ 0 };
+		std::atomic<uint64_t> m_size{ 0 };
+		std::atomic<uint64_t> m_files{ 0 };
+		std::atomic<uint32_t> m_pending{ 1 }; // this directory's own read, plus each subdirectory not yet finished
+	};
+
+	struct SHeader
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_directories;
+		uint64_t m_time;
+	};
+
+	struct SRecord
+	{
+		uint32_t m_parent;
+		uint32_t m_nameLength; // the name follows the record
+		uint64_t m_allocated;
+		uint64_t m_size;
+		uint64_t m_files;
+	};
+
+	struct SInode
+	{
+		uint64_t m_device;
+		uint64_t m_inode;
+
+		inline bool operator==(const SInode& other) const
+		{
+			return (m_device == other.m_device) && (m_inode == other.m_inode);
+		}
+	};
+
+	struct SInodeHash
+	{
+		inline size_t operator()(const SInode& inode) const
+		{
+			return static_cast<size_t>((inode.m_inode * 0x9E3779B97F4A7C15ULL) ^ inode.m_device);
+		}
+	};
+
+	struct SShard
+	{
+		std::mutex m_mutex;
+		std::unordered_set<SInode, SInodeHash> m_inodes;
+	};
+
+	static void InitHeader(SHeader& header)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.m_magic, "PCDUSNAP", 8);
+		header.m_version = VERSION;
+	}
+
+	static inline bool IsSeparator(char c)
+	{
+#if defined(_WIN32)
+		return (c == '\\') || (c == '/');
+#else
+		return c == '/';
+#endif // defined(_WIN32)
+	}
+
+	static inline uint64_t Magnitude(int64_t delta)
+	{
+		return (delta < 0) ? static_cast<uint64_t>(-delta) : static_cast<uint64_t>(delta);
+	}
+
+	static std::string Scaled(uint64_t bytes)
+	{
+		static const char* units[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+		double value = static_cast<double>(bytes);
+		size_t unit = 0;
+		while ((value >= 1024.0) && (unit < (sizeof(units) / sizeof(units[0])) - 1))
+		{
+			value /= 1024.0;
+			++unit;
+		}
+		char text[32];
+		snprintf(text, sizeof(text), "%.2f%s", value, units[unit]);
+		return text;
+	}
+
+	// Path of node relative to the root ("" for the root itself), as saved in snapshots
+	static std::string Relative(const SNode* node)
+	{
+		std::vector<const SNode*> chain;
+		for (; node->m_parent != nullptr; node = node->m_parent)
+		{
+			chain.push_back(node);
+		}
+		std::string path;
+		for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+		{
+			if (!path.empty())
+			{
+				path += SEPARATOR;
+			}
+			path += (*it)->m_name;
+		}
+		return path;
+	}
+
+	std::string Absolute(const std::string& relative) const
+	{
+		return relative.empty() ? m_root->m_name : (IsSeparator(m_root->m_name.back()) ? m_root->m_name : m_root->m_name + SEPARATOR) + relative;
+	}
+
+	inline std::string Path(const SNode* node) const
+	{
+		return Absolute(Relative(node));
+	}
+
+	// Every directory, pre-order
+	void Flatten(std::vector<const SNode*>& nodes) const
+	{
+		std::vector<const SNode*> stack;
+		if (m_root)
+		{
+			stack.push_back(m_root.get());
+		}
+		while (!stack.empty())
+		{
+			const SNode* node = stack.back();
+			stack.pop_back();
+			nodes.push_back(node);
+			for (auto it = node->m_children.rbegin(); it != node->m_children.rend(); ++it)
+			{
+				stack.push_back(it->get());
+			}
+		}
+	}
+
+	// Loads a snapshot into a map of relative path to totals
+	static bool Load(const char* name, std::unordered_map<std::string, SRecord>& records, uint64_t& taken)
+	{
+		FILE* file = fopen(name, "rb");
+		if (file == nullptr)
+		{
+			LOG_ERROR("Unable to open snapshot [%s]", name);
+			return false;
+		}
+
+		std::vector<char> data;
+		char buffer[64 * 1024];
+		size_t read;
+		while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			data.insert(data.end(), buffer, buffer + read);
+		}
+		fclose(file);
+
+		SHeader expected;
+		InitHeader(expected);
+		SHeader header;
+		if ((data.size() < sizeof(SHeader)) || (memcpy(&header, data.data(), sizeof(header)), memcmp(header.m_magic, expected.m_magic, sizeof(header.m_magic)) != 0) || (header.m_version != VERSION))
+		{
+			LOG_ERROR("[%s] isn't a disk usage snapshot", name);
+			return false;
+		}
+
+		taken = header.m_time;
+		std::vector<std::string> paths;
+		paths.reserve(header.m_directories);
+		records.reserve(header.m_directories);
+		size_t offset = sizeof(SHeader);
+		for (uint32_t index = 0; index < header.m_directories; ++index)
+		{
+			SRecord record;
+			if (data.size() - offset < sizeof(record))
+			{
+				break;
+			}
+			memcpy(&record, data.data() + offset, sizeof(record));
+			offset += sizeof(record);
+			if ((data.size() - offset < record.m_nameLength) || ((record.m_parent != NO_PARENT) && (record.m_parent >= index)))
+			{
+				break;
+			}
+
+			std::string path;
+			if (record.m_parent != NO_PARENT)
+			{
+				path = paths[record.m_parent];
+				if (!path.empty())
+				{
+					path += SEPARATOR;
+				}
+				path.append(data.data() + offset, record.m_nameLength);
+			}
+			offset += record.m_nameLength;
+			records.emplace(path, record);
+			paths.push_back(std::move(path));
+		}
+
+		if (paths.size() != header.m_directories)
+		{
+			LOG_ERROR("Snapshot [%s] is truncated or corrupt", name);
+			return false;
+		}
+		return true;
+	}
+
+	// True the first time a file with more than one link is seen
+	bool FirstLink(uint64_t device, uint64_t inode)
+	{
+		SInode key{ device, inode };
+		SShard& shard = m_shards[SInodeHash()(key) % SHARDS];
+		std::lock_guard<std::mutex> lock(shard.m_mutex);
+		return shard.m_inodes.insert(key).second;
+	}
+
+	void Queue(SNode* node, int fd)
+	{
+		m_jobSystem.AddJob([this, node, fd]() {
+			Directory(node, fd);
+		});
+	}
+
+	// node and everything under it is done; the last of a directory's subdirectories to finish carries its total upwards
+	void Finish(SNode* node)
+	{
+		while ((node != nullptr) && (--node->m_pending == 0))
+		{
+			SNode* parent = node->m_parent;
+			if (parent != nullptr)
+			{
+				parent->m_allocated += node->m_allocated.load();
+				parent->m_size += node->m_size.load();
+				parent->m_files += node->m_files.load();
+			}
+			else
+			{
+				m_finish = std::chrono::steady_clock::now();
+			}
+			node = parent;
+		}
+	}
+
+	// Reads one directory; fd is the directory already opened by its parent's job, or -1 to open it by path
+	void Directory(SNode* node, int fd)
+	{
+		uint64_t allocated = 0;
+		uint64_t size = 0;
+		uint64_t files = 0;
+		if (Read(node, fd, allocated, size, files))
+		{
+			++m_directories;
+		}
+		else
+		{
+			++m_errors;
+		}
+
+		node->m_allocated += allocated;
+		node->m_size += size;
+		node->m_files += files;
+		m_files += files;
+
+		// Counted before any is queued, so a subdirectory finishing first can't carry this one's total up early
+		node->m_pending += static_cast<uint32_t>(node->m_children.size());
+		for (size_t index = 0; index < node->m_children.size(); ++index)
+		{
+			SNode* child = node->m_children[index].get();
+			int childFd = -1;
+#if !defined(_WIN32)
+			if ((fd >= 0) && (m_openFds.load() < m_maxFds))
+			{
+				childFd = openat(fd, child->m_name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (childFd >= 0)
+				{
+					++m_openFds;
+				}
+			}
+#endif // !defined(_WIN32)
+			Queue(child, childFd);
+		}
+
+#if !defined(_WIN32)
+		if (fd >= 0)
+		{
+			close(fd);
+			--m_openFds;
+		}
+#endif // !defined(_WIN32)
+		Finish(node);
+	}
+
+#if defined(_WIN32)
+	static HANDLE Open(const std::string& path)
+	{
+		return CreateFileA(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	}
+
+	// The listing has each entry's sizes and file id, but not its link count, so every file's id goes through the set
+	bool Read(SNode* node, int& fd, uint64_t& allocated, uint64_t& size, uint64_t& files)
+	{
+		std::string path(Path(node));
+		HANDLE directory = Open(path);
+		if (directory == INVALID_HANDLE_VALUE)
+		{
+			LOG_ERROR("Unable to open directory [%s]: error 0x%08X", path.c_str(), GetLastError());
+			return false;
+		}
+
+		thread_local std::unique_ptr<uint64_t[]> buffer(new uint64_t[BUFFER_SIZE / sizeof(uint64_t)]);
+		FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+		bool ok = true;
+		while (GetFileInformationByHandleEx(directory, infoClass, buffer.get(), static_cast<DWORD>(BUFFER_SIZE)))
+		{
+			infoClass = FileIdBothDirectoryInfo;
+			const char* entry = reinterpret_cast<const char*>(buffer.get());
+			while (true)
+			{
+				const FILE_ID_BOTH_DIR_INFO* info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(entry);
+				char name[MAX_PATH * 3];
+				int length = WideCharToMultiByte(CP_ACP, 0, info->FileName, static_cast<int>(info->FileNameLength / sizeof(WCHAR)), name, sizeof(name) - 1, nullptr, nullptr);
+				name[std::max(length, 0)] = 0;
+				if ((name[0] == '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0))))
+				{
+					// neither counted nor walked
+				}
+				else if ((info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+				{
+					++m_mounts; // junctions, mount points and symlinks
+				}
+				else if ((info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+				{
+					node->m_children.emplace_back(new SNode(node, name));
+				}
+				else if (FirstLink(m_device, static_cast<uint64_t>(info->FileId.QuadPart)))
+				{
+					allocated += static_cast<uint64_t>(info->AllocationSize.QuadPart);
+					size += static_cast<uint64_t>(info->EndOfFile.QuadPart);
+					++files;
+				}
+				else
+				{
+					++m_hardlinks;
+				}
+
+				if (info->NextEntryOffset == 0)
+				{
+					break;
+				}
+				entry += info->NextEntryOffset;
+			}
+		}
+
+		if (GetLastError() != ERROR_NO_MORE_FILES)
+		{
+			LOG_ERROR("Unable to read directory [%s]: error 0x%08X", path.c_str(), GetLastError());
+			ok = false;
+		}
+		CloseHandle(directory);
+		return ok;
+	}
+#else
+	// The kernel's struct linux_dirent64, which glibc doesn't export
+	struct SDirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+
+	bool Read(SNode* node, int& fd, uint64_t& allocated, uint64_t& size, uint64_t& files)
+	{
+		if (fd < 0)
+		{
+			std::string path(Path(node));
+			fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd < 0)
+			{
+				LOG_ERROR("Unable to open directory [%s]: [%s]", path.c_str(), strerror(errno));
+				return false;
+			}
+			++m_openFds;
+		}
+
+		thread_local std::unique_ptr<char[]> buffer(new char[BUFFER_SIZE]);
+		while (true)
+		{
+			long bytes = syscall(SYS_getdents64, fd, buffer.get(), BUFFER_SIZE);
+			if (bytes == 0)
+			{
+				return true;
+			}
+			else if (bytes < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				LOG_ERROR("Unable to read directory [%s]: [%s]", Path(node).c_str(), strerror(errno));
+				return false;
+			}
+
+			for (long offset = 0; offset < bytes; )
+			{
+				const SDirent64* entry = reinterpret_cast<const SDirent64*>(buffer.get() + offset);
+				offset += entry->d_reclen;
+				const char* name = entry->d_name;
+				if ((name[0] == '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0))))
+				{
+					continue;
+				}
+
+				struct stat info;
+				if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+				{
+					++m_errors;
+					LOG_DEBUG("Unable to stat [%s/%s]: [%s]", Path(node).c_str(), name, strerror(errno));
+					continue;
+				}
+
+				if (S_ISDIR(info.st_mode))
+				{
+					if (static_cast<uint64_t>(info.st_dev) != m_device)
+					{
+						++m_mounts;
+						continue;
+					}
+
+					// A directory's own blocks count towards it rather than its parent, as du has it
+					SNode* child = new SNode(node, name);
+					node->m_children.emplace_back(child);
+					child->m_allocated = static_cast<uint64_t>(info.st_blocks) * 512;
+					child->m_size = static_cast<uint64_t>(info.st_size);
+				}
+				else if ((info.st_nlink <= 1) || FirstLink(static_cast<uint64_t>(info.st_dev), static_cast<uint64_t>(info.st_ino)))
+				{
+					allocated += static_cast<uint64_t>(info.st_blocks) * 512;
+					size += static_cast<uint64_t>(info.st_size);
+					++files;
+				}
+				else
+				{
+					++m_hardlinks;
+				}
+			}
+		}
+	}
+#endif // defined(_WIN32)
+
+	CJobSystem& m_jobSystem;
+	std::unique_ptr<SNode> m_root;
+	uint64_t m_device = 0; // the walk doesn't leave the root's filesystem
+	std::chrono::steady_clock::time_point m_start;
+	std::chrono::steady_clock::time_point m_finish;
+	SShard m_shards[SHARDS];
+	std::atomic<size_t> m_directories{ 0 };
+	std::atomic<size_t> m_files{ 0 };
+	std::atomic<size_t> m_hardlinks{ 0 };
+	std::atomic<size_t> m_mounts{ 0 };
+	std::atomic<size_t> m_errors{ 0 };
+	std::atomic<size_t> m_openFds{ 0 };
+	size_t m_maxFds = 1024;
+};
@@ -0,0 +1,335 @@
+#pragma once
+
+// Free space queries (statvfs / GetDiskFreeSpaceEx) run concurrently on a job system of their own, each given a timeout, so
+// one hung mount or unreachable share is reported as such instead of holding up everything after it.  A query can't be
+// cancelled once it's stuck in the kernel, so the workers running any that timed out are abandoned rather than joined.
+//
+// Also the pre-flight capacity check: the space a manifest's sources need (their allocated size, rounded up to each
+// destination's block size) is summed per destination filesystem and compared with what's available there before any
+// copying starts.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "devicemap.h"
+#include "jobsystem.h"
+#include "log.h"
+#include "manifest.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#endif // !defined(_WIN32)
+
+class CFreeSpace
+{
+public:
+	enum EPreflight : char
+	{
+		eP_NONE,
+		eP_WARN,	// log the filesystems without room and copy anyway
+		eP_REFUSE,	// don't start copying
+	};
+
+	struct SSpace
+	{
+		uint64_t m_total = 0;
+		uint64_t m_available = 0; // to us, which may be less than is free
+		uint64_t m_blockSize = 0;
+		int m_error = 0;
+		bool m_timedOut = false;
+	};
+
+	~CFreeSpace()
+	{
+		if (m_stuck > 0)
+		{
+			// Joining would wait as long as the stuck queries do; the process exiting takes the workers with it
+			LOG_WARNING("Abandoning [%d] free space queries that never returned", m_stuck);
+			m_jobSystem.release();
+		}
+	}
+
+	// Queries every path at once; any that haven't answered within timeout (of being queued) come back as timed out
+	std::vector<SSpace> Query(const std::vector<std::string>& paths, std::chrono::milliseconds timeout)
+	{
+		struct SState
+		{
+			std::mutex m_mutex;
+			std::condition_variable m_answered;
+			std::vector<SSpace> m_spaces;
+			std::vector<bool> m_done;
+			size_t m_remaining = 0;
+		};
+
+		std::shared_ptr<SState> state = std::make_shared<SState>();
+		state->m_spaces.resize(paths.size());
+		state->m_done.resize(paths.size(), false);
+		state->m_remaining = paths.size();
+
+		// A thread per query (up to a point), so a hung filesystem only holds up its own
+		if (!m_jobSystem)
+		{
+			m_jobSystem.reset(new CJobSystem(std::min<size_t>(std::max<size_t>(paths.size(), 1), static_cast<size_t>(MAX_THREADS))));
+		}
+
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+		for (size_t index = 0; index < paths.size(); ++index)
+		{
+			// The job shares the state and has its own copy of the path, so it's safe to answer after we've given up on it
+			std::string path = paths[index];
+			m_jobSystem->AddJob([state, index, path]() {
+				SSpace space;
+				Space(path, space);
+				std::lock_guard<std::mutex> lock(state->m_mutex);
+				if (!state->m_spaces[index].m_timedOut)
+				{
+					state->m_spaces[index] = space;
+					state->m_done[index] = true;
+					--state->m_remaining;
+					state->m_answered.notify_one();
+				}
+			});
+		}
+
+		std::unique_lock<std::mutex> lock(state->m_mutex);
+		state->m_answered.wait_until(lock, deadline, [&state]() { return state->m_remaining == 0; });
+		for (size_t index = 0; index < paths.size(); ++index)
+		{
+			if (!state->m_done[index])
+			{
+				state->m_spaces[index].m_timedOut = true;
+				++m_stuck;
+			}
+		}
+		return state->m_spaces;
+	}
+
+	// The free space report: one line per path, in the order given
+	bool Report(const std::vector<std::string>& paths, std::chrono::milliseconds timeout)
+	{
+		std::vector<SSpace> spaces = Query(paths, timeout);
+		bool all = true;
+		for (size_t index = 0; index < paths.size(); ++index)
+		{
+			const SSpace& space = spaces[index];
+			if (space.m_timedOut)
+			{
+				LOG_ERROR("Unable to query [%s]: no answer after [%dms]", paths[index].c_str(), static_cast<int>(timeout.count()));
+				all = false;
+			}
+			else if (space.m_error != 0)
+			{
+				LOG_ERROR("Unable to query [%s]: error 0x%08X", paths[index].c_str(), space.m_error);
+				all = false;
+			}
+			else
+			{
+				double used = (space.m_total > 0) ? static_cast<double>(space.m_total - std::min(space.m_available, space.m_total)) / static_cast<double>(space.m_total) : 0.0;
+				LOG_INFORMATION("[%s] - %.2fGB, %.2f%% full (%.2fGB available)", paths[index].c_str(), ToGB(space.m_total), used * 100.0, ToGB(space.m_available));
+			}
+		}
+		return all;
+	}
+
+	// Checks each destination filesystem has room for the entries copied to it, reading the sources' sizes on jobSystem's
+	// workers; returns false if any doesn't.  Filesystems that can't be queried in time are warned about and let through.
+	bool Preflight(CJobSystem& jobSystem, const std::vector<CManifest::SEntry>& entries, std::chrono::milliseconds timeout)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		// Started first, so the sizes are read while the destination filesystems are being queried
+		std::vector<uint64_t> sizes(entries.size());
+		for (size_t first = 0; first < entries.size(); first += BATCH_SIZE)
+		{
+			size_t last = std::min(first + BATCH_SIZE, entries.size());
+			jobSystem.AddJob([&entries, &sizes, first, last]() {
+				std::string source;
+				for (size_t index = first; index < last; ++index)
+				{
+					source.assign(entries[index].m_source, entries[index].m_sourceLength);
+					sizes[index] = Allocated(source);
+				}
+			});
+		}
+
+		// Which filesystem each destination lands on, and an existing directory on each to query
+		CDeviceMap devices;
+		std::unordered_map<uint64_t, uint32_t> filesystemIndex;
+		std::vector<std::string> filesystems;
+		std::vector<uint32_t> destinations(entries.size());
+		for (size_t index = 0; index < entries.size(); ++index)
+		{
+			const CManifest::SEntry& entry = entries[index];
+			uint64_t device = devices.Device(entry.m_destination, entry.m_destinationLength);
+			auto it = filesystemIndex.find(device);
+			if (it == filesystemIndex.end())
+			{
+				it = filesystemIndex.emplace(device, static_cast<uint32_t>(filesystems.size())).first;
+				filesystems.push_back(Existing(std::string(entry.m_destination, entry.m_destinationLength)));
+			}
+			destinations[index] = it->second;
+		}
+
+		std::vector<SSpace> spaces = Query(filesystems, timeout);
+		while (!jobSystem.WaitForIdle(std::chrono::seconds(2)))
+		{
+			LOG_INFORMATION("Reading the sources' sizes to check there's room for them...");
+			jobSystem.Update();
+		}
+
+		std::vector<uint64_t> needed(filesystems.size(), 0);
+		std::vector<size_t> files(filesystems.size(), 0);
+		for (size_t index = 0; index < entries.size(); ++index)
+		{
+			uint32_t filesystem = destinations[index];
+			uint64_t blockSize = std::max<uint64_t>(spaces[filesystem].m_blockSize, 1);
+			needed[filesystem] += ((sizes[index] + blockSize - 1) / blockSize) * blockSize;
+			++files[filesystem];
+		}
+
+		bool room = true;
+		for (size_t filesystem = 0; filesystem < filesystems.size(); ++filesystem)
+		{
+			const SSpace& space = spaces[filesystem];
+			const char* path = filesystems[filesystem].c_str();
+			if (space.m_timedOut || (space.m_error != 0))
+			{
+				LOG_WARNING("Unable to check the space on [%s] (%s); [%d] files needing %.2fGB are copied there", path, space.m_timedOut ? "no answer in time" : "query failed", files[filesystem], ToGB(needed[filesystem]));
+			}
+			else if (needed[filesystem] > space.m_available)
+			{
+				LOG_WARNING("[%s] doesn't have room: [%d] files need %.2fGB and only %.2fGB is available", path, files[filesystem], ToGB(needed[filesystem]), ToGB(space.m_available));
+				room = false;
+			}
+			else
+			{
+				LOG_INFORMATION("[%s] has room: [%d] files need %.2fGB of the %.2fGB available", path, files[filesystem], ToGB(needed[filesystem]), ToGB(space.m_available));
+			}
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		LOG_INFORMATION("Pre-flight check of [%d] entries on [%d] destination filesystems took [%.1fs]", entries.size(), filesystems.size(), seconds);
+		return room;
+	}
+
+private:
+	static const size_t BATCH_SIZE = 256;
+	static const size_t MAX_THREADS = 64;
+
+	static inline double ToGB(uint64_t bytes)
+	{
+		return static_cast<double>(bytes) / (1024.0 * 1024.0 * 1024.0);
+	}
+
+	static inline bool IsSeparator(char c)
+	{
+#if defined(_WIN32)
+		return (c == '\\') || (c == '/');
+#else
+		return c == '/';
+#endif // defined(_WIN32)
+	}
+
+	// The nearest existing directory above destination, which is where it will be created
+	static std::string Existing(std::string path)
+	{
+		while (true)
+		{
+			while (!path.empty() && IsSeparator(path.back()))
+			{
+				path.pop_back();
+			}
+			while (!path.empty() && !IsSeparator(path.back()))
+			{
+				path.pop_back();
+			}
+			if (path.empty())
+			{
+				return ".";
+			}
+#if defined(_WIN32)
+			if (GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES)
+			{
+				return path;
+			}
+#else
+			struct stat info;
+			if ((stat(path.c_str(), &info) == 0) || (errno != ENOENT))
+			{
+				return path;
+			}
+#endif // defined(_WIN32)
+		}
+	}
+
+#if defined(_WIN32)
+	static void Space(const std::string& path, SSpace& space)
+	{
+		// A share's root has to end in a separator
+		std::string directory(path);
+		if (!directory.empty() && !IsSeparator(directory.back()))
+		{
+			directory += '\\';
+		}
+
+		ULARGE_INTEGER available;
+		ULARGE_INTEGER total;
+		if (!GetDiskFreeSpaceExA(directory.c_str(), &available, &total, nullptr))
+		{
+			space.m_error = (int)GetLastError();
+			return;
+		}
+
+		space.m_available = available.QuadPart;
+		space.m_total = total.QuadPart;
+		DWORD sectorsPerCluster = 0;
+		DWORD bytesPerSector = 0;
+		DWORD freeClusters = 0;
+		DWORD clusters = 0;
+		space.m_blockSize = GetDiskFreeSpaceA(directory.c_str(), &sectorsPerCluster, &bytesPerSector, &freeClusters, &clusters) ? static_cast<uint64_t>(sectorsPerCluster) * bytesPerSector : 4096;
+	}
+
+	static uint64_t Allocated(const std::string& source)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		return GetFileAttributesExA(source.c_str(), GetFileExInfoStandard, &info) ? (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow : 0;
+	}
+#else
+	static void Space(const std::string& path, SSpace& space)
+	{
+		struct statvfs info;
+		if (statvfs(path.c_str(), &info) != 0)
+		{
+			space.m_error = errno;
+			return;
+		}
+
+		space.m_total = static_cast<uint64_t>(info.f_blocks) * info.f_frsize;
+		space.m_available = static_cast<uint64_t>(info.f_bavail) * info.f_frsize;
+		space.m_blockSize = info.f_frsize;
+	}
+
+	// Sparse files only need their data copied (see CLinuxCopyBackend::SparseCopy())
+	static uint64_t Allocated(const std::string& source)
+	{
+		struct stat info;
+		if (stat(source.c_str(), &info) != 0)
+		{
+			return 0;
+		}
+		return std::min(static_cast<uint64_t>(info.st_size), static_cast<uint64_t>(info.st_blocks) * 512);
+	}
+#endif // defined(_WIN32)
+
+	std::unique_ptr<CJobSystem> m_jobSystem;
+	size_t m_stuck = 0;
+};
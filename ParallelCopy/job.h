@@ -0,0 +1,132 @@
+#pragma once
+
+// Move-only, type erased void() callable for the job system.  Unlike std::function, the lambdas it's given (a few
+// pointers and counts, or a couple of std::strings for a retry) are stored inline rather than on the heap, so making,
+// queueing and running a job allocates nothing.  Anything bigger still works, but is allocated.
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+class CJob
+{
+public:
+	static const size_t INLINE_SIZE = 96;
+
+	CJob() {}
+	CJob(std::nullptr_t) {}
+
+	template<typename functor, typename = typename std::enable_if<!std::is_same<typename std::decay<functor>::type, CJob>::value>::type>
+	CJob(functor&& function)
+	{
+		typedef typename std::decay<functor>::type type;
+		Construct<type>(std::forward<functor>(function), std::integral_constant<bool, SFits<type>::value>());
+	}
+
+	CJob(CJob&& other)
+	{
+		MoveFrom(other);
+	}
+
+	CJob& operator=(CJob&& other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			MoveFrom(other);
+		}
+		return *this;
+	}
+
+	~CJob()
+	{
+		Reset();
+	}
+
+	inline void operator()()
+	{
+		m_ops->m_invoke(m_storage);
+	}
+
+	inline explicit operator bool() const
+	{
+		return m_ops != nullptr;
+	}
+
+	void Reset()
+	{
+		if (m_ops != nullptr)
+		{
+			m_ops->m_destroy(m_storage);
+			m_ops = nullptr;
+		}
+	}
+
+private:
+	CJob(const CJob&) = delete;
+	CJob& operator=(const CJob&) = delete;
+
+	struct SOps
+	{
+		void(*m_invoke)(void* storage);
+		void(*m_move)(void* from, void* to); // move constructs into to, destroying from
+		void(*m_destroy)(void* storage);
+	};
+
+	// Stored inline if it fits and moving it can't throw (a job is moved between queues with no way to undo half a move)
+	template<typename type>
+	struct SFits : std::integral_constant<bool, (sizeof(type) <= INLINE_SIZE) && (alignof(type) <= alignof(std::max_align_t)) && std::is_nothrow_move_constructible<type>::value>
+	{
+	};
+
+	template<typename type>
+	struct SInline
+	{
+		static void Invoke(void* storage) { (*static_cast<type*>(storage))(); }
+		static void Move(void* from, void* to) { new (to) type(std::move(*static_cast<type*>(from))); static_cast<type*>(from)->~type(); }
+		static void Destroy(void* storage) { static_cast<type*>(storage)->~type(); }
+		static const SOps s_ops;
+	};
+
+	template<typename type>
+	struct SHeap
+	{
+		static void Invoke(void* storage) { (**static_cast<type**>(storage))(); }
+		static void Move(void* from, void* to) { *static_cast<type**>(to) = *static_cast<type**>(from); }
+		static void Destroy(void* storage) { delete *static_cast<type**>(storage); }
+		static const SOps s_ops;
+	};
+
+	template<typename type, typename functor>
+	void Construct(functor&& function, std::true_type)
+	{
+		new (m_storage) type(std::forward<functor>(function));
+		m_ops = &SInline<type>::s_ops;
+	}
+
+	template<typename type, typename functor>
+	void Construct(functor&& function, std::false_type)
+	{
+		*reinterpret_cast<type**>(m_storage) = new type(std::forward<functor>(function));
+		m_ops = &SHeap<type>::s_ops;
+	}
+
+	void MoveFrom(CJob& other)
+	{
+		if (other.m_ops != nullptr)
+		{
+			other.m_ops->m_move(other.m_storage, m_storage);
+			m_ops = other.m_ops;
+			other.m_ops = nullptr;
+		}
+	}
+
+	alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+	const SOps* m_ops = nullptr;
+};
+
+template<typename type>
+const CJob::SOps CJob::SInline<type>::s_ops = { &CJob::SInline<type>::Invoke, &CJob::SInline<type>::Move, &CJob::SInline<type>::Destroy };
+
+template<typename type>
+const CJob::SOps CJob::SHeap<type>::s_ops = { &CJob::SHeap<type>::Invoke, &CJob::SHeap<type>::Move, &CJob::SHeap<type>::Destroy };
@@ -1,278 +1,1548 @@
-#pragma once
-
-// job system stuff
-//#include <atomic>
-#include <chrono>
-#include <deque>
-#include <functional>
-#include <mutex>
-#include <string>
-#include <thread>
-#include <utility>
-#include <vector>
-
-#include "thread.h"
-
-#define THREAD_ID "[" << std::this_thread::get_id() << "] "
-
-volatile std::atomic<uint64_t> JOBID = 0;
-//
-// TODO: for a thread worker pool with floating affinity, or a round-robin affinity pool, specifying thread affinity for a job is meaningless.
-// If we're using a config file for threads with specific functions, then they should probably have their own job queues
-//
-
-class CJobSystem
-{
-public:
-	enum EState : char
-	{
-		S_IDLE,
-		S_RUNNING,
-		S_SHUTTING_DOWN,
-	};
-
-	// Constructor that will provide a pool of job worker threads with either unique, or 'floating' thread affinity
-	CJobSystem(size_t numThreads = 0, bool asFloatingPool = true)
-		: m_numThreads{ numThreads }
-	{
-		if (m_numThreads == 0)
-		{
-			// General good practice is 2 software threads per hardware thread; the -1 is because these are in addition to the main thread
-			m_numThreads = (std::thread::hardware_concurrency() * 2) - 1;
-		}
-
-		LOG_VERBOSE("[%d] CJobSystem constructed : m_numThreads = %d", std::this_thread::get_id(), m_numThreads);
-		CreateWorkerThreads(asFloatingPool);
-	}
-
-	// Constructor that will create threads from the supplied thread config file
-	CJobSystem(const std::string threadConfigFile)
-		: m_numThreads{ 0 }
-	{
-		// TODO: Read config file then create threads; N.B. thread affinity
-		LOG_VERBOSE("[%d] CJobSystem constructed : m_numThreads = %d", std::this_thread::get_id(), m_numThreads);
-	}
-
-	~CJobSystem()
-	{
-		Shutdown();
-	}
-
-	void Update()
-	{
-		// Main update loop to be run on the main thread, ensuring callbacks occur on the main thread
-		LOG_VERBOSE("[%d] CJobSystem::Update()", std::this_thread::get_id());
-		while (true)
-		{
-			std::function<void()>&& callback = m_callbackQueue.pop();
-			if (callback == nullptr)
-			{
-				break;
-			}
-			else
-			{
-				LOG_VERBOSE("[%d] CJobSystem::Update(): servicing callback", std::this_thread::get_id());
-				callback();
-			}
-		}
-	}
-
-	// TODO: create AddJob() with thread affinity
-	inline void AddJob(std::function<void()>&& function)
-	{
-		m_jobQueue.push(std::forward<std::function<void()>>(function));
-	}
-
-	inline size_t JobCount()
-	{
-		return m_jobQueue.size();
-	}
-
-	inline size_t JobsRunning()
-	{
-		return m_jobQueue.running();
-	}
-
-	inline size_t NumThreads()
-	{
-		return m_numThreads;
-	}
-
-	void Shutdown()
-	{
-		LOG_VERBOSE("[%d] CJobSystem::Shutdown()", std::this_thread::get_id());
-		for (CWorkerThread*& workerThread : m_workerThreads)
-		{
-			if (workerThread != nullptr)
-			{
-				delete workerThread;
-				workerThread = nullptr;
-			}
-		}
-	}
-
-private:
-	// 'Floating' affinity means threads will be balanced on the cores according to core load
-	// 'Unique' affinity locks threads to cores in a round-robin way.
-	void CreateWorkerThreads(bool asFloatingPool)
-	{
-		m_workerThreads.resize(m_numThreads);
-		size_t affinityMax = std::thread::hardware_concurrency();
-		char nameBuffer[32] = "";
-		for (size_t index = 0; index < m_numThreads; ++index)
-		{
-			sprintf_s(nameBuffer, sizeof(nameBuffer), "WorkerThread%zd", index);
-			std::string name(nameBuffer);
-			m_workerThreads[index] = (asFloatingPool) ? new CWorkerThread(name, &m_jobQueue) : new CWorkerThread(name, &m_jobQueue, 1LL << (index % affinityMax));
-			LOG_DEBUG("[%d] CJobSystem::CreateWorkerThreads() created thread #%d [%d]", std::this_thread::get_id(), index, m_workerThreads[index]->GetId());
-		}
-	}
-
-	class CJobQueue
-	{
-	public:
-		// Number of jobs in the queue
-		inline size_t size()
-		{
-			return m_queue.size();
-		}
-
-		// Number of jobs currently running on worker threads
-		inline size_t running()
-		{
-			return m_running;
-		}
-
-		// Worker thread calls this before calling the job functor
-		inline void jobStarted()
-		{
-			++m_running;
-		}
-
-		// Worker thread calls this after returning from the job functor
-		inline void jobFinished()
-		{
-			--m_running;
-		}
-
-		void push(std::function<void()>&& function, uint64_t&& affinityMask = std::numeric_limits<uint64_t>::max())
-		{
-			std::lock_guard<std::mutex> lock(m_mutex);
-			LOG_VERBOSE("[%d] CJobQueue::push() Adding job to jobqueue", std::this_thread::get_id());
-			m_queue.push_back(SJobInfo(std::forward<std::function<void()>>(function), std::forward<uint64_t>(affinityMask), std::forward<uint64_t>(JOBID++)));
-		}
-
-		// TODO: pop needs to consider job thread affinity
-		std::function<void()> pop()
-		{
-			std::lock_guard<std::mutex> lock(m_mutex);
-			if (!m_queue.empty())
-			{
-				LOG_VERBOSE("[%d] CJobQueue::pop() Removing job from jobqueue", std::this_thread::get_id());
-				std::function<void()> outFunction(std::move(m_queue.front().m_function));
-				uint64_t jobID(std::move(m_queue.front().m_jobID));
-				m_queue.pop_front();
-				LOG_VERBOSE("[%d] CJobQueue::pop() Removed job [%d] from jobqueue", std::this_thread::get_id(), jobID);
-				return outFunction;
-			}
-			LOG_VERBOSE("[%d] CJobQueue::pop() Jobqueue empty", std::this_thread::get_id());
-			return nullptr;
-		}
-
-	private:
-		struct SJobInfo
-		{
-			SJobInfo(std::function<void()>&& function, uint64_t&& affinityMask, uint64_t&& jobID)
-				: m_affinityMask{ std::forward<uint64_t>(affinityMask) }
-				, m_jobID{ jobID }
-				, m_function{ std::forward<std::function<void()>>(function) }
-			{
-			}
-
-			uint64_t m_affinityMask;
-			uint64_t m_jobID;
-			std::function<void()> m_function;
-		};
-
-		volatile std::atomic_size_t m_running;
-		std::mutex m_mutex;
-		std::deque<SJobInfo> m_queue;
-	};
-
-	class CWorkerThread : public CThread
-	{
-	public:
-		// Worker thread with 'floating' core affinity
-		CWorkerThread(std::string& name, CJobQueue* queue)
-			: CThread{ name }
-			, m_requestTerminate{ false }
-			, m_queue{ queue }
-		{
-			auto lambda = [this]() { this->Main(); };
-			Start<decltype(lambda)>(lambda);
-		}
-
-		// Worker thread with specified core affinity
-		CWorkerThread(std::string& name, CJobQueue* queue, uint64_t coreAffinity)
-			: CThread{ name }
-			, m_requestTerminate{ false }
-			, m_queue{ queue }
-		{
-			auto lambda = [this]() { this->Main(); };
-			Start<decltype(lambda)>(lambda, coreAffinity);
-		}
-
-		~CWorkerThread()
-		{
-			RequestTerminate();
-		}
-
-		inline void RequestTerminate()
-		{
-			if (!m_requestTerminate)
-			{
-				LOG_VERBOSE("[%d] CWorkerThread::RequestTerminate() [%d]", std::this_thread::get_id(), GetId());
-				m_requestTerminate = true;
-				Join();
-			}
-		}
-
-	private:
-		//TODO: worker threads need to check for jobs for the correct affinity (need to think about this)
-		void Main()
-		{
-			LOG_VERBOSE("[%d] CWorkerThread::Main() starting", std::this_thread::get_id());
-
-			while (!m_requestTerminate)
-			{
-				std::function<void()> function(m_queue->pop());
-				if (function != nullptr)
-				{
-					LOG_VERBOSE("[%d] CWorkerThread::Main() executing function", std::this_thread::get_id());
-					m_queue->jobStarted();
-					function();
-					m_queue->jobFinished();
-				}
-				else
-				{
-					LOG_VERBOSE("[%d] CWorkerThread::Main() waiting", std::this_thread::get_id());
-					//std::this_thread::yield();
-					std::this_thread::sleep_for(std::chrono::microseconds(100));
-				}
-			}
-
-			LOG_DEBUG("[%d] CWorkerThread::Main() shutting down with %d outstanding jobs in queue", std::this_thread::get_id(), m_queue->size());
-		}
-
-		volatile std::atomic_bool m_requestTerminate;
-		std::mutex m_mutex;
-		CJobQueue* m_queue;
-	};
-
-	size_t m_numThreads;
-	CJobQueue m_jobQueue;
-	CJobQueue m_callbackQueue;
-	std::vector<CWorkerThread*> m_workerThreads;
-};
-
-
+#pragma once
+
+// job system stuff
+//#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "job.h"
+#include "thread.h"
+
+#define THREAD_ID "[" << std::this_thread::get_id() << "] "
+
+volatile std::atomic<uint64_t> JOBID = 0;
+//
+// TODO: for a thread worker pool with floating affinity, or a round-robin affinity pool, specifying thread affinity for a job is meaningless.
+// If we're using a config file for threads with specific functions, then they should probably have their own job queues
+//
+
+class CJobSystem
+{
+public:
+	enum EState : char
+	{
+		S_IDLE,
+		S_RUNNING,
+		S_SHUTTING_DOWN,
+	};
+
+	struct SDependentJob;
+
+	// A job that can wait for others to finish before it's queued, and be waited for in turn, so multi-stage work can be
+	// split into a job per stage.  Made by CreateJob(), it's queued by Submit() once every prerequisite given to
+	// AddDependency() has finished.  Shared; the job lives as long as any handle to it.
+	class CJobHandle
+	{
+	public:
+		CJobHandle() {}
+
+		inline explicit operator bool() const
+		{
+			return m_job != nullptr;
+		}
+
+		// True once the job has returned
+		bool IsFinished() const
+		{
+			std::lock_guard<std::mutex> lock(m_job->m_mutex);
+			return m_job->m_finished;
+		}
+
+	private:
+		friend class CJobSystem;
+
+		CJobHandle(std::shared_ptr<SDependentJob>&& job)
+			: m_job{ std::move(job) }
+		{
+		}
+
+		std::shared_ptr<SDependentJob> m_job;
+	};
+
+	// Constructor that will provide a pool of job worker threads with either unique, or 'floating' thread affinity
+	CJobSystem(size_t numThreads = 0, bool asFloatingPool = true)
+		: m_numThreads{ numThreads }
+	{
+		if (m_numThreads == 0)
+		{
+			// General good practice is 2 software threads per hardware thread; the -1 is because these are in addition to the main thread
+			m_numThreads = (std::thread::hardware_concurrency() * 2) - 1;
+		}
+
+		LOG_VERBOSE("[%d] CJobSystem constructed : m_numThreads = %d", std::this_thread::get_id(), m_numThreads);
+		CreateWorkerThreads(asFloatingPool);
+	}
+
+	// Constructor that will create threads from the supplied thread config file
+	CJobSystem(const std::string threadConfigFile)
+		: m_numThreads{ 0 }
+	{
+		// TODO: Read config file then create threads; N.B. thread affinity
+		LOG_VERBOSE("[%d] CJobSystem constructed : m_numThreads = %d", std::this_thread::get_id(), m_numThreads);
+	}
+
+	~CJobSystem()
+	{
+		Shutdown();
+	}
+
+	void Update()
+	{
+		// Main update loop to be run on the main thread, ensuring callbacks occur on the main thread
+		LOG_VERBOSE("[%d] CJobSystem::Update()", std::this_thread::get_id());
+		while (true)
+		{
+			CJob callback = m_callbackQueue.pop();
+			if (!callback)
+			{
+				break;
+			}
+			else
+			{
+				LOG_VERBOSE("[%d] CJobSystem::Update(): servicing callback", std::this_thread::get_id());
+				callback();
+				m_scheduler.callbackDone();
+			}
+		}
+	}
+
+	// Runs callback on the main thread, from Update(); it counts as outstanding until it has run, and the waits below
+	// service it as soon as it's queued, so workers can hand results back without the main thread polling for them
+	void AddCallback(CJob&& callback)
+	{
+		m_scheduler.callbackQueued();
+		m_callbackQueue.push(std::move(callback));
+		m_scheduler.notifyWaiters();
+	}
+
+	// A job that isn't queued until Submit(), and not then until its prerequisites have finished
+	CJobHandle CreateJob(CJob&& function)
+	{
+		return CJobHandle(std::make_shared<SDependentJob>(std::move(function), false));
+	}
+
+	// As CreateJob(), but the job runs as a callback on the main thread
+	CJobHandle CreateCallback(CJob&& callback)
+	{
+		return CJobHandle(std::make_shared<SDependentJob>(std::move(callback), true));
+	}
+
+	// As CreateJob(), but once it's ready the job waits for room on its devices, as AddDeviceJob()
+	CJobHandle CreateDeviceJob(CJob&& function, uint64_t sourceDevice, uint64_t destinationDevice)
+	{
+		return CJobHandle(std::make_shared<SDependentJob>(std::move(function), false, true, sourceDevice, destinationDevice));
+	}
+
+	// job waits for prerequisite to finish (if it hasn't already).  Only while job can't yet be queued: before it's
+	// submitted, or while it's still waiting on a prerequisite that can't finish meanwhile, e.g. from within that
+	// prerequisite, which is how a job hands its part to a retry of itself.
+	void AddDependency(const CJobHandle& job, const CJobHandle& prerequisite)
+	{
+		std::lock_guard<std::mutex> lock(prerequisite.m_job->m_mutex);
+		if (!prerequisite.m_job->m_finished)
+		{
+			++job.m_job->m_blockers;
+			prerequisite.m_job->m_continuations.push_back(job.m_job);
+		}
+	}
+
+	// From here until it's queued, the job counts as outstanding (so WaitForIdle() waits for it) without tying up a worker
+	void Submit(const CJobHandle& job)
+	{
+		m_scheduler.block();
+		Release(job.m_job);
+	}
+
+	// Submits the job once delay has passed, as AddDelayedJob()
+	template<typename Rep, typename Period>
+	void SubmitDelayed(const CJobHandle& job, const std::chrono::duration<Rep, Period>& delay)
+	{
+		m_scheduler.block();
+		std::shared_ptr<SDependentJob> delayed(job.m_job);
+		AddDelayedJob([this, delayed]() {
+			Release(delayed);
+		}, delay);
+	}
+
+	// Continuation: function runs once prerequisite has finished; on the worker that ran it if it's free, as a job queued
+	// from a worker goes on its own deque
+	CJobHandle Then(const CJobHandle& prerequisite, CJob&& function)
+	{
+		CJobHandle job = CreateJob(std::move(function));
+		AddDependency(job, prerequisite);
+		Submit(job);
+		return job;
+	}
+
+	// Continuation run as a callback on the main thread
+	CJobHandle ThenOnMainThread(const CJobHandle& prerequisite, CJob&& callback)
+	{
+		CJobHandle job = CreateCallback(std::move(callback));
+		AddDependency(job, prerequisite);
+		Submit(job);
+		return job;
+	}
+
+	// TODO: create AddJob() with thread affinity
+	// Jobs added from a worker thread go onto that worker's own deque; anything else goes through the injection queue
+	inline void AddJob(CJob&& function)
+	{
+		m_scheduler.push(std::move(function));
+	}
+
+	// Queues the job once delay has passed; until then it counts as outstanding (so WaitForIdle() waits for it) without
+	// tying up a worker
+	template<typename Rep, typename Period>
+	void AddDelayedJob(CJob&& function, const std::chrono::duration<Rep, Period>& delay)
+	{
+		if (m_timers != nullptr)
+		{
+			m_timers->add(std::move(function), std::chrono::duration_cast<std::chrono::milliseconds>(delay));
+		}
+		else
+		{
+			AddJob(std::move(function));
+		}
+	}
+
+	// Queued on devices that are busy; see AddDeviceJob()
+	inline void AddDeviceJob(CJob&& function, uint64_t sourceDevice, uint64_t destinationDevice)
+	{
+		m_devices.add(std::move(function), sourceDevice, destinationDevice);
+	}
+
+	// The most jobs that may run against any one device at once, unless set for that device; 0 for no limit
+	inline void SetDeviceLimit(size_t limit)
+	{
+		m_devices.setLimit(limit);
+	}
+
+	inline void SetDeviceLimit(uint64_t device, size_t limit)
+	{
+		m_devices.setLimit(device, limit);
+	}
+
+	inline size_t JobCount()
+	{
+		return m_scheduler.size();
+	}
+
+	inline size_t JobsRunning()
+	{
+		return m_scheduler.running();
+	}
+
+	inline size_t JobsDelayed()
+	{
+		return m_scheduler.delayed();
+	}
+
+	// Number of device jobs waiting for their device to have room
+	inline size_t JobsHeld()
+	{
+		return m_scheduler.held();
+	}
+
+	inline size_t NumThreads()
+	{
+		return m_numThreads;
+	}
+
+	// Number of workers taking jobs; the rest are parked, keeping their threads but not being woken for jobs, until it
+	// is raised again
+	inline size_t ActiveThreads()
+	{
+		return m_scheduler.active();
+	}
+
+	// Clamped to between 1 and NumThreads(); returns the new count
+	size_t SetActiveThreads(size_t numThreads)
+	{
+		numThreads = std::min(std::max<size_t>(numThreads, 1), m_numThreads);
+		m_scheduler.setActive(numThreads);
+		LOG_DEBUG("[%d] CJobSystem::SetActiveThreads() [%d] of [%d] workers active", std::this_thread::get_id(), numThreads, m_numThreads);
+		return numThreads;
+	}
+
+	// Blocks until the queue is empty and no jobs are running.  The waits are made from the main thread, and service
+	// callbacks (see AddCallback()) while they wait.
+	void WaitForIdle()
+	{
+		do
+		{
+			Update();
+		} while (!m_scheduler.waitForOutstanding(1));
+	}
+
+	// As above, but gives up after timeout; returns true if the job system went idle
+	template<typename Rep, typename Period>
+	bool WaitForIdle(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return Wait(1, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+	}
+
+	// Blocks until fewer than maxOutstanding jobs are queued or running, so a producer can't run arbitrarily far ahead
+	// of the workers; gives up after timeout and returns false if there's still no room
+	template<typename Rep, typename Period>
+	bool WaitForCapacity(size_t maxOutstanding, const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return Wait(maxOutstanding, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+	}
+
+	void Shutdown()
+	{
+		LOG_VERBOSE("[%d] CJobSystem::Shutdown()", std::this_thread::get_id());
+		if (m_timers != nullptr)
+		{
+			delete m_timers; // first, as it feeds the workers
+			m_timers = nullptr;
+		}
+		for (CWorkerThread*& workerThread : m_workerThreads)
+		{
+			if (workerThread != nullptr)
+			{
+				delete workerThread;
+				workerThread = nullptr;
+			}
+		}
+	}
+
+	// Shared between the handles to it, its continuations' prerequisites and the job queued to run it
+	struct SDependentJob
+	{
+		SDependentJob(CJob&& function, bool mainThread, bool onDevices = false, uint64_t sourceDevice = 0, uint64_t destinationDevice = 0)
+			: m_function{ std::move(function) }
+			, m_mainThread{ mainThread }
+			, m_onDevices{ onDevices }
+			, m_sourceDevice{ sourceDevice }
+			, m_destinationDevice{ destinationDevice }
+		{
+		}
+
+		CJob m_function; // released once it has run, along with whatever it holds
+		std::atomic<uint32_t> m_blockers{ 1 }; // prerequisites yet to finish, plus one until submitted
+		const bool m_mainThread;
+		const bool m_onDevices; // queued per device rather than straight to the workers
+		const uint64_t m_sourceDevice;
+		const uint64_t m_destinationDevice;
+		std::mutex m_mutex;
+		std::vector<std::shared_ptr<SDependentJob>> m_continuations; // guarded by m_mutex
+		bool m_finished = false; // guarded by m_mutex
+	};
+
+private:
+	// Queues job if that was the last thing it was waiting for
+	void Release(const std::shared_ptr<SDependentJob>& job)
+	{
+		if (--job->m_blockers != 0)
+		{
+			return;
+		}
+
+		std::shared_ptr<SDependentJob> ready(job);
+		CJob run = [this, ready]() {
+			ready->m_function();
+			Finish(ready);
+		};
+		if (job->m_mainThread)
+		{
+			AddCallback(std::move(run));
+		}
+		else if (job->m_onDevices)
+		{
+			m_devices.add(std::move(run), job->m_sourceDevice, job->m_destinationDevice);
+		}
+		else
+		{
+			m_scheduler.push(std::move(run));
+		}
+		m_scheduler.unblock(); // after the push, so the job is always counted somewhere
+	}
+
+	// The job has run; anything waiting for it that has nothing else to wait for is queued
+	void Finish(const std::shared_ptr<SDependentJob>& job)
+	{
+		job->m_function.Reset();
+		std::vector<std::shared_ptr<SDependentJob>> continuations;
+		{
+			std::lock_guard<std::mutex> lock(job->m_mutex);
+			job->m_finished = true;
+			continuations.swap(job->m_continuations);
+		}
+		for (const std::shared_ptr<SDependentJob>& continuation : continuations)
+		{
+			Release(continuation);
+		}
+	}
+
+	// Waits for fewer than limit jobs to be outstanding until deadline, running callbacks whenever any are queued
+	bool Wait(size_t limit, std::chrono::steady_clock::time_point deadline)
+	{
+		while (true)
+		{
+			Update();
+			if (m_scheduler.waitForOutstanding(limit, deadline))
+			{
+				return true;
+			}
+			if ((m_scheduler.callbacks() == 0) || (std::chrono::steady_clock::now() >= deadline))
+			{
+				return false;
+			}
+		}
+	}
+
+	// 'Floating' affinity means threads will be balanced on the cores according to core load
+	// 'Unique' affinity locks threads to cores in a round-robin way.
+	void CreateWorkerThreads(bool asFloatingPool)
+	{
+		m_scheduler.resize(m_numThreads);
+		m_workerThreads.resize(m_numThreads);
+		size_t affinityMax = std::thread::hardware_concurrency();
+		char nameBuffer[32] = "";
+		for (size_t index = 0; index < m_numThreads; ++index)
+		{
+			snprintf(nameBuffer, sizeof(nameBuffer), "WorkerThread%zd", index);
+			std::string name(nameBuffer);
+			m_workerThreads[index] = (asFloatingPool) ? new CWorkerThread(name, &m_scheduler, index) : new CWorkerThread(name, &m_scheduler, index, 1LL << (index % affinityMax));
+			LOG_DEBUG("[%d] CJobSystem::CreateWorkerThreads() created thread #%d [%d]", std::this_thread::get_id(), index, m_workerThreads[index]->GetId());
+		}
+
+		std::string name("TimerThread");
+		m_timers = new CTimerWheel(name, &m_scheduler);
+	}
+
+	struct SJobInfo
+	{
+		SJobInfo(CJob&& function, uint64_t affinityMask, uint64_t jobID)
+			: m_affinityMask{ affinityMask }
+			, m_jobID{ jobID }
+			, m_function{ std::move(function) }
+		{
+		}
+
+		uint64_t m_affinityMask;
+		uint64_t m_jobID;
+		CJob m_function;
+		SJobInfo* m_next = nullptr; // for the FIFOs it waits in
+	};
+
+	// Slab allocator for SJobInfo.  Each thread has its own free list, so allocating or freeing a job is a couple of
+	// pointer moves.  Jobs are mostly made on one thread and freed on another, so a list that grows past its limit hands a
+	// batch to a shared pool for threads that have run out to take; a new slab is only needed when every job made so far
+	// is still in use, so once a run warms up no job touches the heap.
+	class CJobAllocator
+	{
+	public:
+		static SJobInfo* New(CJob&& function, uint64_t affinityMask = std::numeric_limits<uint64_t>::max())
+		{
+			SCache& cache = Cache();
+			if (cache.m_free == nullptr)
+			{
+				Refill(cache);
+			}
+
+			SFree* node = cache.m_free;
+			cache.m_free = node->m_next;
+			--cache.m_count;
+			return new (node) SJobInfo(std::move(function), affinityMask, JOBID++);
+		}
+
+		static void Delete(SJobInfo* job)
+		{
+			job->~SJobInfo();
+			SCache& cache = Cache();
+			SFree* node = reinterpret_cast<SFree*>(job);
+			node->m_next = cache.m_free;
+			cache.m_free = node;
+			if (++cache.m_count >= 2 * BATCH)
+			{
+				SFree* batch = cache.m_free;
+				SFree* last = batch;
+				for (size_t count = 1; count < BATCH; ++count)
+				{
+					last = last->m_next;
+				}
+				cache.m_free = last->m_next;
+				cache.m_count -= BATCH;
+				last->m_next = nullptr;
+				std::lock_guard<std::mutex> lock(Shared().m_mutex);
+				Shared().m_batches.push_back(batch);
+			}
+		}
+
+	private:
+		static const size_t BATCH = 64;
+		static const size_t SLAB = 4 * BATCH;
+
+		typedef std::aligned_storage<sizeof(SJobInfo), alignof(SJobInfo)>::type SNode;
+
+		struct SFree
+		{
+			SFree* m_next;
+		};
+
+		struct SCache
+		{
+			~SCache()
+			{
+				// The thread is exiting; its jobs go back for others to use
+				if (m_free != nullptr)
+				{
+					std::lock_guard<std::mutex> lock(Shared().m_mutex);
+					Shared().m_batches.push_back(m_free);
+				}
+			}
+
+			SFree* m_free = nullptr;
+			size_t m_count = 0;
+		};
+
+		struct SShared
+		{
+			std::mutex m_mutex;
+			std::vector<SFree*> m_batches; // lists of free jobs
+			std::vector<std::unique_ptr<SNode[]>> m_slabs;
+		};
+
+		static SCache& Cache()
+		{
+			thread_local SCache cache;
+			return cache;
+		}
+
+		// Never destroyed, as jobs can outlive any static that might own it
+		static SShared& Shared()
+		{
+			static SShared* shared = new SShared();
+			return *shared;
+		}
+
+		static void Refill(SCache& cache)
+		{
+			SShared& shared = Shared();
+			std::lock_guard<std::mutex> lock(shared.m_mutex);
+			if (!shared.m_batches.empty())
+			{
+				cache.m_free = shared.m_batches.back();
+				shared.m_batches.pop_back();
+				for (SFree* node = cache.m_free; node != nullptr; node = node->m_next)
+				{
+					++cache.m_count;
+				}
+				return;
+			}
+
+			SNode* slab = new SNode[SLAB];
+			shared.m_slabs.emplace_back(slab);
+			for (size_t node = SLAB; node > 0; --node)
+			{
+				SFree* free = reinterpret_cast<SFree*>(&slab[node - 1]);
+				free->m_next = cache.m_free;
+				cache.m_free = free;
+			}
+			cache.m_count += SLAB;
+		}
+	};
+
+	// FIFO threaded through the jobs themselves, so queueing one never allocates
+	struct SJobList
+	{
+		inline bool empty() const
+		{
+			return m_head == nullptr;
+		}
+
+		void push_back(SJobInfo* job)
+		{
+			job->m_next = nullptr;
+			if (m_tail != nullptr)
+			{
+				m_tail->m_next = job;
+			}
+			else
+			{
+				m_head = job;
+			}
+			m_tail = job;
+			++m_size;
+		}
+
+		SJobInfo* pop_front()
+		{
+			SJobInfo* job = m_head;
+			if (job != nullptr)
+			{
+				m_head = job->m_next;
+				if (m_head == nullptr)
+				{
+					m_tail = nullptr;
+				}
+				--m_size;
+			}
+			return job;
+		}
+
+		void clear()
+		{
+			while (SJobInfo* job = pop_front())
+			{
+				CJobAllocator::Delete(job);
+			}
+		}
+
+		SJobInfo* m_head = nullptr;
+		SJobInfo* m_tail = nullptr;
+		size_t m_size = 0;
+	};
+
+	// Mutex protected FIFO; the scheduler's injection queue for jobs added from outside the worker threads, and the queue
+	// of callbacks to be serviced on the main thread
+	class CJobQueue
+	{
+	public:
+		~CJobQueue()
+		{
+			m_queue.clear();
+		}
+
+		// Number of jobs in the queue
+		inline size_t size()
+		{
+			return m_size.load(std::memory_order_relaxed);
+		}
+
+		void push(CJob&& function, uint64_t affinityMask = std::numeric_limits<uint64_t>::max())
+		{
+			push(CJobAllocator::New(std::move(function), affinityMask));
+		}
+
+		void push(SJobInfo* job)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			LOG_VERBOSE("[%d] CJobQueue::push() Adding job to jobqueue", std::this_thread::get_id());
+			m_queue.push_back(job);
+			m_size.store(m_queue.m_size, std::memory_order_relaxed);
+		}
+
+		// TODO: pop needs to consider job thread affinity
+		CJob pop()
+		{
+			SJobInfo* job = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				job = m_queue.pop_front();
+				m_size.store(m_queue.m_size, std::memory_order_relaxed);
+			}
+			if (job != nullptr)
+			{
+				LOG_VERBOSE("[%d] CJobQueue::pop() Removed job [%d] from jobqueue", std::this_thread::get_id(), job->m_jobID);
+				CJob function(std::move(job->m_function));
+				CJobAllocator::Delete(job);
+				return function;
+			}
+			LOG_VERBOSE("[%d] CJobQueue::pop() Jobqueue empty", std::this_thread::get_id());
+			return nullptr;
+		}
+
+		// Takes a 1/shares portion of the queue (at least one job, at most maxJobs) under a single lock
+		size_t pop(SJobInfo** jobs, size_t maxJobs, size_t shares)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			size_t count = std::min(maxJobs, (m_queue.m_size / shares) + 1);
+			count = std::min(count, m_queue.m_size);
+			for (size_t index = 0; index < count; ++index)
+			{
+				jobs[index] = m_queue.pop_front();
+			}
+			m_size.store(m_queue.m_size, std::memory_order_relaxed);
+			return count;
+		}
+
+	private:
+		std::mutex m_mutex;
+		SJobList m_queue;
+		std::atomic<size_t> m_size{ 0 };
+	};
+
+	// Chase-Lev work stealing deque, using the memory orderings from Le, Pop, Cohen & Zappa Nardelli, "Correct and
+	// Efficient Work-Stealing for Weak Memory Models".  Only the owning worker may push() and pop() (at the bottom); any
+	// thread may steal() (from the top).
+	class CWorkStealingDeque
+	{
+	public:
+		CWorkStealingDeque(int64_t capacity = 1024)
+			: m_top{ 0 }
+			, m_bottom{ 0 }
+			, m_array{ new CArray(capacity) }
+		{
+			m_arrays.emplace_back(m_array.load());
+		}
+
+		~CWorkStealingDeque()
+		{
+			while (SJobInfo* job = pop())
+			{
+				CJobAllocator::Delete(job);
+			}
+		}
+
+		inline size_t size()
+		{
+			int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			int64_t top = m_top.load(std::memory_order_relaxed);
+			return (bottom > top) ? static_cast<size_t>(bottom - top) : 0;
+		}
+
+		void push(SJobInfo* job)
+		{
+			int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			int64_t top = m_top.load(std::memory_order_acquire);
+			CArray* array = m_array.load(std::memory_order_relaxed);
+			if (bottom - top > array->capacity() - 1)
+			{
+				array = array->grow(top, bottom);
+				m_arrays.emplace_back(array);
+				m_array.store(array, std::memory_order_release);
+			}
+			array->put(bottom, job);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+
+		SJobInfo* pop()
+		{
+			int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+			CArray* array = m_array.load(std::memory_order_relaxed);
+			m_bottom.store(bottom, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t top = m_top.load(std::memory_order_relaxed);
+
+			SJobInfo* job = nullptr;
+			if (top <= bottom)
+			{
+				job = array->get(bottom);
+				if (top == bottom)
+				{
+					// Last job in the deque; race any thieves for it
+					if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					{
+						job = nullptr;
+					}
+					m_bottom.store(bottom + 1, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+
+			return job;
+		}
+
+		// Returns nullptr if the deque is empty, or if another thread won the race for the top job
+		SJobInfo* steal()
+		{
+			int64_t top = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t bottom = m_bottom.load(std::memory_order_acquire);
+			if (top < bottom)
+			{
+				SJobInfo* job = m_array.load(std::memory_order_acquire)->get(top);
+				if (m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					return job;
+				}
+			}
+
+			return nullptr;
+		}
+
+	private:
+		class CArray
+		{
+		public:
+			CArray(int64_t capacity)
+				: m_capacity{ capacity }
+				, m_items{ new std::atomic<SJobInfo*>[capacity] }
+			{
+			}
+
+			inline int64_t capacity() const
+			{
+				return m_capacity;
+			}
+
+			inline SJobInfo* get(int64_t index)
+			{
+				return m_items[index & (m_capacity - 1)].load(std::memory_order_relaxed);
+			}
+
+			inline void put(int64_t index, SJobInfo* job)
+			{
+				m_items[index & (m_capacity - 1)].store(job, std::memory_order_relaxed);
+			}
+
+			CArray* grow(int64_t top, int64_t bottom)
+			{
+				CArray* array = new CArray(m_capacity * 2);
+				for (int64_t index = top; index < bottom; ++index)
+				{
+					array->put(index, get(index));
+				}
+				return array;
+			}
+
+		private:
+			const int64_t m_capacity; // must be a power of 2
+			std::unique_ptr<std::atomic<SJobInfo*>[]> m_items;
+		};
+
+		alignas(64) std::atomic<int64_t> m_top;
+		alignas(64) std::atomic<int64_t> m_bottom;
+		std::atomic<CArray*> m_array;
+		std::vector<std::unique_ptr<CArray>> m_arrays; // outgrown arrays are kept until we're destroyed as a thief may still be reading one
+	};
+
+	// Per-worker deques plus a global injection queue.  Queued and running job counts share one atomic so that a job
+	// moving from queued to running is never seen as neither, which is what lets waitForOutstanding() trust a count of zero.
+	class CScheduler
+	{
+	public:
+		void resize(size_t numWorkers)
+		{
+			while (m_deques.size() < numWorkers)
+			{
+				m_deques.emplace_back(new CWorkStealingDeque());
+				m_sleepers.emplace_back(new SSleeper());
+			}
+			m_asleep.reserve(numWorkers);
+			m_active = numWorkers;
+		}
+
+		// Number of workers (from index 0) allowed to take jobs
+		inline size_t active()
+		{
+			return m_active.load();
+		}
+
+		// Workers above the new count park once they finish their current job; jobs left on their deques get stolen
+		void setActive(size_t numWorkers)
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_active = numWorkers;
+			notifySleepers(); // sleepers that are now parked move over to m_park, so they can't swallow a push's wake up
+			m_park.notify_all();
+		}
+
+		// Number of jobs queued and waiting for a worker
+		inline size_t size()
+		{
+			return static_cast<size_t>(m_counts.load() >> 32);
+		}
+
+		// Number of jobs currently running on worker threads
+		inline size_t running()
+		{
+			size_t running = static_cast<size_t>(m_counts.load() & 0xFFFFFFFF);
+			size_t parked = m_delayed.load() + m_held.load() + m_blocked.load() + m_callbacks.load();
+			return (running > parked) ? running - parked : 0;
+		}
+
+		// Number of jobs waiting on a timer before they're queued
+		inline size_t delayed()
+		{
+			return m_delayed.load();
+		}
+
+		// Number of jobs held back until their device has room
+		inline size_t held()
+		{
+			return m_held.load();
+		}
+
+		// Number of submitted jobs waiting on their prerequisites
+		inline size_t blocked()
+		{
+			return m_blocked.load();
+		}
+
+		// Number of callbacks waiting for the main thread
+		inline size_t callbacks()
+		{
+			return m_callbacks.load();
+		}
+
+		void push(CJob&& function, uint64_t affinityMask = std::numeric_limits<uint64_t>::max())
+		{
+			SJobInfo* job = CJobAllocator::New(std::move(function), affinityMask);
+			m_counts += QUEUED;
+
+			SWorkerContext& context = CurrentWorker();
+			if (context.m_scheduler == this)
+			{
+				m_deques[context.m_index]->push(job);
+			}
+			else
+			{
+				m_injectionQueue.push(job);
+			}
+
+			if (m_sleeping > 0)
+			{
+				// The worker that went to sleep last, whose stack and data are the likeliest to still be in cache; one shared
+				// condition variable wakes them in roughly the order they slept, so with many workers it's nearly always a cold one
+				std::lock_guard<std::mutex> lock(m_sleepMutex);
+				if (!m_asleep.empty())
+				{
+					SSleeper& sleeper = *m_sleepers[m_asleep.back()];
+					m_asleep.pop_back();
+					sleeper.m_woken = true;
+					sleeper.m_wake.notify_one();
+				}
+			}
+		}
+
+		// Called by each worker before it starts asking for jobs
+		void attach(size_t index)
+		{
+			SWorkerContext& context = CurrentWorker();
+			context.m_scheduler = this;
+			context.m_index = index;
+			context.m_seed = static_cast<uint32_t>(index * 2654435761u) | 1;
+		}
+
+		// Blocks until there is a job for the worker to run, or terminate is set
+		SJobInfo* waitAndPop(size_t index, const volatile std::atomic_bool& terminate)
+		{
+			while (!terminate)
+			{
+				if (index >= m_active.load())
+				{
+					std::unique_lock<std::mutex> lock(m_sleepMutex);
+					m_park.wait(lock, [&]() { return terminate || (index < m_active.load()); });
+					continue;
+				}
+
+				SJobInfo* job = find(index);
+				if (job != nullptr)
+				{
+					m_counts += RUNNING - QUEUED;
+					return job;
+				}
+
+				if (size() > 0)
+				{
+					// Jobs are queued but another worker beat us to them, or they're in transit between queues
+					std::this_thread::yield();
+					continue;
+				}
+
+				// m_sleeping and m_counts are both seq_cst, so either a pusher sees us sleeping or we see its job
+				std::unique_lock<std::mutex> lock(m_sleepMutex);
+				SSleeper& sleeper = *m_sleepers[index];
+				sleeper.m_woken = false;
+				m_asleep.push_back(index);
+				++m_sleeping;
+				sleeper.m_wake.wait(lock, [&]() { return terminate || sleeper.m_woken || (size() > 0) || (index >= m_active.load()); });
+				if (!sleeper.m_woken)
+				{
+					m_asleep.erase(std::find(m_asleep.begin(), m_asleep.end(), index));
+				}
+				--m_sleeping;
+			}
+
+			return nullptr;
+		}
+
+		// Worker thread calls this after returning from a job it got from waitAndPop()
+		void jobFinished(SJobInfo* job)
+		{
+			CJobAllocator::Delete(job);
+			released();
+		}
+
+		// A delayed job holds a running slot from when its timer is set until it has been pushed, so it is never missing
+		// from outstanding() while in transit; m_delayed is only there so running() can leave them out
+		void defer()
+		{
+			++m_delayed;
+			m_counts += RUNNING;
+		}
+
+		void undefer()
+		{
+			--m_delayed;
+			released();
+		}
+
+		// Jobs held by the device queues are counted in the same way as delayed ones, but separately for reporting
+		void hold()
+		{
+			++m_held;
+			m_counts += RUNNING;
+		}
+
+		void unhold()
+		{
+			--m_held;
+			released();
+		}
+
+		// Jobs waiting on their prerequisites, and callbacks waiting for the main thread, are counted like held ones
+		void block()
+		{
+			++m_blocked;
+			m_counts += RUNNING;
+		}
+
+		void unblock()
+		{
+			--m_blocked;
+			released();
+		}
+
+		void callbackQueued()
+		{
+			++m_callbacks;
+			m_counts += RUNNING;
+		}
+
+		void callbackDone()
+		{
+			--m_callbacks;
+			released();
+		}
+
+		// Wakes anything in waitForOutstanding() to look again, whatever the count (a callback has been queued)
+		void notifyWaiters()
+		{
+			if (m_waiting > 0)
+			{
+				std::lock_guard<std::mutex> lock(m_idleMutex);
+				m_idle.notify_all();
+			}
+		}
+
+		// Wake every sleeping worker so it can see a terminate request
+		void wakeAll()
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			notifySleepers();
+			m_park.notify_all();
+		}
+
+		// Blocks until fewer than limit jobs are queued or running (a limit of 1 waits for idle), or a callback is waiting
+		// for the main thread; returns true if there's room
+		bool waitForOutstanding(size_t limit)
+		{
+			std::unique_lock<std::mutex> lock(m_idleMutex);
+			startWaiting(limit);
+			m_idle.wait(lock, [&]() { return (outstanding() < limit) || (m_callbacks.load() > 0); });
+			stopWaiting();
+			return outstanding() < limit;
+		}
+
+		// As above, giving up at deadline
+		bool waitForOutstanding(size_t limit, std::chrono::steady_clock::time_point deadline)
+		{
+			std::unique_lock<std::mutex> lock(m_idleMutex);
+			startWaiting(limit);
+			m_idle.wait_until(lock, deadline, [&]() { return (outstanding() < limit) || (m_callbacks.load() > 0); });
+			stopWaiting();
+			return outstanding() < limit;
+		}
+
+	private:
+		static const uint64_t QUEUED = 1ULL << 32;
+		static const uint64_t RUNNING = 1;
+		static const size_t INJECTION_BATCH = 32;
+
+		struct SWorkerContext
+		{
+			CScheduler* m_scheduler = nullptr;
+			size_t m_index = 0;
+			uint32_t m_seed = 1;
+		};
+
+		inline size_t outstanding()
+		{
+			return outstanding(m_counts.load());
+		}
+
+		static inline size_t outstanding(uint64_t counts)
+		{
+			return static_cast<size_t>((counts >> 32) + (counts & 0xFFFFFFFF));
+		}
+
+		// A running slot has been given up.  A waiter is only woken when this takes the count below its limit: while it
+		// waits the count is at or above the limit, so that's the one decrement that can change its answer (the rest
+		// would have it wake, take the lock and go back to sleep, on every job).  As with m_sleeping, either we see the
+		// waiter (and its limit, stored first) or it sees our decrement.
+		void released()
+		{
+			uint64_t counts = (m_counts -= RUNNING);
+			if ((m_waiting > 0) && (outstanding(counts) < m_waitLimit.load()))
+			{
+				std::lock_guard<std::mutex> lock(m_idleMutex);
+				m_idle.notify_all();
+			}
+		}
+
+		// Under m_idleMutex.  With several waiters the highest limit is used, which wakes each of them at its own
+		// threshold (and the lower ones a little early, to look again)
+		void startWaiting(size_t limit)
+		{
+			m_waitLimit = std::max(m_waitLimit.load(), limit);
+			++m_waiting;
+		}
+
+		void stopWaiting()
+		{
+			if (--m_waiting == 0)
+			{
+				m_waitLimit = 0;
+			}
+		}
+
+		static SWorkerContext& CurrentWorker()
+		{
+			thread_local SWorkerContext context;
+			return context;
+		}
+
+		// Own deque first (LIFO, so recently spawned work runs while its data is still warm), then a share of the injection
+		// queue, then steal from the top of the other workers' deques (parked ones included) starting with a random victim
+		SJobInfo* find(size_t index)
+		{
+			SJobInfo* job = m_deques[index]->pop();
+			if (job != nullptr)
+			{
+				return job;
+			}
+
+			// Take a batch so the injection lock is paid once per batch rather than per job; the rest go on our deque where
+			// idle workers can steal them
+			SJobInfo* batch[INJECTION_BATCH];
+			size_t count = m_injectionQueue.pop(batch, INJECTION_BATCH, std::max<size_t>(m_active.load(), 1));
+			if (count > 0)
+			{
+				for (size_t item = count - 1; item > 0; --item)
+				{
+					m_deques[index]->push(batch[item]);
+				}
+				return batch[0];
+			}
+
+			size_t numWorkers = m_deques.size();
+			uint32_t& seed = CurrentWorker().m_seed;
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			for (size_t attempt = 0, victim = seed % numWorkers; attempt < numWorkers; ++attempt, victim = (victim + 1) % numWorkers)
+			{
+				if (victim != index)
+				{
+					job = m_deques[victim]->steal();
+					if (job != nullptr)
+					{
+						return job;
+					}
+				}
+			}
+
+			return nullptr;
+		}
+
+		// Each worker sleeps on its own condition variable, so a push can choose which one to wake
+		struct SSleeper
+		{
+			std::condition_variable m_wake;
+			bool m_woken = false; // by a push, which has taken us off m_asleep
+		};
+
+		// Under m_sleepMutex; the sleepers re-check what they're waiting for
+		void notifySleepers()
+		{
+			for (std::unique_ptr<SSleeper>& sleeper : m_sleepers)
+			{
+				sleeper->m_wake.notify_one();
+			}
+		}
+
+		std::atomic<uint64_t> m_counts{ 0 }; // queued jobs in the top 32 bits, running jobs in the bottom 32
+		std::atomic<size_t> m_delayed{ 0 };
+		std::atomic<size_t> m_held{ 0 };
+		std::atomic<size_t> m_blocked{ 0 };
+		std::atomic<size_t> m_callbacks{ 0 };
+		std::atomic<size_t> m_sleeping{ 0 };
+		std::atomic<size_t> m_active{ 0 };
+		std::atomic<size_t> m_waiting{ 0 };
+		std::atomic<size_t> m_waitLimit{ 0 }; // see released()
+		std::vector<std::unique_ptr<CWorkStealingDeque>> m_deques;
+		CJobQueue m_injectionQueue;
+		std::mutex m_sleepMutex;
+		std::vector<std::unique_ptr<SSleeper>> m_sleepers; // per worker
+		std::vector<size_t> m_asleep; // workers waiting for a push to wake them, most recent last
+		std::condition_variable m_park;
+		std::mutex m_idleMutex;
+		std::condition_variable m_idle;
+	};
+
+	class CWorkerThread : public CThread
+	{
+	public:
+		// Worker thread with 'floating' core affinity
+		CWorkerThread(std::string& name, CScheduler* scheduler, size_t index)
+			: CThread{ name }
+			, m_requestTerminate{ false }
+			, m_scheduler{ scheduler }
+			, m_index{ index }
+		{
+			auto lambda = [this]() { this->Main(); };
+			Start<decltype(lambda)>(lambda);
+		}
+
+		// Worker thread with specified core affinity
+		CWorkerThread(std::string& name, CScheduler* scheduler, size_t index, uint64_t coreAffinity)
+			: CThread{ name }
+			, m_requestTerminate{ false }
+			, m_scheduler{ scheduler }
+			, m_index{ index }
+		{
+			auto lambda = [this]() { this->Main(); };
+			Start<decltype(lambda)>(lambda, coreAffinity);
+		}
+
+		~CWorkerThread()
+		{
+			RequestTerminate();
+		}
+
+		inline void RequestTerminate()
+		{
+			if (!m_requestTerminate)
+			{
+				LOG_VERBOSE("[%d] CWorkerThread::RequestTerminate() [%d]", std::this_thread::get_id(), GetId());
+				m_requestTerminate = true;
+				m_scheduler->wakeAll();
+				Join();
+			}
+		}
+
+	private:
+		//TODO: worker threads need to check for jobs for the correct affinity (need to think about this)
+		void Main()
+		{
+			LOG_VERBOSE("[%d] CWorkerThread::Main() starting", std::this_thread::get_id());
+			m_scheduler->attach(m_index);
+
+			while (!m_requestTerminate)
+			{
+				SJobInfo* job = m_scheduler->waitAndPop(m_index, m_requestTerminate);
+				if (job != nullptr)
+				{
+					LOG_VERBOSE("[%d] CWorkerThread::Main() executing job [%d]", std::this_thread::get_id(), job->m_jobID);
+					job->m_function();
+					m_scheduler->jobFinished(job);
+				}
+			}
+
+			LOG_DEBUG("[%d] CWorkerThread::Main() shutting down with %d outstanding jobs in queue", std::this_thread::get_id(), m_scheduler->size());
+		}
+
+		volatile std::atomic_bool m_requestTerminate;
+		std::mutex m_mutex;
+		CScheduler* m_scheduler;
+		size_t m_index;
+	};
+
+	// Hashed timer wheel for delayed jobs; its thread hands expired jobs to the scheduler, so no worker ever sleeps on a
+	// timer.  Each slot holds the timers due on ticks congruent to it, with the due tick deciding which lap they fire on.
+	class CTimerWheel : public CThread
+	{
+	public:
+		CTimerWheel(std::string& name, CScheduler* scheduler)
+			: CThread{ name }
+			, m_scheduler{ scheduler }
+			, m_start{ std::chrono::steady_clock::now() }
+		{
+			auto lambda = [this]() { this->Main(); };
+			Start<decltype(lambda)>(lambda);
+		}
+
+		~CTimerWheel()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_terminate = true;
+			}
+			m_wake.notify_one();
+			Join();
+
+			for (std::vector<STimer>& slot : m_slots)
+			{
+				for (size_t timer = 0; timer < slot.size(); ++timer)
+				{
+					m_scheduler->undefer();
+				}
+			}
+			if (m_pending > 0)
+			{
+				LOG_DEBUG("[%d] CTimerWheel::~CTimerWheel() discarded %d delayed jobs", std::this_thread::get_id(), m_pending);
+			}
+		}
+
+		void add(CJob&& function, std::chrono::milliseconds delay)
+		{
+			m_scheduler->defer();
+
+			uint64_t ticks = std::max<uint64_t>((delay.count() + TICK_MS - 1) / TICK_MS, 1);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			uint64_t due = now() + ticks;
+			m_slots[due % SLOTS].push_back(STimer{ due, std::move(function) });
+			if (m_pending++ == 0)
+			{
+				m_wake.notify_one(); // the wheel doesn't tick while it's empty
+			}
+		}
+
+	private:
+		static const uint64_t TICK_MS = 10;
+		static const size_t SLOTS = 1024;
+
+		struct STimer
+		{
+			uint64_t m_due;
+			CJob m_function;
+		};
+
+		inline uint64_t now()
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count()) / TICK_MS;
+		}
+
+		void Main()
+		{
+			LOG_VERBOSE("[%d] CTimerWheel::Main() starting", std::this_thread::get_id());
+			std::vector<CJob> expired;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_terminate)
+			{
+				if (m_pending == 0)
+				{
+					m_wake.wait(lock);
+					continue;
+				}
+
+				// Catch up on every tick since the last pass; after a full lap every slot has been looked at
+				uint64_t target = now();
+				if (target > m_tick + SLOTS)
+				{
+					m_tick = target - SLOTS;
+				}
+				while (m_tick < target)
+				{
+					std::vector<STimer>& slot = m_slots[++m_tick % SLOTS];
+					for (size_t timer = 0; timer < slot.size();)
+					{
+						if (slot[timer].m_due <= target)
+						{
+							expired.push_back(std::move(slot[timer].m_function));
+							slot[timer] = std::move(slot.back());
+							slot.pop_back();
+						}
+						else
+						{
+							++timer;
+						}
+					}
+				}
+
+				if (!expired.empty())
+				{
+					m_pending -= expired.size();
+					lock.unlock();
+					for (CJob& function : expired)
+					{
+						m_scheduler->push(std::move(function));
+						m_scheduler->undefer(); // after the push, so the job is always counted somewhere
+					}
+					expired.clear();
+					lock.lock();
+				}
+
+				m_wake.wait_until(lock, m_start + std::chrono::milliseconds((m_tick + 1) * TICK_MS));
+			}
+		}
+
+		CScheduler* m_scheduler;
+		const std::chrono::steady_clock::time_point m_start;
+		std::vector<STimer> m_slots[SLOTS];
+		uint64_t m_tick = 0;
+		size_t m_pending = 0;
+		bool m_terminate = false;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+	};
+
+	// FIFOs of jobs per (source, destination) device pair, so that a slow volume can't take every worker while jobs for
+	// idle ones queue up behind its jobs.  A job counts against both its devices from when it's released to the workers
+	// until it returns; until its devices have room it waits here, counted as outstanding like a delayed job.  Whenever
+	// a job finishes, the pairs are visited round-robin, releasing one job from each in turn while their devices have room.
+	class CDeviceQueues
+	{
+	public:
+		CDeviceQueues(CScheduler* scheduler)
+			: m_scheduler{ scheduler }
+		{
+		}
+
+		~CDeviceQueues()
+		{
+			for (std::unique_ptr<SQueue>& queue : m_queues)
+			{
+				for (size_t job = 0; job < queue->m_jobs.m_size; ++job)
+				{
+					m_scheduler->unhold();
+				}
+				queue->m_jobs.clear();
+			}
+		}
+
+		void setLimit(size_t limit)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_limit = limit;
+		}
+
+		void setLimit(uint64_t device, size_t limit)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_devices[device].m_limit = limit;
+			m_devices[device].m_limited = true;
+		}
+
+		void add(CJob&& function, uint64_t source, uint64_t destination)
+		{
+			m_scheduler->hold();
+			SJobInfo* job = CJobAllocator::New(std::move(function));
+			std::lock_guard<std::mutex> lock(m_mutex);
+			queue(source, destination).m_jobs.push_back(job);
+			dispatch();
+		}
+
+	private:
+		struct SDevice
+		{
+			size_t m_running = 0;
+			size_t m_limit = 0;
+			bool m_limited = false; // has its own limit rather than the default
+		};
+
+		struct SQueue
+		{
+			uint64_t m_source;
+			uint64_t m_destination;
+			SDevice* m_sourceDevice;
+			SDevice* m_destinationDevice; // the same as the source when copying within a device, which counts once
+			SJobList m_jobs;
+		};
+
+		SQueue& queue(uint64_t source, uint64_t destination)
+		{
+			if ((m_last != nullptr) && (m_last->m_source == source) && (m_last->m_destination == destination))
+			{
+				return *m_last;
+			}
+
+			for (std::unique_ptr<SQueue>& queue : m_queues)
+			{
+				if ((queue->m_source == source) && (queue->m_destination == destination))
+				{
+					m_last = queue.get();
+					return *m_last;
+				}
+			}
+
+			// unordered_map never moves its elements, so the pointers stay good
+			m_queues.emplace_back(new SQueue{ source, destination, &m_devices[source], &m_devices[destination], SJobList() });
+			m_last = m_queues.back().get();
+			LOG_DEBUG("[%d] CDeviceQueues::queue() new device pair [%llx] -> [%llx]", std::this_thread::get_id(), source, destination);
+			return *m_last;
+		}
+
+		inline bool hasRoom(const SDevice& device)
+		{
+			size_t limit = device.m_limited ? device.m_limit : m_limit;
+			return (limit == 0) || (device.m_running < limit);
+		}
+
+		// Called with m_mutex held
+		void dispatch()
+		{
+			for (size_t visited = 0; visited < m_queues.size(); )
+			{
+				SQueue& queue = *m_queues[m_next];
+				m_next = (m_next + 1) % m_queues.size();
+				if (queue.m_jobs.empty() || !hasRoom(*queue.m_sourceDevice) || !hasRoom(*queue.m_destinationDevice))
+				{
+					++visited;
+					continue;
+				}
+
+				++queue.m_sourceDevice->m_running;
+				if (queue.m_destinationDevice != queue.m_sourceDevice)
+				{
+					++queue.m_destinationDevice->m_running;
+				}
+				SJobInfo* job = queue.m_jobs.pop_front();
+				SQueue* released = &queue;
+				m_scheduler->push([this, released, job]() {
+					job->m_function();
+					CJobAllocator::Delete(job);
+					finished(*released);
+				});
+				m_scheduler->unhold(); // after the push, so the job is always counted somewhere
+				visited = 0;
+			}
+		}
+
+		void finished(SQueue& queue)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--queue.m_sourceDevice->m_running;
+			if (queue.m_destinationDevice != queue.m_sourceDevice)
+			{
+				--queue.m_destinationDevice->m_running;
+			}
+			dispatch();
+		}
+
+		CScheduler* m_scheduler;
+		std::mutex m_mutex;
+		std::unordered_map<uint64_t, SDevice> m_devices;
+		std::vector<std::unique_ptr<SQueue>> m_queues; // in round-robin order
+		SQueue* m_last = nullptr;
+		size_t m_next = 0;
+		size_t m_limit = 0;
+	};
+
+	size_t m_numThreads;
+	CScheduler m_scheduler;
+	CDeviceQueues m_devices{ &m_scheduler };
+	CJobQueue m_callbackQueue;
+	std::vector<CWorkerThread*> m_workerThreads;
+	CTimerWheel* m_timers = nullptr;
+};
+
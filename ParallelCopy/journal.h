@@ -0,0 +1,454 @@
+#pragma once
+
+// Append-only record of which manifest entries have been copied, kept next to the manifest as '<manifest>.journal', so
+// a run that dies part way through can be resumed without redoing (or even re-statting) what was already copied.
+//
+// The file is a header (identifying the manifest by size and modification time) followed by one 32 bit manifest line
+// number per completed entry, in completion order.  Workers only append to an in-memory batch; a background thread
+// writes the batch and syncs the journal every FLUSH_INTERVAL (or sooner when the batch fills), so after a crash at most
+// the last second or so of copies is redone.  Before a batch is written its copies are made durable, with one syncfs()
+// per destination filesystem on Linux (FlushFileBuffers() per file on Windows, where flushing a volume needs admin), so
+// the journal never claims a copy that a power cut could still lose.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "devicemap.h"
+#include "log.h"
+#include "thread.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CJournal
+{
+public:
+	CJournal(const char* manifest)
+		: m_name{ std::string(manifest) + ".journal" }
+	{
+	}
+
+	~CJournal()
+	{
+		if (m_thread)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_terminate = true;
+			}
+			m_flush.notify_one();
+			m_thread->Join(); // writes and syncs whatever is left
+		}
+		Close();
+	}
+
+	// Starts a new journal, or with resume loads the completed entries from an existing one and carries on appending to
+	// it.  The manifest's size and modification time are recorded so a journal isn't resumed against a different
+	// manifest, or the same one edited in place.
+	bool Open(bool resume, uint64_t manifestSize, uint64_t manifestModified)
+	{
+		bool fresh = true;
+		if (resume)
+		{
+			fresh = !Load(manifestSize, manifestModified);
+		}
+
+		if (!OpenForAppend(fresh, manifestSize, manifestModified))
+		{
+			LOG_ERROR("Unable to open journal [%s]; progress won't be recorded", m_name.c_str());
+			return false;
+		}
+
+		std::string name("JournalThread");
+		m_thread.reset(new CThread(name));
+		m_thread->Start([this]() { this->Main(); });
+		return true;
+	}
+
+	inline const char* Name() const
+	{
+		return m_name.c_str();
+	}
+
+	// Number of entries the resumed journal says are done
+	inline size_t Resumed() const
+	{
+		return m_resumed;
+	}
+
+	inline bool IsComplete(size_t line) const
+	{
+		size_t word = line / 64;
+		return (word < m_completed.size()) && ((m_completed[word] & (1ULL << (line % 64))) != 0);
+	}
+
+	// destination is where the entry was copied to, which is made durable before the entry is journalled
+	void Complete(size_t line, const std::string& destination)
+	{
+		if (!m_thread || (line > UINT32_MAX))
+		{
+			return;
+		}
+
+		bool full;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_batch.push_back(static_cast<uint32_t>(line));
+			m_destinations.push_back(destination);
+			full = (m_batch.size() == BATCH_SIZE);
+		}
+		if (full)
+		{
+			m_flush.notify_one();
+		}
+	}
+
+private:
+	static const size_t BATCH_SIZE = 64 * 1024;
+	static const unsigned int FLUSH_INTERVAL_MS = 1000;
+	static const uint32_t VERSION = 2;
+
+	struct SHeader
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_recordSize;
+		uint64_t m_manifestSize;
+		uint64_t m_manifestModified;
+	};
+
+	static void InitHeader(SHeader& header, uint64_t manifestSize, uint64_t manifestModified)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.m_magic, "PCJRNL", 6);
+		header.m_version = VERSION;
+		header.m_recordSize = sizeof(uint32_t);
+		header.m_manifestSize = manifestSize;
+		header.m_manifestModified = manifestModified;
+	}
+
+	// Maps the journal and sets a bit per completed line; returns false if there's nothing usable to resume from
+	bool Load(uint64_t manifestSize, uint64_t manifestModified)
+	{
+		const char* data = nullptr;
+		size_t size = 0;
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(m_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		HANDLE mapping = nullptr;
+		LARGE_INTEGER fileSize;
+		if ((file != INVALID_HANDLE_VALUE) && GetFileSizeEx(file, &fileSize) && (fileSize.QuadPart > 0))
+		{
+			size = static_cast<size_t>(fileSize.QuadPart);
+			mapping = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			data = (mapping != nullptr) ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+		}
+#else
+		int fd = open(m_name.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info;
+		if ((fd >= 0) && (fstat(fd, &info) == 0) && (info.st_size > 0))
+		{
+			size = static_cast<size_t>(info.st_size);
+			void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapped != MAP_FAILED)
+			{
+				madvise(mapped, size, MADV_SEQUENTIAL);
+				data = static_cast<const char*>(mapped);
+			}
+		}
+#endif // defined(_WIN32)
+
+		bool ok = false;
+		if (data == nullptr)
+		{
+			LOG_WARNING("No journal to resume from in [%s]; starting from the beginning", m_name.c_str());
+		}
+		else
+		{
+			SHeader expected;
+			InitHeader(expected, manifestSize, manifestModified);
+			if ((size < sizeof(SHeader)) || (memcmp(data, &expected, sizeof(SHeader)) != 0))
+			{
+				LOG_WARNING("Journal [%s] doesn't match the manifest; starting from the beginning", m_name.c_str());
+			}
+			else
+			{
+				// A crash can leave a partial record at the end, which is ignored (and overwritten when we reopen)
+				size_t records = (size - sizeof(SHeader)) / sizeof(uint32_t);
+				const char* record = data + sizeof(SHeader);
+				for (size_t index = 0; index < records; ++index, record += sizeof(uint32_t))
+				{
+					uint32_t line;
+					memcpy(&line, record, sizeof(line));
+					size_t word = line / 64;
+					if (word >= m_completed.size())
+					{
+						m_completed.resize(std::max(word + 1, m_completed.size() * 2), 0);
+					}
+					uint64_t bit = 1ULL << (line % 64);
+					m_resumed += ((m_completed[word] & bit) == 0) ? 1 : 0;
+					m_completed[word] |= bit;
+				}
+				m_validSize = sizeof(SHeader) + records * sizeof(uint32_t);
+				ok = true;
+			}
+		}
+
+#if defined(_WIN32)
+		if (data != nullptr)
+		{
+			UnmapViewOfFile(data);
+		}
+		if (mapping != nullptr)
+		{
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+#else
+		if (data != nullptr)
+		{
+			munmap(const_cast<char*>(data), size);
+		}
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+#endif // defined(_WIN32)
+
+		return ok;
+	}
+
+	bool OpenForAppend(bool fresh, uint64_t manifestSize, uint64_t manifestModified)
+	{
+		SHeader header;
+		InitHeader(header, manifestSize, manifestModified);
+#if defined(_WIN32)
+		m_file = CreateFileA(m_name.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, fresh ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		if (fresh)
+		{
+			return Write(reinterpret_cast<const char*>(&header), sizeof(header)) && Sync();
+		}
+
+		LARGE_INTEGER position;
+		position.QuadPart = static_cast<LONGLONG>(m_validSize);
+		return SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) && SetEndOfFile(m_file);
+#else
+		m_fd = open(m_name.c_str(), O_WRONLY | O_CLOEXEC | (fresh ? (O_CREAT | O_TRUNC) : 0), 0644);
+		if (m_fd < 0)
+		{
+			return false;
+		}
+
+		if (fresh)
+		{
+			return Write(reinterpret_cast<const char*>(&header), sizeof(header)) && Sync();
+		}
+
+		return (ftruncate(m_fd, static_cast<off_t>(m_validSize)) == 0) && (lseek(m_fd, 0, SEEK_END) >= 0);
+#endif // defined(_WIN32)
+	}
+
+	bool Write(const char* data, size_t size)
+	{
+		while (size > 0)
+		{
+#if defined(_WIN32)
+			DWORD written = 0;
+			if (!WriteFile(m_file, data, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &written, nullptr))
+			{
+				return false;
+			}
+#else
+			ssize_t written = write(m_fd, data, size);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+#endif // defined(_WIN32)
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	bool Sync()
+	{
+#if defined(_WIN32)
+		return FlushFileBuffers(m_file) != 0;
+#else
+		return fdatasync(m_fd) == 0;
+#endif // defined(_WIN32)
+	}
+
+	void Close()
+	{
+#if defined(_WIN32)
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_file);
+			m_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+			m_fd = -1;
+		}
+		for (const std::pair<const uint64_t, int>& filesystem : m_filesystems)
+		{
+			if (filesystem.second >= 0)
+			{
+				close(filesystem.second);
+			}
+		}
+		m_filesystems.clear();
+#endif // defined(_WIN32)
+	}
+
+	// Forces the copies at destinations to disk; false if any might not have made it
+#if defined(_WIN32)
+	bool Durable(const std::vector<std::string>& destinations)
+	{
+		bool durable = true;
+		for (const std::string& destination : destinations)
+		{
+			HANDLE file = CreateFileA(destination.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if ((file == INVALID_HANDLE_VALUE) || !FlushFileBuffers(file))
+			{
+				LOG_DEBUG("Unable to flush [%s]: error 0x%08X", destination.c_str(), GetLastError());
+				durable = false;
+			}
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+			}
+		}
+		return durable;
+	}
+#else
+	bool Durable(const std::vector<std::string>& destinations)
+	{
+		// Each filesystem is synced once however many of the batch's copies landed on it, through a directory kept open
+		// on it for the rest of the run
+		std::vector<int> filesystems;
+		bool durable = true;
+		for (const std::string& destination : destinations)
+		{
+			uint64_t device = m_devices.Device(destination.c_str(), destination.length());
+			auto it = m_filesystems.find(device);
+			if (it == m_filesystems.end())
+			{
+				size_t separator = destination.find_last_of('/');
+				std::string directory = (separator == std::string::npos) ? std::string(".") : (separator == 0) ? std::string("/") : destination.substr(0, separator);
+				it = m_filesystems.emplace(device, open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)).first;
+				if (it->second < 0)
+				{
+					LOG_WARNING("Unable to open [%s] to sync its filesystem: [%s]", directory.c_str(), strerror(errno));
+				}
+			}
+
+			if (it->second < 0)
+			{
+				durable = false;
+			}
+			else if (std::find(filesystems.begin(), filesystems.end(), it->second) == filesystems.end())
+			{
+				filesystems.push_back(it->second);
+			}
+		}
+
+		for (int filesystem : filesystems)
+		{
+			if (syncfs(filesystem) != 0)
+			{
+				LOG_DEBUG("syncfs() failed: [%s]", strerror(errno));
+				durable = false;
+			}
+		}
+		return durable;
+	}
+#endif // defined(_WIN32)
+
+	// Journal thread; swaps the batch out so workers can keep appending while it's written
+	void Main()
+	{
+		std::vector<uint32_t> writing;
+		std::vector<std::string> destinations;
+		writing.reserve(BATCH_SIZE);
+		bool failed = false;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_flush.wait_for(lock, std::chrono::milliseconds(static_cast<unsigned int>(FLUSH_INTERVAL_MS)), [&]() { return m_terminate || (m_batch.size() >= BATCH_SIZE); });
+			bool terminate = m_terminate;
+			writing.swap(m_batch);
+			destinations.swap(m_destinations);
+			lock.unlock();
+
+			if (!writing.empty() && !failed)
+			{
+				// Left out rather than journalled, so a resumed run copies them again
+				if (!Durable(destinations))
+				{
+					LOG_ERROR("Unable to make [%d] copies durable; they aren't recorded in journal [%s]", writing.size(), m_name.c_str());
+				}
+				else if (!Write(reinterpret_cast<const char*>(writing.data()), writing.size() * sizeof(uint32_t)) || !Sync())
+				{
+					LOG_ERROR("Failed to write journal [%s]; progress is no longer being recorded", m_name.c_str());
+					failed = true;
+				}
+			}
+			writing.clear();
+			destinations.clear();
+
+			lock.lock();
+			if (terminate && m_batch.empty())
+			{
+				break;
+			}
+		}
+	}
+
+	const std::string m_name;
+	std::vector<uint64_t> m_completed; // bit per manifest line, from the resumed journal
+	size_t m_resumed = 0;
+	size_t m_validSize = 0;
+#if defined(_WIN32)
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+#else
+	int m_fd = -1;
+	CDeviceMap m_devices; // only used by the journal thread, as is...
+	std::unordered_map<uint64_t, int> m_filesystems; // ...a directory fd on each destination filesystem, to syncfs()
+#endif // defined(_WIN32)
+
+	std::unique_ptr<CThread> m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_flush;
+	std::vector<uint32_t> m_batch;
+	std::vector<std::string> m_destinations; // alongside m_batch
+	bool m_terminate = false;
+};
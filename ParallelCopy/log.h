@@ -1,165 +1,594 @@
-#pragma once
-
-#include <iostream>
-#include <memory>
-#include <fstream>
-#include <string>
-
-class CLog
-{
-public:
-	enum eSeverity
-	{
-		eS_FATAL,
-		eS_ERROR,
-		eS_WARNING,
-		eS_INFORMATION,
-		eS_DEBUG,
-		eS_VERBOSE,
-	};
-
-	CLog(eSeverity level = eS_INFORMATION, const char* name = nullptr)
-		: m_name{ (name != nullptr) ? name : "anonymous" }
-		, m_level{ level }
-		, m_file{ (name != nullptr) ? new std::ofstream(name, std::ios_base::trunc | std::ios_base::out) : nullptr }
-	{
-	}
-	~CLog()
-	{
-		if (m_file != nullptr)
-		{
-			delete m_file;
-		}
-	}
-
-	eSeverity SetLogLevel(eSeverity level)
-	{
-		m_level = level;
-	}
-
-	template<typename ...Ts>
-	CLog& write(eSeverity level, const char* file, unsigned long line, const char* format, Ts... args)
-	{
-		if (level <= m_level)
-		{
-			auto& out = (level > eS_ERROR) ? std::cout : std::cerr;
-#if defined _DEBUG
-			std::string buffer = format_string("%s(%d) [%s] %s\n", file, line, level_to_string(level), format);
-#else
-			file; line; // prevent 'unused parameter' warning
-			std::string buffer = format_string("[%s] %s\n", level_to_string(level), format);
-#endif // defined _DEBUG
-			if (sizeof...(args) > 0)
-			{
-				buffer = format_string(buffer.c_str(), args...);
-			}
-			out << buffer.c_str() << std::flush;
-			if (m_file != nullptr)
-				*m_file << buffer.c_str();
-		}
-
-		return *this;
-	}
-
-protected:
-	template <typename ...Ts>
-	std::string format_string(const char* format, Ts... args)
-	{
-		auto size = snprintf(nullptr, 0, format, args...) + 1; // +1 for the NULL
-		std::unique_ptr<char[]> buffer(new char[size]);
-		snprintf(buffer.get(), size, format, args...);
-		return std::string(buffer.get(), buffer.get() + size - 1); // -1 as we don't store the NULL
-	}
-
-	const char* level_to_string(eSeverity level)
-	{
-		const char* ret = nullptr;
-		switch (level)
-		{
-		case CLog::eS_FATAL:
-			ret = "FATAL";
-			break;
-		case CLog::eS_ERROR:
-			ret = "ERROR";
-			break;
-		case CLog::eS_WARNING:
-			ret = "WARNING";
-			break;
-		case CLog::eS_INFORMATION:
-			ret = "INFO";
-			break;
-		case CLog::eS_VERBOSE:
-			ret = "VERBOSE";
-			break;
-		case CLog::eS_DEBUG:
-			ret = "DEBUG";
-			break;
-		default:
-			ret = "???";
-			break;
-		}
-		return ret;
-	}
-
-private:
-	const std::string m_name;
-	eSeverity m_level;
-	std::ofstream* m_file;
-};
-
-extern CLog g_log;
-
-#define LOG_FATAL(_format, ...) g_log.write(CLog::eS_FATAL, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#define LOG_ERROR(_format, ...) g_log.write(CLog::eS_ERROR, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#define LOG_WARNING(_format, ...) g_log.write(CLog::eS_WARNING, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#define LOG_INFORMATION(_format, ...) g_log.write(CLog::eS_INFORMATION, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#if defined _DEBUG
-#define LOG_DEBUG(_format, ...) g_log.write(CLog::eS_DEBUG, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#define LOG_VERBOSE(_format, ...) g_log.write(CLog::eS_VERBOSE, __FILE__, __LINE__, _format, ##__VA_ARGS__)
-#else
-// Elide debug and verbose from release mode
-#define LOG_DEBUG(_format, ...)
-#define LOG_VERBOSE(_format, ...)
-#endif // defined _DEBUG
-
-/*
-class CWLog
-{
-public:
-	enum eSeverity
-	{
-		eS_FATAL,
-		eS_ERROR,
-		eS_WARNING,
-		eS_INFORMATION,
-		eS_VERBOSE,
-		eS_DEBUG
-	};
-
-	CWLog(const wchar_t* name = nullptr);
-	~CWLog();
-
-	eSeverity SetLogLevel(eSeverity level)
-	{
-		m_level = level;
-	}
-
-	template<typename ...Ts>
-	CWLog& write(eSeverity level, std::wstring&& file, unsigned long line, const std::wstring&& format, Ts... args);
-
-protected:
-	template <typename ...Ts>
-	std::wstring&& format_string(const std::wstring&& format, Ts... args)
-	{
-		auto size = swprintf(nullptr, 0, format.c_str(), args...) + 1; // +1 for the NULL
-		std::unique_ptr<wchar_t[]> buffer(new wchar_t[size]);
-		swprintf(buffer.get(), size, format.c_str(), Ts... args);
-		return std::wstring(buffer.get(), buffer.get() + size - 1); // -1 as we don't store the NULL
-	}
-
-private:
-	const std::wstring m_name;
-	eSeverity m_level;
-	std::unique_ptr<std::wofstream> m_file;
-};
+#pragma once
+
+// Asynchronous logger.  Producers only copy the format pointer and the arguments into a preallocated slot of a bounded
+// multi-producer ring; a background thread formats the lines and writes them out in batches, so workers never stall on
+// console I/O or interleave their output.  Formats must therefore be string literals (as the LOG_* macros pass them);
+// string arguments are copied into the slot, truncated if they don't fit.
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class CLog
+{
+public:
+	enum eSeverity
+	{
+		eS_FATAL,
+		eS_ERROR,
+		eS_WARNING,
+		eS_INFORMATION,
+		eS_DEBUG,
+		eS_VERBOSE,
+	};
+
+	// What a producer does when the ring is full
+	enum eOverflow
+	{
+		eO_BLOCK, // wait for the log thread to make space
+		eO_DROP, // discard the message and count it (fatal messages are never dropped)
+	};
+
+	CLog(eSeverity level = eS_INFORMATION, const char* name = nullptr)
+		: m_name{ (name != nullptr) ? name : "anonymous" }
+		, m_level{ level }
+		, m_file{ (name != nullptr) ? new std::ofstream(name, std::ios_base::trunc | std::ios_base::out) : nullptr }
+		, m_records{ new SRecord[CAPACITY] }
+	{
+		for (size_t index = 0; index < CAPACITY; ++index)
+		{
+			m_records[index].m_sequence.store(index, std::memory_order_relaxed);
+		}
+		m_thread = std::thread([this]() { Main(); });
+	}
+	~CLog()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_terminate = true;
+		}
+		m_wake.notify_one();
+		m_thread.join(); // drains everything still queued
+
+		if (m_file != nullptr)
+		{
+			delete m_file;
+		}
+	}
+
+	eSeverity SetLogLevel(eSeverity level)
+	{
+		eSeverity previous = m_level;
+		m_level = level;
+		return previous;
+	}
+
+	eOverflow SetOverflowPolicy(eOverflow policy)
+	{
+		return m_overflow.exchange(policy, std::memory_order_relaxed);
+	}
+
+	inline uint64_t Dropped() const
+	{
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+	template<typename ...Ts>
+	CLog& write(eSeverity level, const char* file, unsigned long line, const char* format, Ts... args)
+	{
+		if (level <= m_level)
+		{
+			SRecord* record = Acquire(level);
+			if (record != nullptr)
+			{
+				record->m_level = level;
+				record->m_file = file;
+				record->m_line = line;
+				record->m_format = format;
+				record->m_size = 0;
+				record->m_count = 0;
+				record->m_truncated = false;
+				Store(*record, args...);
+				Publish(*record);
+			}
+		}
+
+		return *this;
+	}
+
+protected:
+	const char* level_to_string(eSeverity level)
+	{
+		const char* ret = nullptr;
+		switch (level)
+		{
+		case CLog::eS_FATAL:
+			ret = "FATAL";
+			break;
+		case CLog::eS_ERROR:
+			ret = "ERROR";
+			break;
+		case CLog::eS_WARNING:
+			ret = "WARNING";
+			break;
+		case CLog::eS_INFORMATION:
+			ret = "INFO";
+			break;
+		case CLog::eS_VERBOSE:
+			ret = "VERBOSE";
+			break;
+		case CLog::eS_DEBUG:
+			ret = "DEBUG";
+			break;
+		default:
+			ret = "???";
+			break;
+		}
+		return ret;
+	}
+
+private:
+	static const size_t CAPACITY = 4096; // must be a power of 2
+	static const size_t RECORD_DATA = 976; // keeps each record at 1KB
+	static const size_t BATCH_SIZE = 256; // records formatted per write
+
+	// Arguments are stored as a type tag followed by the value, with the type being the one printf would have been
+	// handed after the default argument promotions, so the log thread can pass it back with the right type
+	enum eArgument : char
+	{
+		eA_INT,
+		eA_UINT,
+		eA_LONG,
+		eA_ULONG,
+		eA_LONGLONG,
+		eA_ULONGLONG,
+		eA_DOUBLE,
+		eA_STRING, // uint16_t length followed by the characters
+		eA_POINTER,
+	};
+
+	// Vyukov style slot; m_sequence says whether it's free for the producer claiming position m_sequence, or holds the
+	// record for position m_sequence - 1
+	struct SRecord
+	{
+		std::atomic_size_t m_sequence;
+		const char* m_file;
+		const char* m_format;
+		unsigned long m_line;
+		eSeverity m_level;
+		uint16_t m_size;
+		uint8_t m_count;
+		bool m_truncated;
+		char m_data[RECORD_DATA];
+	};
+
+	SRecord* Acquire(eSeverity level)
+	{
+		size_t position = m_enqueue.load(std::memory_order_relaxed);
+		while (true)
+		{
+			SRecord& record = m_records[position & (CAPACITY - 1)];
+			size_t sequence = record.m_sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (difference == 0)
+			{
+				if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					return &record;
+				}
+			}
+			else if (difference < 0)
+			{
+				// Full
+				if ((m_overflow.load(std::memory_order_relaxed) == eO_DROP) && (level != eS_FATAL))
+				{
+					m_dropped.fetch_add(1, std::memory_order_relaxed);
+					return nullptr;
+				}
+				Wake();
+				std::this_thread::yield();
+				position = m_enqueue.load(std::memory_order_relaxed);
+			}
+			else
+			{
+				position = m_enqueue.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void Publish(SRecord& record)
+	{
+		size_t position = record.m_sequence.load(std::memory_order_relaxed);
+		record.m_sequence.store(position + 1, std::memory_order_release);
+		Wake();
+	}
+
+	void Wake()
+	{
+		// Pairs with the fence in Main(); either it sees our record or we see it asleep
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeping.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_wake.notify_one();
+		}
+	}
+
+	static void Store(SRecord&) {}
+
+	template<typename T, typename ...Ts>
+	static void Store(SRecord& record, T value, Ts... args)
+	{
+		Add(record, value);
+		Store(record, args...);
+	}
+
+	template<typename T>
+	static void Add(SRecord& record, eArgument type, T value)
+	{
+		if (record.m_size + 1 + sizeof(T) > RECORD_DATA)
+		{
+			record.m_truncated = true;
+			return;
+		}
+
+		record.m_data[record.m_size] = type;
+		memcpy(&record.m_data[record.m_size + 1], &value, sizeof(T));
+		record.m_size += static_cast<uint16_t>(1 + sizeof(T));
+		++record.m_count;
+	}
+
+	// Overload resolution follows the default argument promotions (char/short/bool/enum to int, float to double)
+	static void Add(SRecord& record, int value) { Add(record, eA_INT, value); }
+	static void Add(SRecord& record, unsigned int value) { Add(record, eA_UINT, value); }
+	static void Add(SRecord& record, long value) { Add(record, eA_LONG, value); }
+	static void Add(SRecord& record, unsigned long value) { Add(record, eA_ULONG, value); }
+	static void Add(SRecord& record, long long value) { Add(record, eA_LONGLONG, value); }
+	static void Add(SRecord& record, unsigned long long value) { Add(record, eA_ULONGLONG, value); }
+	static void Add(SRecord& record, double value) { Add(record, eA_DOUBLE, value); }
+	static void Add(SRecord& record, const void* value) { Add(record, eA_POINTER, value); }
+	// Only narrow strings are copied into the record; anything else would be stored as a pointer and read after it's gone
+	static void Add(SRecord& record, const wchar_t* value) = delete;
+	static void Add(SRecord& record, std::thread::id value) { Add(record, eA_UINT, static_cast<unsigned int>(std::hash<std::thread::id>()(value))); } // for "%d"
+
+	static void Add(SRecord& record, const char* value)
+	{
+		if (record.m_size + 1 + sizeof(uint16_t) > RECORD_DATA)
+		{
+			record.m_truncated = true;
+			return;
+		}
+
+		if (value == nullptr)
+		{
+			value = "(null)";
+		}
+		size_t length = strlen(value);
+		size_t space = RECORD_DATA - record.m_size - 1 - sizeof(uint16_t);
+		if (length > space)
+		{
+			length = space;
+			record.m_truncated = true;
+		}
+
+		uint16_t stored = static_cast<uint16_t>(length);
+		record.m_data[record.m_size] = eA_STRING;
+		memcpy(&record.m_data[record.m_size + 1], &stored, sizeof(stored));
+		memcpy(&record.m_data[record.m_size + 1 + sizeof(stored)], value, length);
+		record.m_size += static_cast<uint16_t>(1 + sizeof(stored) + length);
+		++record.m_count;
+	}
+
+	// Log thread
+	void Main()
+	{
+		std::string batch;
+		batch.reserve(BATCH_SIZE * 256);
+		uint64_t reportedDropped = 0;
+
+		while (true)
+		{
+			batch.clear();
+			size_t consoleStart = 0;
+			bool consoleError = false;
+			size_t count = 0;
+			for (; count < BATCH_SIZE; ++count)
+			{
+				SRecord& record = m_records[m_dequeue & (CAPACITY - 1)];
+				if (record.m_sequence.load(std::memory_order_acquire) != m_dequeue + 1)
+				{
+					break;
+				}
+
+				// Console output goes in runs, as errors go to a different stream
+				bool error = (record.m_level <= eS_ERROR);
+				if ((error != consoleError) && (batch.size() > consoleStart))
+				{
+					(consoleError ? std::cerr : std::cout).write(batch.data() + consoleStart, batch.size() - consoleStart);
+					consoleStart = batch.size();
+				}
+				consoleError = error;
+
+				Format(record, batch);
+				record.m_sequence.store(m_dequeue + CAPACITY, std::memory_order_release);
+				++m_dequeue;
+			}
+
+			uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+			if (dropped != reportedDropped)
+			{
+				if (consoleError && (batch.size() > consoleStart))
+				{
+					std::cerr.write(batch.data() + consoleStart, batch.size() - consoleStart);
+					consoleStart = batch.size();
+				}
+				consoleError = false;
+				Append(batch, "[%s] ", level_to_string(eS_WARNING));
+				Append(batch, "%llu log messages dropped (%llu in total)\n", static_cast<unsigned long long>(dropped - reportedDropped), static_cast<unsigned long long>(dropped));
+				reportedDropped = dropped;
+			}
+
+			if (!batch.empty())
+			{
+				(consoleError ? std::cerr : std::cout).write(batch.data() + consoleStart, batch.size() - consoleStart);
+				std::cout.flush();
+				std::cerr.flush();
+				if (m_file != nullptr)
+				{
+					m_file->write(batch.data(), batch.size());
+					m_file->flush();
+				}
+			}
+
+			if (count == 0)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (m_records[m_dequeue & (CAPACITY - 1)].m_sequence.load(std::memory_order_acquire) != m_dequeue + 1)
+				{
+					if (m_terminate)
+					{
+						break;
+					}
+					m_wake.wait(lock);
+				}
+				m_sleeping.store(false, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void Format(const SRecord& record, std::string& out)
+	{
+#if defined _DEBUG
+		Append(out, "%s(%lu) [%s] ", record.m_file, record.m_line, level_to_string(record.m_level));
+#else
+		Append(out, "[%s] ", level_to_string(record.m_level));
+#endif // defined _DEBUG
+
+		const char* format = record.m_format;
+		if (record.m_count == 0)
+		{
+			// Not a format string when there are no arguments
+			out.append(format);
+		}
+		else
+		{
+			size_t offset = 0;
+			uint8_t remaining = record.m_count;
+			while (*format != 0)
+			{
+				const char* conversion = strchr(format, '%');
+				if (conversion == nullptr)
+				{
+					out.append(format);
+					break;
+				}
+				out.append(format, conversion - format);
+				if (conversion[1] == '%')
+				{
+					out.push_back('%');
+					format = conversion + 2;
+					continue;
+				}
+
+				// %[flags][width][.precision][length]type, with any '*' taken from the arguments
+				char specification[64];
+				size_t length = 0;
+				const char* end = conversion;
+				specification[length++] = *end++;
+				while ((*end != 0) && (strchr("-+ #0", *end) != nullptr) && (length < sizeof(specification) - 16))
+				{
+					specification[length++] = *end++;
+				}
+				while ((*end != 0) && (strchr("0123456789.*hljztLI", *end) != nullptr) && (length < sizeof(specification) - 16))
+				{
+					if ((*end == '*') && (remaining > 0) && (record.m_data[offset] == eA_INT))
+					{
+						int value;
+						memcpy(&value, &record.m_data[offset + 1], sizeof(value));
+						offset += 1 + sizeof(value);
+						--remaining;
+						length += snprintf(&specification[length], sizeof(specification) - length, "%d", value);
+						++end;
+					}
+					else
+					{
+						specification[length++] = *end++;
+					}
+				}
+				if (*end == 0)
+				{
+					out.append(conversion);
+					break;
+				}
+				specification[length++] = *end++;
+				specification[length] = 0;
+				format = end;
+
+				if (remaining == 0)
+				{
+					out.append(conversion, end - conversion); // more conversions than arguments
+					continue;
+				}
+				--remaining;
+
+				const char* value = &record.m_data[offset + 1];
+				switch (record.m_data[offset])
+				{
+				case eA_INT:
+					offset += 1 + AppendArgument<int>(out, specification, value);
+					break;
+				case eA_UINT:
+					offset += 1 + AppendArgument<unsigned int>(out, specification, value);
+					break;
+				case eA_LONG:
+					offset += 1 + AppendArgument<long>(out, specification, value);
+					break;
+				case eA_ULONG:
+					offset += 1 + AppendArgument<unsigned long>(out, specification, value);
+					break;
+				case eA_LONGLONG:
+					offset += 1 + AppendArgument<long long>(out, specification, value);
+					break;
+				case eA_ULONGLONG:
+					offset += 1 + AppendArgument<unsigned long long>(out, specification, value);
+					break;
+				case eA_DOUBLE:
+					offset += 1 + AppendArgument<double>(out, specification, value);
+					break;
+				case eA_POINTER:
+					offset += 1 + AppendArgument<const void*>(out, specification, value);
+					break;
+				case eA_STRING:
+					{
+						uint16_t stored;
+						memcpy(&stored, value, sizeof(stored));
+						m_scratch.assign(value + sizeof(stored), stored);
+						Append(out, specification, m_scratch.c_str());
+						offset += 1 + sizeof(stored) + stored;
+					}
+					break;
+				}
+			}
+		}
+
+		if (record.m_truncated)
+		{
+			out.append(" [truncated]");
+		}
+		out.push_back('\n');
+	}
+
+	// Reads a T stored at value and formats it; returns how many bytes it used
+	template<typename T>
+	static size_t AppendArgument(std::string& out, const char* specification, const char* value)
+	{
+		T argument;
+		memcpy(&argument, value, sizeof(argument));
+		Append(out, specification, argument);
+		return sizeof(argument);
+	}
+
+	template<typename ...Ts>
+	static void Append(std::string& out, const char* format, Ts... args)
+	{
+		char buffer[256];
+		int size = snprintf(buffer, sizeof(buffer), format, args...);
+		if (size < 0)
+		{
+			return;
+		}
+		if (static_cast<size_t>(size) < sizeof(buffer))
+		{
+			out.append(buffer, size);
+		}
+		else
+		{
+			size_t start = out.size();
+			out.resize(start + size + 1);
+			snprintf(&out[start], size + 1, format, args...);
+			out.resize(start + size);
+		}
+	}
+
+	const std::string m_name;
+	eSeverity m_level;
+	std::ofstream* m_file;
+
+	std::unique_ptr<SRecord[]> m_records;
+	alignas(64) std::atomic_size_t m_enqueue{ 0 };
+	alignas(64) size_t m_dequeue = 0; // only touched by the log thread
+	std::string m_scratch;
+	std::atomic_uint64_t m_dropped{ 0 };
+	std::atomic<eOverflow> m_overflow{ eO_BLOCK };
+	std::atomic_bool m_sleeping{ false };
+	bool m_terminate = false;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::thread m_thread;
+};
+
+extern CLog g_log;
+
+#define LOG_FATAL(_format, ...) g_log.write(CLog::eS_FATAL, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#define LOG_ERROR(_format, ...) g_log.write(CLog::eS_ERROR, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#define LOG_WARNING(_format, ...) g_log.write(CLog::eS_WARNING, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#define LOG_INFORMATION(_format, ...) g_log.write(CLog::eS_INFORMATION, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#if defined _DEBUG
+#define LOG_DEBUG(_format, ...) g_log.write(CLog::eS_DEBUG, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#define LOG_VERBOSE(_format, ...) g_log.write(CLog::eS_VERBOSE, __FILE__, __LINE__, _format, ##__VA_ARGS__)
+#else
+// Elide debug and verbose from release mode
+#define LOG_DEBUG(_format, ...)
+#define LOG_VERBOSE(_format, ...)
+#endif // defined _DEBUG
+
+/*
+class CWLog
+{
+public:
+	enum eSeverity
+	{
+		eS_FATAL,
+		eS_ERROR,
+		eS_WARNING,
+		eS_INFORMATION,
+		eS_VERBOSE,
+		eS_DEBUG
+	};
+
+	CWLog(const wchar_t* name = nullptr);
+	~CWLog();
+
+	eSeverity SetLogLevel(eSeverity level)
+	{
+		m_level = level;
+	}
+
+	template<typename ...Ts>
+	CWLog& write(eSeverity level, std::wstring&& file, unsigned long line, const std::wstring&& format, Ts... args);
+
+protected:
+	template <typename ...Ts>
+	std::wstring&& format_string(const std::wstring&& format, Ts... args)
+	{
+		auto size = swprintf(nullptr, 0, format.c_str(), args...) + 1; // +1 for the NULL
+		std::unique_ptr<wchar_t[]> buffer(new wchar_t[size]);
+		swprintf(buffer.get(), size, format.c_str(), Ts... args);
+		return std::wstring(buffer.get(), buffer.get() + size - 1); // -1 as we don't store the NULL
+	}
+
+private:
+	const std::wstring m_name;
+	eSeverity m_level;
+	std::unique_ptr<std::wofstream> m_file;
+};
 */
\ No newline at end of file
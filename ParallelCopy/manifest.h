@@ -0,0 +1,178 @@
+#pragma once
+
+// Memory mapped 'src|dst' manifest; entries are handed out as views into the mapping, so reading a line allocates nothing
+#include <cstdint>
+#include <string.h>
+
+#include "log.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CManifest
+{
+public:
+	// Views into the mapping; only valid for as long as the CManifest is
+	struct SEntry
+	{
+		const char* m_source = nullptr;
+		size_t m_sourceLength = 0;
+		const char* m_destination = nullptr;
+		size_t m_destinationLength = 0;
+		size_t m_line = 0; // 1 based
+	};
+
+	enum EResult : char
+	{
+		eR_OK,
+		eR_END,
+		eR_MALFORMED,
+	};
+
+	CManifest(const char* name)
+		: m_name{ name }
+	{
+#if defined(_WIN32)
+		m_file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			LARGE_INTEGER size;
+			FILETIME modified;
+			if (GetFileSizeEx(m_file, &size) && GetFileTime(m_file, nullptr, nullptr, &modified))
+			{
+				m_size = static_cast<size_t>(size.QuadPart);
+				m_modified = (static_cast<uint64_t>(modified.dwHighDateTime) << 32) | modified.dwLowDateTime;
+				m_open = true;
+				if (m_size > 0)
+				{
+					m_mapping = CreateFileMapping(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+					m_data = (m_mapping != nullptr) ? static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+					m_open = (m_data != nullptr);
+				}
+			}
+		}
+#else
+		int fd = open(name, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			struct stat info;
+			if (fstat(fd, &info) == 0)
+			{
+				m_size = static_cast<size_t>(info.st_size);
+				m_modified = (static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000ULL) + info.st_mtim.tv_nsec;
+				m_open = true;
+				if (m_size > 0)
+				{
+					void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+					if (data != MAP_FAILED)
+					{
+						// We only ever move forwards, so let the kernel read ahead and drop pages behind us
+						madvise(data, m_size, MADV_SEQUENTIAL);
+						m_data = static_cast<const char*>(data);
+					}
+					m_open = (m_data != nullptr);
+				}
+			}
+			close(fd); // the mapping holds its own reference
+		}
+#endif // defined(_WIN32)
+
+		if (!m_open)
+		{
+			LOG_ERROR("Unable to open manifest [%s]", name);
+		}
+	}
+
+	~CManifest()
+	{
+#if defined(_WIN32)
+		if (m_data != nullptr)
+		{
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping != nullptr)
+		{
+			CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_file);
+		}
+#else
+		if (m_data != nullptr)
+		{
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+#endif // defined(_WIN32)
+	}
+
+	inline bool IsOpen() const
+	{
+		return m_open;
+	}
+
+	inline const char* Name() const
+	{
+		return m_name;
+	}
+
+	inline size_t Size() const
+	{
+		return m_size;
+	}
+
+	// Last write time, in the platform's own units (100ns FILETIME ticks on Windows, ns since the epoch on Linux)
+	inline uint64_t Modified() const
+	{
+		return m_modified;
+	}
+
+	// Reads the next line; on eR_MALFORMED entry.m_line still identifies the offending line
+	EResult Next(SEntry& entry)
+	{
+		if (m_offset >= m_size)
+		{
+			return eR_END;
+		}
+
+		const char* line = m_data + m_offset;
+		size_t remaining = m_size - m_offset;
+		const char* end = static_cast<const char*>(memchr(line, '\n', remaining));
+		size_t length = (end != nullptr) ? static_cast<size_t>(end - line) : remaining;
+		m_offset += (end != nullptr) ? length + 1 : length;
+		if ((length > 0) && (line[length - 1] == '\r'))
+		{
+			--length;
+		}
+
+		entry.m_line = ++m_line;
+		const char* sep = static_cast<const char*>(memchr(line, '|', length));
+		if (sep == nullptr)
+		{
+			return eR_MALFORMED;
+		}
+
+		entry.m_source = line;
+		entry.m_sourceLength = static_cast<size_t>(sep - line);
+		entry.m_destination = sep + 1;
+		entry.m_destinationLength = length - entry.m_sourceLength - 1;
+		return eR_OK;
+	}
+
+private:
+	const char* m_name;
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	uint64_t m_modified = 0;
+	size_t m_offset = 0;
+	size_t m_line = 0;
+	bool m_open = false;
+#if defined(_WIN32)
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#endif // defined(_WIN32)
+};
@@ -0,0 +1,510 @@
+#pragma once
+
+// Throughput counters and latency histograms for the copy, with an optional thread that periodically writes them out
+// in Prometheus text format ('<path>.prom') and as JSON ('<path>.json') for monitoring to pick up.
+//
+// Counters live in cache line sized slots, one per thread (threads share a slot only past MAX_SLOTS), so recording a
+// copy never contends with other workers.  Latencies go into log-linear ('HDR' style) histograms, one per phase of a
+// copy (open, copy, close) and file size bucket, accurate to about 6% from a microsecond up to days.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "thread.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif // defined(_MSC_VER)
+
+// Log-linear histogram of microsecond latencies: 16 linear sub-buckets for every power of two
+class CLatencyHistogram
+{
+public:
+	static const unsigned int SUB_BUCKET_BITS = 4;
+	static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const unsigned int MAX_BITS = 40; // ~12 days
+	static const unsigned int BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	CLatencyHistogram()
+	{
+		for (std::atomic<uint64_t>& count : m_counts)
+		{
+			count = 0;
+		}
+	}
+
+	void Record(uint64_t microseconds)
+	{
+		microseconds = std::min<uint64_t>(microseconds, (1ULL << MAX_BITS) - 1);
+		m_counts[Index(microseconds)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(microseconds, std::memory_order_relaxed);
+		uint64_t max = m_max.load(std::memory_order_relaxed);
+		while ((microseconds > max) && !m_max.compare_exchange_weak(max, microseconds, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	inline uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+	inline uint64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+	inline uint64_t Max() const { return m_max.load(std::memory_order_relaxed); }
+
+	// Upper bound of the bucket holding the given fraction (0-1) of the samples
+	uint64_t Percentile(double fraction) const
+	{
+		uint64_t count = Count();
+		if (count == 0)
+		{
+			return 0;
+		}
+
+		uint64_t target = std::max<uint64_t>(static_cast<uint64_t>(fraction * count + 0.5), 1);
+		uint64_t seen = 0;
+		for (unsigned int index = 0; index < BUCKETS; ++index)
+		{
+			seen += m_counts[index].load(std::memory_order_relaxed);
+			if (seen >= target)
+			{
+				return std::min(UpperBound(index), Max());
+			}
+		}
+		return Max();
+	}
+
+	// Number of samples no bigger than microseconds; exact when it falls on a bucket boundary
+	uint64_t CountAtMost(uint64_t microseconds) const
+	{
+		uint64_t count = 0;
+		for (unsigned int index = 0; (index < BUCKETS) && (UpperBound(index) <= microseconds); ++index)
+		{
+			count += m_counts[index].load(std::memory_order_relaxed);
+		}
+		return count;
+	}
+
+private:
+	static unsigned int Index(uint64_t value)
+	{
+		if (value < SUB_BUCKETS)
+		{
+			return static_cast<unsigned int>(value);
+		}
+
+		unsigned int shift = HighestBit(value) - SUB_BUCKET_BITS;
+		return ((shift + 1) << SUB_BUCKET_BITS) + static_cast<unsigned int>((value >> shift) & (SUB_BUCKETS - 1));
+	}
+
+	// One past the biggest value that lands in the bucket
+	static uint64_t UpperBound(unsigned int index)
+	{
+		if (index < SUB_BUCKETS)
+		{
+			return index + 1;
+		}
+
+		unsigned int shift = (index >> SUB_BUCKET_BITS) - 1;
+		return static_cast<uint64_t>(SUB_BUCKETS + (index & (SUB_BUCKETS - 1)) + 1) << shift;
+	}
+
+	static inline unsigned int HighestBit(uint64_t value)
+	{
+#if defined(_MSC_VER)
+		unsigned long bit;
+		_BitScanReverse64(&bit, value);
+		return static_cast<unsigned int>(bit);
+#else
+		return 63 - static_cast<unsigned int>(__builtin_clzll(value));
+#endif // defined(_MSC_VER)
+	}
+
+	std::atomic<uint64_t> m_counts[BUCKETS];
+	std::atomic<uint64_t> m_count{ 0 };
+	std::atomic<uint64_t> m_sum{ 0 };
+	std::atomic<uint64_t> m_max{ 0 };
+};
+
+class CMetrics
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	enum EPhase : char
+	{
+		eP_OPEN,	// opening (and creating) the files
+		eP_COPY,	// moving the data
+		eP_CLOSE,	// setting attributes and closing
+		eP_COUNT,
+	};
+
+	enum ESize : char
+	{
+		eS_4K,
+		eS_64K,
+		eS_1M,
+		eS_16M,
+		eS_256M,
+		eS_HUGE,
+		eS_COUNT,
+	};
+
+	CMetrics()
+		: m_start{ Clock::now() }
+	{
+		for (SSlot& slot : m_slots)
+		{
+			slot.m_bytes = slot.m_files = slot.m_skipped = slot.m_errors = slot.m_retries = 0;
+		}
+	}
+
+	~CMetrics()
+	{
+		StopExporter();
+	}
+
+	inline void Copied(uint64_t bytes)
+	{
+		SSlot& slot = Slot();
+		Add(slot.m_files, 1);
+		Add(slot.m_bytes, bytes);
+	}
+
+	inline void Skipped()
+	{
+		Add(Slot().m_skipped, 1);
+	}
+
+	// A copy attempt that failed, whether or not it's retried
+	inline void Error()
+	{
+		Add(Slot().m_errors, 1);
+	}
+
+	inline void Retried()
+	{
+		Add(Slot().m_retries, 1);
+	}
+
+	void Latency(EPhase phase, uint64_t fileSize, Clock::duration elapsed)
+	{
+		int64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+		m_latency[phase][SizeBucket(fileSize)].Record(static_cast<uint64_t>(std::max<int64_t>(microseconds, 0)));
+	}
+
+	// Bytes and files copied so far, and the time spent copying them (in microseconds, over all phases)
+	void Progress(uint64_t& bytes, uint64_t& files, uint64_t& microseconds) const
+	{
+		STotals totals = Totals();
+		bytes = totals.m_bytes;
+		files = totals.m_files;
+		microseconds = 0;
+		for (int phase = 0; phase < eP_COUNT; ++phase)
+		{
+			for (int size = 0; size < eS_COUNT; ++size)
+			{
+				microseconds += m_latency[phase][size].Sum();
+			}
+		}
+	}
+
+	// Extra values to export alongside the counters, e.g. queue depths; read on the exporter thread
+	void AddGauge(const char* name, const char* help, std::function<double()>&& value)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_gauges.emplace_back(SGauge{ name, help, std::move(value) });
+	}
+
+	// Writes '<path>.prom' and '<path>.json' every interval, and once more when stopped.  Each file is written under a
+	// temporary name and renamed over the last, so readers never see a partial snapshot.
+	void StartExporter(const char* path, unsigned int intervalMs)
+	{
+		m_path = path;
+		m_intervalMs = std::max(intervalMs, 100u);
+		std::string name("MetricsThread");
+		m_exporter.reset(new CThread(name));
+		m_exporter->Start([this]() { this->Main(); });
+	}
+
+	void StopExporter()
+	{
+		if (m_exporter)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_terminate = true;
+			}
+			m_wake.notify_one();
+			m_exporter->Join();
+			m_exporter.reset();
+		}
+	}
+
+	// Totals and latency percentiles for the log at the end of a run
+	void Report()
+	{
+		STotals totals = Totals();
+		double seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+		LOG_INFORMATION("%llu files (%llu bytes) copied in %.1fs: %.1f files/s, %.1f MB/s; %llu errors, %llu retries", totals.m_files, totals.m_bytes, seconds, totals.m_files / seconds, (totals.m_bytes / seconds) / (1024 * 1024), totals.m_errors, totals.m_retries);
+		for (int phase = 0; phase < eP_COUNT; ++phase)
+		{
+			for (int size = 0; size < eS_COUNT; ++size)
+			{
+				const CLatencyHistogram& histogram = m_latency[phase][size];
+				if (histogram.Count() > 0)
+				{
+					LOG_INFORMATION("[%s] files %s: %llu, p50 %lluus, p99 %lluus, max %lluus", PhaseToString(static_cast<EPhase>(phase)), SizeToString(static_cast<ESize>(size)), histogram.Count(), histogram.Percentile(0.5), histogram.Percentile(0.99), histogram.Max());
+				}
+			}
+		}
+	}
+
+	static const char* PhaseToString(EPhase phase)
+	{
+		static const char* names[eP_COUNT] = { "open", "copy", "close" };
+		return (phase < eP_COUNT) ? names[phase] : "???";
+	}
+
+	static const char* SizeToString(ESize size)
+	{
+		static const char* names[eS_COUNT] = { "0-4K", "4K-64K", "64K-1M", "1M-16M", "16M-256M", "256M+" };
+		return (size < eS_COUNT) ? names[size] : "???";
+	}
+
+private:
+	static const size_t MAX_SLOTS = 256;
+
+	struct alignas(64) SSlot
+	{
+		std::atomic<uint64_t> m_bytes;
+		std::atomic<uint64_t> m_files;
+		std::atomic<uint64_t> m_skipped;
+		std::atomic<uint64_t> m_errors;
+		std::atomic<uint64_t> m_retries;
+	};
+
+	struct STotals
+	{
+		uint64_t m_bytes = 0;
+		uint64_t m_files = 0;
+		uint64_t m_skipped = 0;
+		uint64_t m_errors = 0;
+		uint64_t m_retries = 0;
+	};
+
+	struct SGauge
+	{
+		std::string m_name;
+		std::string m_help;
+		std::function<double()> m_value;
+	};
+
+	// The slot's cache line is normally only ever touched by this thread, so the add is uncontended
+	static inline void Add(std::atomic<uint64_t>& counter, uint64_t value)
+	{
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	SSlot& Slot()
+	{
+		thread_local size_t index = m_nextSlot++;
+		if (index >= MAX_SLOTS)
+		{
+			return m_slots[MAX_SLOTS]; // out of private slots
+		}
+		return m_slots[index];
+	}
+
+	static ESize SizeBucket(uint64_t size)
+	{
+		int bucket = eS_4K;
+		for (uint64_t limit = 4 * 1024; (size >= limit) && (bucket < eS_HUGE); limit *= 16)
+		{
+			++bucket;
+		}
+		return static_cast<ESize>(bucket);
+	}
+
+	STotals Totals() const
+	{
+		STotals totals;
+		for (const SSlot& slot : m_slots)
+		{
+			totals.m_bytes += slot.m_bytes.load(std::memory_order_relaxed);
+			totals.m_files += slot.m_files.load(std::memory_order_relaxed);
+			totals.m_skipped += slot.m_skipped.load(std::memory_order_relaxed);
+			totals.m_errors += slot.m_errors.load(std::memory_order_relaxed);
+			totals.m_retries += slot.m_retries.load(std::memory_order_relaxed);
+		}
+		return totals;
+	}
+
+	void Main()
+	{
+		STotals previous;
+		Clock::time_point previousTime = m_start;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_wake.wait_for(lock, std::chrono::milliseconds(m_intervalMs), [this]() { return m_terminate; });
+			bool terminate = m_terminate;
+			lock.unlock();
+
+			Clock::time_point now = Clock::now();
+			STotals totals = Totals();
+			double interval = std::max(std::chrono::duration<double>(now - previousTime).count(), 1e-3);
+			Export(totals, (totals.m_bytes - previous.m_bytes) / interval, (totals.m_files - previous.m_files) / interval, std::chrono::duration<double>(now - m_start).count());
+			previous = totals;
+			previousTime = now;
+
+			lock.lock();
+			if (terminate)
+			{
+				break;
+			}
+		}
+	}
+
+	void Export(const STotals& totals, double bytesPerSecond, double filesPerSecond, double elapsed)
+	{
+		std::string prometheus;
+		std::string json;
+		Append(json, "{\"elapsed_seconds\":%.3f,\"bytes\":%llu,\"files\":%llu,\"skipped\":%llu,\"errors\":%llu,\"retries\":%llu,\"bytes_per_second\":%.0f,\"files_per_second\":%.1f", elapsed, totals.m_bytes, totals.m_files, totals.m_skipped, totals.m_errors, totals.m_retries, bytesPerSecond, filesPerSecond);
+
+		// Per thread counters
+		static const char* counters[][2] = {
+			{ "bytes", "Bytes copied" },
+			{ "files", "Files copied" },
+			{ "skipped", "Files skipped as unchanged" },
+			{ "errors", "Failed copy attempts" },
+			{ "retries", "Copy attempts retried" },
+		};
+		json += ",\"threads\":[";
+		bool first = true;
+		for (size_t index = 0; index <= MAX_SLOTS; ++index)
+		{
+			const SSlot& slot = m_slots[index];
+			uint64_t values[] = { slot.m_bytes.load(std::memory_order_relaxed), slot.m_files.load(std::memory_order_relaxed), slot.m_skipped.load(std::memory_order_relaxed), slot.m_errors.load(std::memory_order_relaxed), slot.m_retries.load(std::memory_order_relaxed) };
+			if ((values[0] | values[1] | values[2] | values[3] | values[4]) != 0)
+			{
+				Append(json, "%s{\"thread\":%d,\"bytes\":%llu,\"files\":%llu,\"skipped\":%llu,\"errors\":%llu,\"retries\":%llu}", first ? "" : ",", static_cast<int>(index), values[0], values[1], values[2], values[3], values[4]);
+				first = false;
+			}
+		}
+		json += "]";
+		for (size_t counter = 0; counter < sizeof(counters) / sizeof(counters[0]); ++counter)
+		{
+			Append(prometheus, "# HELP parallelcopy_%s_total %s\n# TYPE parallelcopy_%s_total counter\n", counters[counter][0], counters[counter][1], counters[counter][0]);
+			for (size_t index = 0; index <= MAX_SLOTS; ++index)
+			{
+				const SSlot& slot = m_slots[index];
+				uint64_t values[] = { slot.m_bytes.load(std::memory_order_relaxed), slot.m_files.load(std::memory_order_relaxed), slot.m_skipped.load(std::memory_order_relaxed), slot.m_errors.load(std::memory_order_relaxed), slot.m_retries.load(std::memory_order_relaxed) };
+				if ((values[0] | values[1] | values[2] | values[3] | values[4]) != 0)
+				{
+					Append(prometheus, "parallelcopy_%s_total{thread=\"%d\"} %llu\n", counters[counter][0], static_cast<int>(index), values[counter]);
+				}
+			}
+		}
+
+		// Latencies, as histograms for Prometheus (on fixed 1-2-5 boundaries) and as percentiles in the JSON
+		static const uint64_t boundaries[] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000, 50000000, 100000000 };
+		prometheus += "# HELP parallelcopy_latency_seconds Time spent in each phase of copying a file, by file size\n# TYPE parallelcopy_latency_seconds histogram\n";
+		json += ",\"latency_us\":[";
+		first = true;
+		for (int phase = 0; phase < eP_COUNT; ++phase)
+		{
+			for (int size = 0; size < eS_COUNT; ++size)
+			{
+				const CLatencyHistogram& histogram = m_latency[phase][size];
+				uint64_t count = histogram.Count();
+				if (count == 0)
+				{
+					continue;
+				}
+
+				const char* phaseName = PhaseToString(static_cast<EPhase>(phase));
+				const char* sizeName = SizeToString(static_cast<ESize>(size));
+				for (uint64_t boundary : boundaries)
+				{
+					Append(prometheus, "parallelcopy_latency_seconds_bucket{phase=\"%s\",size=\"%s\",le=\"%g\"} %llu\n", phaseName, sizeName, boundary / 1e6, histogram.CountAtMost(boundary));
+				}
+				Append(prometheus, "parallelcopy_latency_seconds_bucket{phase=\"%s\",size=\"%s\",le=\"+Inf\"} %llu\n", phaseName, sizeName, count);
+				Append(prometheus, "parallelcopy_latency_seconds_sum{phase=\"%s\",size=\"%s\"} %.6f\n", phaseName, sizeName, histogram.Sum() / 1e6);
+				Append(prometheus, "parallelcopy_latency_seconds_count{phase=\"%s\",size=\"%s\"} %llu\n", phaseName, sizeName, count);
+
+				Append(json, "%s{\"phase\":\"%s\",\"size\":\"%s\",\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", first ? "" : ",", phaseName, sizeName, count, histogram.Percentile(0.5), histogram.Percentile(0.9), histogram.Percentile(0.99), histogram.Percentile(0.999), histogram.Max());
+				first = false;
+			}
+		}
+		json += "]";
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (SGauge& gauge : m_gauges)
+			{
+				double value = gauge.m_value();
+				Append(prometheus, "# HELP parallelcopy_%s %s\n# TYPE parallelcopy_%s gauge\nparallelcopy_%s %g\n", gauge.m_name.c_str(), gauge.m_help.c_str(), gauge.m_name.c_str(), gauge.m_name.c_str(), value);
+				Append(json, ",\"%s\":%g", gauge.m_name.c_str(), value);
+			}
+		}
+
+		prometheus += "# HELP parallelcopy_bytes_per_second Copy rate over the last export interval\n# TYPE parallelcopy_bytes_per_second gauge\n";
+		Append(prometheus, "parallelcopy_bytes_per_second %.0f\n", bytesPerSecond);
+		json += "}\n";
+
+		WriteFile(m_path + ".prom", prometheus);
+		WriteFile(m_path + ".json", json);
+	}
+
+	template<typename... Args>
+	static void Append(std::string& text, const char* format, Args... args)
+	{
+		char buffer[1024];
+		int length = snprintf(buffer, sizeof(buffer), format, args...);
+		if (length > 0)
+		{
+			text.append(buffer, std::min(static_cast<size_t>(length), sizeof(buffer) - 1));
+		}
+	}
+
+	void WriteFile(const std::string& name, const std::string& text)
+	{
+		std::string temporary = name + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		bool written = (file != nullptr) && (fwrite(text.data(), 1, text.size(), file) == text.size());
+		written = (file != nullptr) && (fclose(file) == 0) && written;
+#if defined(_WIN32)
+		written = written && MoveFileExA(temporary.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+		written = written && (rename(temporary.c_str(), name.c_str()) == 0);
+#endif // defined(_WIN32)
+		if (!written && !m_exportFailed)
+		{
+			LOG_WARNING("Unable to write metrics to [%s]", name.c_str());
+			m_exportFailed = true;
+		}
+	}
+
+	const Clock::time_point m_start;
+	SSlot m_slots[MAX_SLOTS + 1]; // the last is shared by any threads beyond MAX_SLOTS
+	std::atomic_size_t m_nextSlot{ 0 };
+	CLatencyHistogram m_latency[eP_COUNT][eS_COUNT];
+
+	std::unique_ptr<CThread> m_exporter;
+	std::string m_path;
+	unsigned int m_intervalMs = 1000;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::vector<SGauge> m_gauges;
+	bool m_terminate = false;
+	bool m_exportFailed = false;
+};
+
+extern CMetrics g_metrics;
@@ -0,0 +1,158 @@
+#pragma once
+
+// Decides how long to wait before retrying a failed copy: exponential backoff per file with jitter, stretched further
+// while the destination it's going to (the share or mount, not the individual file) keeps failing, so a flaky server
+// gets left alone rather than hammered by every file queued for it
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "log.h"
+
+class CRetryPolicy
+{
+public:
+	CRetryPolicy(unsigned int baseDelayMs, unsigned int maxDelayMs)
+		: m_baseDelayMs{ baseDelayMs }
+		, m_maxDelayMs{ maxDelayMs }
+	{
+	}
+
+	void SetDelays(unsigned int baseDelayMs, unsigned int maxDelayMs)
+	{
+		m_baseDelayMs = baseDelayMs;
+		m_maxDelayMs = std::max(maxDelayMs, baseDelayMs);
+	}
+
+	// Records attempt (1 based) of a copy to destination as failed, and returns how long to wait before the next one
+	std::chrono::milliseconds Failed(const std::string& destination, unsigned int attempt)
+	{
+		unsigned int streak;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			SDestination& state = m_destinations[DestinationKey(destination)];
+			if (attempt <= 1)
+			{
+				// Only first attempts count towards the streak, so it measures how many files are failing rather than
+				// how often the same few are retried
+				if (state.m_streak++ == 0)
+				{
+					++m_failing;
+				}
+			}
+			++state.m_failures;
+			streak = state.m_streak;
+		}
+
+		// The delay doubles with each attempt at this file, and once STREAK_THRESHOLD files in a row have failed on the
+		// destination, again each time that streak doubles (up to 32x)
+		unsigned int exponent = std::min(std::max(attempt, 1u) - 1, 30u);
+		for (unsigned int boost = 0; (streak >= STREAK_THRESHOLD) && (boost < 5); streak >>= 1, ++boost)
+		{
+			++exponent;
+		}
+		return Delay(exponent);
+	}
+
+	// Any success on a destination ends its failure streak
+	void Succeeded(const std::string& destination)
+	{
+		if (m_failing == 0)
+		{
+			return; // the usual case, and lock free
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_destinations.find(DestinationKey(destination));
+		if ((it != m_destinations.end()) && (it->second.m_streak > 0))
+		{
+			it->second.m_streak = 0;
+			++it->second.m_recoveries;
+			--m_failing;
+		}
+	}
+
+	void Report()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& destination : m_destinations)
+		{
+			LOG_INFORMATION("[%s] failed %d times, recovered %d times%s", destination.first.empty() ? "." : destination.first.c_str(), destination.second.m_failures, destination.second.m_recoveries, (destination.second.m_streak > 0) ? ", still failing" : "");
+		}
+	}
+
+	// The share ('\\server\share'), drive ('X:') or top two directories ('/mnt/nas') a path lives on
+	static std::string DestinationKey(const std::string& path)
+	{
+		size_t end = std::string::npos;
+		if ((path.length() > 2) && IsSeparator(path[0]) && IsSeparator(path[1]))
+		{
+			end = NextSeparator(path, NextSeparator(path, 2) + 1);
+		}
+		else if ((path.length() > 1) && (path[1] == ':'))
+		{
+			end = 2;
+		}
+		else if (!path.empty() && IsSeparator(path[0]))
+		{
+			// The file itself isn't part of the key
+			size_t first = NextSeparator(path, 1);
+			size_t second = (first < path.length()) ? NextSeparator(path, first + 1) : first;
+			end = (second < path.length()) ? second : (first < path.length()) ? first : 1;
+		}
+		else
+		{
+			end = 0; // relative to the current directory
+		}
+
+		return path.substr(0, end);
+	}
+
+private:
+	static const unsigned int STREAK_THRESHOLD = 8;
+
+	struct SDestination
+	{
+		unsigned int m_streak = 0; // failures since the last success
+		unsigned int m_failures = 0;
+		unsigned int m_recoveries = 0;
+	};
+
+	static inline bool IsSeparator(char c)
+	{
+		return (c == '/') || (c == '\\');
+	}
+
+	static size_t NextSeparator(const std::string& path, size_t from)
+	{
+		size_t next = path.find_first_of("/\\", std::min(from, path.length()));
+		return (next == std::string::npos) ? path.length() : next;
+	}
+
+	// base * 2^exponent, capped, with 'equal jitter' (half fixed, half random) so retries that failed together
+	// don't all come back together
+	std::chrono::milliseconds Delay(unsigned int exponent)
+	{
+		uint64_t delay = std::min<uint64_t>(static_cast<uint64_t>(m_baseDelayMs) << std::min(exponent, 32u), m_maxDelayMs);
+		uint64_t half = delay / 2;
+		std::uniform_int_distribution<uint64_t> jitter(0, delay - half);
+		return std::chrono::milliseconds(half + jitter(Random()));
+	}
+
+	static std::minstd_rand& Random()
+	{
+		thread_local std::minstd_rand random(static_cast<unsigned int>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+		return random;
+	}
+
+	unsigned int m_baseDelayMs;
+	unsigned int m_maxDelayMs;
+	std::atomic_size_t m_failing{ 0 }; // destinations currently on a failure streak
+	std::mutex m_mutex;
+	std::unordered_map<std::string, SDestination> m_destinations;
+};
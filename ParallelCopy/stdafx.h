@@ -1,16 +1,21 @@
-// stdafx.h : include file for standard system include files,
-// or project specific include files that are used frequently, but
-// are changed infrequently
-//
-
-#pragma once
-
-#include "targetver.h"
-
-#include <stdio.h>
-#include <tchar.h>
-#include <ShlObj.h>
-
-
-
-// TODO: reference additional headers your program requires here
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#if defined(_WIN32)
+#include <tchar.h>
+#include <ShlObj.h>
+#else
+#include <strings.h>
+#define _stricmp strcasecmp
+#endif // defined(_WIN32)
+
+
+
+// TODO: reference additional headers your program requires here
@@ -0,0 +1,468 @@
+#pragma once
+
+// Parallel source tree walk, for copying a directory without a manifest.  Every directory is a job on the job system:
+// it reads its entries in large batches (getdents64() on Linux, FindFirstFileEx() with FIND_FIRST_EX_LARGE_FETCH on
+// Windows), queues a job per subdirectory and hands each file straight to the caller, so copying starts with the first
+// file found rather than after the whole tree has been scanned.
+//
+// Subdirectories are queued before the directory's files, and a worker takes the jobs it queued itself newest first, so
+// it copies a directory's files before going deeper.  That alone doesn't bound anything, since directories are read far
+// faster than their files are copied: once the copies queued or running reach the in-flight limit, the subdirectories
+// found are held back as paths and released one at a time as copies finish.  What's queued is then the limit plus the
+// files of the directories being read at that moment; the held paths still grow with the tree's directories, but not
+// with its files.  On Linux a subdirectory is opened with openat() relative to its parent while the parent is still
+// open, and the fd handed to its job, so the kernel never re-walks a full path (held ones are opened by path later).
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "jobsystem.h"
+#include "log.h"
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+class CTreeWalker
+{
+public:
+	// Called on a worker, in a job of its own, to copy each regular file found (given its source and destination paths)
+	typedef std::function<void(const std::string&, const std::string&)> Found;
+
+	CTreeWalker(CJobSystem& jobSystem, size_t maxInFlight, Found&& found)
+		: m_jobSystem(jobSystem)
+		, m_found{ std::move(found) }
+		, m_maxInFlight(std::max<size_t>(maxInFlight, 1))
+	{
+#if !defined(_WIN32)
+		// Directory fds count against RLIMIT_NOFILE along with the destination directory cache and the files being
+		// copied; past this share, queued directories are opened by path when their job runs instead
+		struct rlimit limit;
+		if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY))
+		{
+			m_maxFds = std::max<size_t>(static_cast<size_t>(limit.rlim_cur / 8), 16);
+		}
+#endif // !defined(_WIN32)
+	}
+
+	// Queues the walk of source, whose files are copied to the same relative paths under destination; returns false if
+	// source isn't a directory, or destination is inside it.  The walk is done when the job system goes idle.
+	bool Walk(const std::string& source, const std::string& destination)
+	{
+		std::string root(Trim(source));
+		if (Inside(root, Trim(destination)))
+		{
+			LOG_ERROR("Not copying [%s] to [%s]: the destination is inside the source, so the walk would find the copies", root.c_str(), destination.c_str());
+			return false;
+		}
+#if defined(_WIN32)
+		DWORD attributes = GetFileAttributesA(root.c_str());
+		if ((attributes == INVALID_FILE_ATTRIBUTES) || ((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0))
+		{
+			LOG_ERROR("[%s] isn't a directory", root.c_str());
+			return false;
+		}
+		int fd = -1;
+#else
+		int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			LOG_ERROR("Unable to open directory [%s]: [%s]", root.c_str(), strerror(errno));
+			return false;
+		}
+		++m_openFds;
+#endif // defined(_WIN32)
+
+		m_start = std::chrono::steady_clock::now();
+		Queue(fd, root, Trim(destination));
+		return true;
+	}
+
+	inline size_t Directories() const
+	{
+		return m_directories.load();
+	}
+
+	inline size_t Files() const
+	{
+		return m_files.load();
+	}
+
+	// Symlinks, devices, sockets and the like, which aren't copied
+	inline size_t Skipped() const
+	{
+		return m_skipped.load();
+	}
+
+	inline size_t Errors() const
+	{
+		return m_errors.load();
+	}
+
+	// True once every directory has been read (the copies may still be running)
+	inline bool Finished() const
+	{
+		return m_pending.load() == 0;
+	}
+
+	// path without any trailing separators
+	static std::string Trim(const std::string& path)
+	{
+		size_t length = path.length();
+		while ((length > 1) && IsSeparator(path[length - 1]))
+		{
+			--length;
+		}
+		return std::string(path, 0, length);
+	}
+
+private:
+	static const size_t BUFFER_SIZE = 256 * 1024; // getdents64() batch; one syscall covers thousands of entries
+
+	static inline bool IsSeparator(char c)
+	{
+#if defined(_WIN32)
+		return (c == '\\') || (c == '/');
+#else
+		return c == '/';
+#endif // defined(_WIN32)
+	}
+
+	static std::string Join(const std::string& directory, const char* name)
+	{
+		std::string path(directory);
+		if (path.empty() || !IsSeparator(path.back()))
+		{
+#if defined(_WIN32)
+			path += '\\';
+#else
+			path += '/';
+#endif // defined(_WIN32)
+		}
+		path += name;
+		return path;
+	}
+
+	// True if destination is source or somewhere beneath it
+	static bool Inside(const std::string& source, const std::string& destination)
+	{
+#if defined(_WIN32)
+		char sourcePath[MAX_PATH];
+		char destinationPath[MAX_PATH];
+		if ((GetFullPathNameA(source.c_str(), MAX_PATH, sourcePath, nullptr) == 0) || (GetFullPathNameA(destination.c_str(), MAX_PATH, destinationPath, nullptr) == 0))
+		{
+			return false;
+		}
+		std::string root(Trim(sourcePath));
+		std::string path(Trim(destinationPath));
+		return (path.length() >= root.length()) && (_strnicmp(path.c_str(), root.c_str(), root.length()) == 0) && ((path.length() == root.length()) || IsSeparator(root.back()) || IsSeparator(path[root.length()]));
+#else
+		// Compared by device and inode rather than by name, so symlinks and relative paths can't hide it
+		struct stat root;
+		if (stat(source.c_str(), &root) != 0)
+		{
+			return false;
+		}
+
+		// The nearest part of destination that exists...
+		std::string path(destination);
+		struct stat info;
+		while (stat(path.c_str(), &info) != 0)
+		{
+			if ((path == ".") || (path == "/"))
+			{
+				return false;
+			}
+			size_t separator = path.find_last_of('/');
+			path = (separator == std::string::npos) ? "." : (separator == 0) ? "/" : path.substr(0, separator);
+		}
+
+		// ...and each directory above it, up to the root (which is its own parent)
+		while ((info.st_dev != root.st_dev) || (info.st_ino != root.st_ino))
+		{
+			struct stat parent;
+			path += "/..";
+			if ((stat(path.c_str(), &parent) != 0) || ((parent.st_dev == info.st_dev) && (parent.st_ino == info.st_ino)))
+			{
+				return false;
+			}
+			info = parent;
+		}
+		return true;
+#endif // defined(_WIN32)
+	}
+
+	void Queue(int fd, const std::string& source, const std::string& destination)
+	{
+		++m_pending;
+		Submit(fd, source, destination);
+	}
+
+	void Submit(int fd, const std::string& source, const std::string& destination)
+	{
+		m_jobSystem.AddJob([this, fd, source, destination]() {
+			Directory(fd, source, destination);
+		});
+	}
+
+	// Queues the subdirectory unless the copies have reached the limit, in which case it's held until they drop back;
+	// decided under the lock Copied() releases under, so a directory can't be held just after the last copy finished
+	bool Hold(const std::string& source, const std::string& destination)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_inFlight < m_maxInFlight)
+		{
+			return false;
+		}
+		++m_pending;
+		m_held.emplace_back(SHeld{ source, destination });
+		return true;
+	}
+
+	// Queues the most recently held directory if there's room for its files
+	void Release()
+	{
+		SHeld held;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_held.empty() || (m_inFlight >= m_maxInFlight))
+			{
+				return;
+			}
+			held = std::move(m_held.back());
+			m_held.pop_back();
+		}
+		Submit(-1, held.m_source, held.m_destination);
+	}
+
+	void Copy(const std::string& source, const std::string& destination)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_inFlight;
+		}
+		m_jobSystem.AddJob([this, source, destination]() {
+			m_found(source, destination);
+			Copied();
+		});
+	}
+
+	// Runs in the copy's job, so anything released is queued before the job system could see itself idle
+	void Copied()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_inFlight;
+		}
+		Release();
+	}
+
+	// Reads one directory; fd is the directory already opened by its parent's job, or -1 to open it by path
+	void Directory(int fd, const std::string& source, const std::string& destination)
+	{
+		std::vector<std::string> directories;
+		std::vector<std::string> files;
+		if (Read(fd, source, directories, files))
+		{
+			++m_directories;
+		}
+		else
+		{
+			++m_errors;
+		}
+
+		for (const std::string& name : directories)
+		{
+			std::string childSource(Join(source, name.c_str()));
+			std::string childDestination(Join(destination, name.c_str()));
+			if (Hold(childSource, childDestination))
+			{
+				continue;
+			}
+
+			int child = -1;
+#if !defined(_WIN32)
+			if ((fd >= 0) && (m_openFds.load() < m_maxFds))
+			{
+				child = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (child >= 0)
+				{
+					++m_openFds;
+				}
+			}
+#endif // !defined(_WIN32)
+			Queue(child, childSource, childDestination);
+		}
+
+#if !defined(_WIN32)
+		if (fd >= 0)
+		{
+			close(fd);
+			--m_openFds;
+		}
+#endif // !defined(_WIN32)
+
+		m_files += files.size();
+		for (const std::string& name : files)
+		{
+			Copy(Join(source, name.c_str()), Join(destination, name.c_str()));
+		}
+
+		// Nothing else may be left to release a held directory once this one's done
+		Release();
+
+		if (--m_pending == 0)
+		{
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+			LOG_INFORMATION("Walked [%d] directories in [%.1fs]: [%d] files found, [%d] skipped (not regular files), [%d] directories unreadable", Directories(), seconds, Files(), Skipped(), Errors());
+		}
+	}
+
+#if defined(_WIN32)
+	bool Read(int fd, const std::string& source, std::vector<std::string>& directories, std::vector<std::string>& files)
+	{
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileExA(Join(source, "*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+		if (find == INVALID_HANDLE_VALUE)
+		{
+			LOG_ERROR("Unable to read directory [%s]: error 0x%08X", source.c_str(), GetLastError());
+			return false;
+		}
+
+		do
+		{
+			const char* name = data.cFileName;
+			if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
+			{
+				continue;
+			}
+
+			if ((data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+			{
+				++m_skipped; // junctions and symlinks
+			}
+			else if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+			{
+				directories.emplace_back(name);
+			}
+			else
+			{
+				files.emplace_back(name);
+			}
+		} while (FindNextFileA(find, &data));
+
+		FindClose(find);
+		return true;
+	}
+#else
+	// The kernel's struct linux_dirent64, which glibc doesn't export
+	struct SDirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+
+	bool Read(int& fd, const std::string& source, std::vector<std::string>& directories, std::vector<std::string>& files)
+	{
+		if (fd < 0)
+		{
+			fd = open(source.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd < 0)
+			{
+				LOG_ERROR("Unable to open directory [%s]: [%s]", source.c_str(), strerror(errno));
+				return false;
+			}
+			++m_openFds;
+		}
+
+		thread_local std::unique_ptr<char[]> buffer(new char[BUFFER_SIZE]);
+		while (true)
+		{
+			long bytes = syscall(SYS_getdents64, fd, buffer.get(), BUFFER_SIZE);
+			if (bytes == 0)
+			{
+				return true;
+			}
+			else if (bytes < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				LOG_ERROR("Unable to read directory [%s]: [%s]", source.c_str(), strerror(errno));
+				return false;
+			}
+
+			for (long offset = 0; offset < bytes; )
+			{
+				const SDirent64* entry = reinterpret_cast<const SDirent64*>(buffer.get() + offset);
+				offset += entry->d_reclen;
+				const char* name = entry->d_name;
+				if ((name[0] == '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0))))
+				{
+					continue;
+				}
+
+				unsigned char type = entry->d_type;
+				if (type == DT_UNKNOWN)
+				{
+					// Some filesystems don't fill in the type
+					struct stat info;
+					type = (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) ? DT_UNKNOWN : S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+				}
+
+				if (type == DT_DIR)
+				{
+					directories.emplace_back(name);
+				}
+				else if (type == DT_REG)
+				{
+					files.emplace_back(name);
+				}
+				else
+				{
+					++m_skipped;
+					LOG_DEBUG("Skipping [%s/%s]: not a regular file or directory", source.c_str(), name);
+				}
+			}
+		}
+	}
+#endif // defined(_WIN32)
+
+	// A subdirectory waiting for the copies to drop below the limit
+	struct SHeld
+	{
+		std::string m_source;
+		std::string m_destination;
+	};
+
+	CJobSystem& m_jobSystem;
+	Found m_found;
+	std::mutex m_mutex;
+	std::vector<SHeld> m_held; // newest last, so the walk carries on deepest first
+	size_t m_inFlight = 0; // copies queued or running
+	size_t m_maxInFlight;
+	std::chrono::steady_clock::time_point m_start;
+	std::atomic<size_t> m_pending{ 0 }; // directories queued or being read
+	std::atomic<size_t> m_directories{ 0 };
+	std::atomic<size_t> m_files{ 0 };
+	std::atomic<size_t> m_skipped{ 0 };
+	std::atomic<size_t> m_errors{ 0 };
+	std::atomic<size_t> m_openFds{ 0 };
+	size_t m_maxFds = 1024;
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#if !defined(_WIN32)
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Minimal wrapper around the raw io_uring syscalls and the shared submission/completion rings
+class CUring
+{
+public:
+	CUring(unsigned int entries)
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (m_fd < 0)
+		{
+			LOG_DEBUG("io_uring_setup() failed: [%s]", strerror(errno));
+			return;
+		}
+
+		m_sqRingSize = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+		m_cqRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+		}
+
+		m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		m_cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sqRing : mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		m_sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+		if ((m_sqRing == MAP_FAILED) || (m_cqRing == MAP_FAILED) || (m_sqes == MAP_FAILED))
+		{
+			LOG_DEBUG("Unable to map io_uring rings: [%s]", strerror(errno));
+			close(m_fd);
+			m_fd = -1;
+			return;
+		}
+
+		char* sq = static_cast<char*>(m_sqRing);
+		m_sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+		m_sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+		m_sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+		m_sqEntries = params.sq_entries;
+		uint32_t* array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+		for (uint32_t index = 0; index < m_sqEntries; ++index)
+		{
+			array[index] = index;
+		}
+
+		char* cq = static_cast<char*>(m_cqRing);
+		m_cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+		m_cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+		m_cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+		m_sqeTail = *m_sqTail;
+	}
+
+	~CUring()
+	{
+		if (m_fd >= 0)
+		{
+			munmap(m_sqes, m_sqEntries * sizeof(struct io_uring_sqe));
+			if (m_cqRing != m_sqRing)
+			{
+				munmap(m_cqRing, m_cqRingSize);
+			}
+			munmap(m_sqRing, m_sqRingSize);
+			close(m_fd);
+		}
+	}
+
+	inline bool IsOpen() const
+	{
+		return m_fd >= 0;
+	}
+
+	bool RegisterBuffers(const struct iovec* buffers, unsigned int count)
+	{
+		return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	}
+
+	// Returns a zeroed submission entry, or nullptr if the submission ring is full
+	struct io_uring_sqe* GetSqe()
+	{
+		uint32_t head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		if (m_sqeTail - head >= m_sqEntries)
+		{
+			return nullptr;
+		}
+
+		struct io_uring_sqe* sqe = &m_sqes[m_sqeTail & m_sqMask];
+		memset(sqe, 0, sizeof(*sqe));
+		++m_sqeTail;
+		return sqe;
+	}
+
+	// Submission entries free to prepare without GetSqe() returning nullptr
+	inline unsigned int Available() const
+	{
+		return m_sqEntries - (m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+	}
+
+	// Submits everything prepared and not yet taken by the kernel in a single syscall, optionally waiting for completions.
+	// Returns the number submitted or -errno; after -EBUSY or -EAGAIN whatever wasn't taken goes with the next call.
+	int Submit(unsigned int waitFor)
+	{
+		uint32_t toSubmit = m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		__atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+		if ((toSubmit == 0) && (waitFor == 0))
+		{
+			return 0;
+		}
+
+		int ret;
+		do
+		{
+			ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, toSubmit, waitFor, (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+		} while ((ret < 0) && (errno == EINTR));
+		return (ret < 0) ? -errno : ret;
+	}
+
+	// Takes back every entry the kernel hasn't consumed, calling function with each one's user_data
+	template<typename functor>
+	unsigned int Discard(functor function)
+	{
+		uint32_t head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		std::vector<uint64_t> discarded;
+		for (uint32_t index = head; index != m_sqeTail; ++index)
+		{
+			discarded.push_back(m_sqes[index & m_sqMask].user_data);
+		}
+		m_sqeTail = head;
+		__atomic_store_n(m_sqTail, head, __ATOMIC_RELEASE);
+
+		for (uint64_t userData : discarded)
+		{
+			function(userData);
+		}
+		return static_cast<unsigned int>(discarded.size());
+	}
+
+	// Calls function for every available completion
+	template<typename functor>
+	unsigned int Reap(functor function)
+	{
+		uint32_t head = *m_cqHead;
+		uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		unsigned int count = 0;
+		for (; head != tail; ++head, ++count)
+		{
+			function(m_cqes[head & m_cqMask]);
+		}
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+private:
+	int m_fd = -1;
+	void* m_sqRing = MAP_FAILED;
+	void* m_cqRing = MAP_FAILED;
+	size_t m_sqRingSize = 0;
+	size_t m_cqRingSize = 0;
+	struct io_uring_sqe* m_sqes = nullptr;
+	uint32_t* m_sqHead = nullptr;
+	uint32_t* m_sqTail = nullptr;
+	uint32_t m_sqMask = 0;
+	uint32_t m_sqEntries = 0;
+	uint32_t m_sqeTail = 0;
+	uint32_t* m_cqHead = nullptr;
+	uint32_t* m_cqTail = nullptr;
+	uint32_t m_cqMask = 0;
+	struct io_uring_cqe* m_cqes = nullptr;
+};
+#endif // !defined(_WIN32)
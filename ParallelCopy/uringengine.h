@@ -0,0 +1,638 @@
+#pragma once
+
+// io_uring copy engine: a handful of threads, each driving one ring with hundreds of files in flight, for manifests
+// dominated by small files where the per-file syscalls cost more than the data
+#if !defined(_WIN32)
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "copybackend.h"
+#include "log.h"
+#include "metrics.h"
+#include "thread.h"
+#include "uring.h"
+
+class CUringCopyEngine
+{
+public:
+	// Called for any file the engine couldn't copy, so it can be retried through the normal copy path
+	typedef std::function<void(std::string&&, std::string&&, size_t)> Fallback;
+	// Called for every file the engine did copy, with its destination
+	typedef std::function<void(size_t, const std::string&)> Copied;
+
+	// Each file carries a caller supplied id (the manifest line) which is handed back to whichever callback gets it.
+	// With incremental, the destination is statx'd alongside the source and left alone if it's already up to date.
+	CUringCopyEngine(CCopyBackend& backend, size_t numRings, unsigned int filesPerRing, bool incremental, Fallback&& fallback, Copied&& copied)
+		: m_backend(backend)
+		, m_fallback{ std::move(fallback) }
+		, m_copied{ std::move(copied) }
+		, m_incremental{ incremental }
+	{
+		// Every ring and its buffers are set up before committing to this engine, so a failure (RLIMIT_MEMLOCK, or no
+		// io_uring at all) leaves it closed and the caller copies through the thread pool instead
+		for (size_t index = 0; index < numRings; ++index)
+		{
+			m_rings.emplace_back(new SRing(filesPerRing));
+			if (!m_rings.back()->IsOpen())
+			{
+				LOG_WARNING("io_uring is not available: [%s]", strerror(errno));
+				m_rings.clear();
+				return;
+			}
+		}
+
+		char nameBuffer[32] = "";
+		for (size_t index = 0; index < numRings; ++index)
+		{
+			snprintf(nameBuffer, sizeof(nameBuffer), "RingThread%zd", index);
+			std::string name(nameBuffer);
+			SRing* ring = m_rings[index].get();
+			m_threads.emplace_back(new CThread(name));
+			m_threads.back()->Start([this, ring]() { this->Main(*ring); });
+		}
+	}
+
+	~CUringCopyEngine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_terminate = true;
+		}
+		m_available.notify_all();
+		for (std::unique_ptr<CThread>& thread : m_threads)
+		{
+			thread->Join();
+		}
+	}
+
+	inline bool IsOpen() const
+	{
+		return !m_threads.empty();
+	}
+
+	inline size_t FilesCopied() const
+	{
+		return m_filesCopied;
+	}
+
+	inline size_t FilesFallenBack() const
+	{
+		return m_fallenBack;
+	}
+
+	// Same contract as CJobSystem::WaitForCapacity(), counting files queued for or in flight on the rings
+	template<typename Rep, typename Period>
+	bool WaitForCapacity(size_t maxOutstanding, const std::chrono::duration<Rep, Period>& timeout)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_progress.wait_for(lock, timeout, [&]() { return m_outstanding < maxOutstanding; });
+	}
+
+	template<typename Rep, typename Period>
+	bool WaitForIdle(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return WaitForCapacity(1, timeout);
+	}
+
+	void Add(std::string&& source, std::string&& destination, size_t id)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending.emplace_back(SPending{ std::move(source), std::move(destination), id });
+			++m_outstanding;
+		}
+		m_available.notify_one();
+	}
+
+private:
+	static const size_t BUFFER_SIZE = 64 * 1024;
+	static const uint8_t OP_STATX_DESTINATION = 0xFF; // our own tag, so its failure isn't taken as the file's
+
+	enum EState : char
+	{
+		eS_FREE,
+		eS_OPENING,		// openat(source) and statx(source) in flight
+		eS_CREATING,	// openat(destination) in flight
+		eS_COPYING,		// linked read -> write of the next BUFFER_SIZE in flight
+		eS_CLOSING,		// close(source) and close(destination) in flight
+	};
+
+	struct SPending
+	{
+		std::string m_source;
+		std::string m_destination;
+		size_t m_id;
+	};
+
+	struct SFile
+	{
+		std::string m_source;
+		std::string m_destination;
+		size_t m_id = 0;
+		struct statx m_info;
+		struct statx m_destinationInfo;
+		uint64_t m_offset = 0;
+		uint32_t m_length = 0;
+		uint32_t m_checksum = 0; // of the data copied so far, when the backend is verifying
+		CMetrics::Clock::time_point m_phase; // when the current phase (open, copy or close) started
+		int m_in = -1;
+		int m_out = -1;
+		int m_error = 0;
+		int m_pending = 0;
+		EState m_state = eS_FREE;
+		bool m_destinationExists = false;
+		bool m_skipped = false;
+		bool m_sparse = false; // handed back to the thread pool, whose copy keeps the holes
+	};
+
+	// Driven by one ring thread once it's set up
+	struct SRing
+	{
+		SRing(unsigned int files)
+			: m_ring{ files * 3 }
+			, m_files(files)
+			, m_bufferBytes(files * BUFFER_SIZE)
+		{
+			if (!m_ring.IsOpen())
+			{
+				return;
+			}
+
+			void* buffers = mmap(nullptr, m_bufferBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+			if (buffers == MAP_FAILED)
+			{
+				LOG_ERROR("Unable to allocate io_uring buffers: [%s]", strerror(errno));
+				return;
+			}
+			m_buffers = static_cast<char*>(buffers);
+
+			// Registered buffers save the kernel pinning and unpinning pages on every read and write
+			std::vector<struct iovec> iovecs(files);
+			for (unsigned int index = 0; index < files; ++index)
+			{
+				iovecs[index].iov_base = m_buffers + (index * BUFFER_SIZE);
+				iovecs[index].iov_len = BUFFER_SIZE;
+				m_free.push_back(files - 1 - index);
+			}
+			m_fixedBuffers = m_ring.RegisterBuffers(iovecs.data(), files);
+			if (!m_fixedBuffers)
+			{
+				LOG_DEBUG("Unable to register io_uring buffers: [%s]; using unregistered buffers", strerror(errno));
+			}
+		}
+
+		~SRing()
+		{
+			if (m_buffers != nullptr)
+			{
+				munmap(m_buffers, m_bufferBytes);
+			}
+		}
+
+		inline bool IsOpen() const
+		{
+			return m_ring.IsOpen() && (m_buffers != nullptr);
+		}
+
+		CUring m_ring;
+		std::vector<SFile> m_files;
+		std::vector<unsigned int> m_free;
+		size_t m_bufferBytes;
+		char* m_buffers = nullptr;
+		bool m_fixedBuffers = false;
+		unsigned int m_inFlight = 0;
+	};
+
+	void Main(SRing& ring)
+	{
+		while (true)
+		{
+			if (!Refill(ring))
+			{
+				break;
+			}
+
+			// A full completion queue (-EBUSY) or a lack of kernel resources (-EAGAIN) clears as completions are reaped;
+			// anything else and the entries the kernel didn't take are failed back to their files
+			int submitted = ring.m_ring.Submit((ring.m_inFlight > 0) ? 1 : 0);
+			bool retry = (submitted == -EBUSY) || (submitted == -EAGAIN);
+			if ((submitted < 0) && !retry)
+			{
+				LOG_ERROR("io_uring_enter() failed: [%s]; handing its files back", strerror(-submitted));
+				ring.m_ring.Discard([&](uint64_t userData) {
+					struct io_uring_cqe cqe;
+					memset(&cqe, 0, sizeof(cqe));
+					cqe.user_data = userData;
+					cqe.res = submitted;
+					Complete(ring, cqe);
+				});
+			}
+
+			if ((ring.m_ring.Reap([&](const struct io_uring_cqe& cqe) { Complete(ring, cqe); }) == 0) && retry)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// Makes sure count submission entries can be prepared, submitting what's already queued to make room if need be
+	static bool Reserve(SRing& ring, unsigned int count)
+	{
+		if (ring.m_ring.Available() < count)
+		{
+			ring.m_ring.Submit(0);
+		}
+		return ring.m_ring.Available() >= count;
+	}
+
+	// Starts new files in any free slots; only blocks when the ring has nothing in flight.  Returns false on shutdown.
+	bool Refill(SRing& ring)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (ring.m_inFlight == 0)
+		{
+			m_available.wait(lock, [&]() { return m_terminate || !m_pending.empty(); });
+			if (m_pending.empty())
+			{
+				return false;
+			}
+		}
+
+		while (!ring.m_free.empty() && !m_pending.empty())
+		{
+			unsigned int slot = ring.m_free.back();
+			ring.m_free.pop_back();
+			SFile& file = ring.m_files[slot];
+			file.m_source = std::move(m_pending.front().m_source);
+			file.m_destination = std::move(m_pending.front().m_destination);
+			file.m_id = m_pending.front().m_id;
+			m_pending.pop_front();
+
+			lock.unlock();
+			Start(ring, slot);
+			lock.lock();
+		}
+
+		return true;
+	}
+
+	void Start(SRing& ring, unsigned int slot)
+	{
+		SFile& file = ring.m_files[slot];
+		file.m_offset = 0;
+		file.m_checksum = 0;
+		file.m_phase = CMetrics::Clock::now();
+		file.m_in = -1;
+		file.m_out = -1;
+		file.m_error = 0;
+		file.m_destinationExists = false;
+		file.m_skipped = false;
+		file.m_sparse = false;
+		++ring.m_inFlight;
+
+		if (!m_backend.CreateParentDirectory(file.m_destination))
+		{
+			file.m_error = ENOENT;
+			Finish(ring, slot);
+			return;
+		}
+
+		if (!Reserve(ring, m_incremental ? 3 : 2))
+		{
+			file.m_error = EBUSY;
+			Finish(ring, slot);
+			return;
+		}
+
+		struct io_uring_sqe* sqe = ring.m_ring.GetSqe();
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = reinterpret_cast<uint64_t>(file.m_source.c_str());
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->user_data = UserData(slot, IORING_OP_OPENAT);
+
+		sqe = ring.m_ring.GetSqe();
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = reinterpret_cast<uint64_t>(file.m_source.c_str());
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = reinterpret_cast<uint64_t>(&file.m_info);
+		sqe->user_data = UserData(slot, IORING_OP_STATX);
+		file.m_pending = 2;
+
+		if (m_incremental)
+		{
+			sqe = ring.m_ring.GetSqe();
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uint64_t>(file.m_destination.c_str());
+			sqe->len = STATX_SIZE | STATX_MTIME;
+			sqe->off = reinterpret_cast<uint64_t>(&file.m_destinationInfo);
+			sqe->user_data = UserData(slot, OP_STATX_DESTINATION);
+			++file.m_pending;
+		}
+
+		file.m_state = eS_OPENING;
+	}
+
+	void Complete(SRing& ring, const struct io_uring_cqe& cqe)
+	{
+		unsigned int slot = static_cast<unsigned int>(cqe.user_data >> 8);
+		uint8_t op = static_cast<uint8_t>(cqe.user_data & 0xFF);
+		SFile& file = ring.m_files[slot];
+		--file.m_pending;
+
+		if (op == OP_STATX_DESTINATION)
+		{
+			file.m_destinationExists = (cqe.res >= 0);
+		}
+		else if (cqe.res < 0)
+		{
+			if (file.m_error == 0)
+			{
+				file.m_error = -cqe.res;
+			}
+		}
+		else
+		{
+			switch (op)
+			{
+			case IORING_OP_OPENAT:
+				((file.m_state == eS_OPENING) ? file.m_in : file.m_out) = cqe.res;
+				break;
+			case IORING_OP_READ_FIXED:
+			case IORING_OP_READ:
+			case IORING_OP_WRITE_FIXED:
+			case IORING_OP_WRITE:
+				if ((static_cast<uint32_t>(cqe.res) != file.m_length) && (file.m_error == 0))
+				{
+					file.m_error = EIO; // the source changed size underneath us
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (file.m_pending > 0)
+		{
+			return;
+		}
+
+		if ((file.m_error != 0) && (file.m_state != eS_CLOSING))
+		{
+			Finish(ring, slot);
+			return;
+		}
+
+		switch (file.m_state)
+		{
+		case eS_OPENING:
+			if (file.m_destinationExists && CLinuxCopyBackend::Same(file.m_info, file.m_destinationInfo))
+			{
+				close(file.m_in);
+				file.m_in = -1;
+				file.m_skipped = true;
+				Finish(ring, slot);
+			}
+			else if ((file.m_info.stx_blocks * 512) < file.m_info.stx_size)
+			{
+				close(file.m_in);
+				file.m_in = -1;
+				file.m_sparse = true;
+				Finish(ring, slot);
+			}
+			else if (!Reserve(ring, 1))
+			{
+				file.m_error = EBUSY;
+				Finish(ring, slot);
+			}
+			else
+			{
+				struct io_uring_sqe* sqe = ring.m_ring.GetSqe();
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = reinterpret_cast<uint64_t>(file.m_destination.c_str());
+				sqe->len = file.m_info.stx_mode & 07777;
+				sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+				sqe->user_data = UserData(slot, IORING_OP_OPENAT);
+				file.m_pending = 1;
+				file.m_state = eS_CREATING;
+			}
+			break;
+		case eS_CREATING:
+		case eS_COPYING:
+			if (file.m_state == eS_COPYING)
+			{
+				if (m_backend.Verifying() != CCopyBackend::eV_NONE)
+				{
+					file.m_checksum = CCrc32c::Update(file.m_checksum, ring.m_buffers + (slot * BUFFER_SIZE), file.m_length);
+				}
+				file.m_offset += file.m_length;
+			}
+			else
+			{
+				PhaseEnded(file, CMetrics::eP_OPEN);
+			}
+			if (file.m_offset >= file.m_info.stx_size)
+			{
+				Close(ring, slot);
+			}
+			else if (!Reserve(ring, 2))
+			{
+				file.m_error = EBUSY;
+				Finish(ring, slot);
+			}
+			else
+			{
+				QueueCopy(ring, slot);
+			}
+			break;
+		case eS_CLOSING:
+			Finish(ring, slot);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Read then write the next buffer's worth; the link means the write is only issued once the read has completed
+	void QueueCopy(SRing& ring, unsigned int slot)
+	{
+		SFile& file = ring.m_files[slot];
+		char* buffer = ring.m_buffers + (slot * BUFFER_SIZE);
+		file.m_length = static_cast<uint32_t>(std::min(static_cast<uint64_t>(BUFFER_SIZE), static_cast<uint64_t>(file.m_info.stx_size - file.m_offset)));
+
+		struct io_uring_sqe* sqe = ring.m_ring.GetSqe();
+		sqe->opcode = ring.m_fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = file.m_in;
+		sqe->addr = reinterpret_cast<uint64_t>(buffer);
+		sqe->len = file.m_length;
+		sqe->off = file.m_offset;
+		sqe->buf_index = static_cast<uint16_t>(slot);
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = UserData(slot, sqe->opcode);
+
+		sqe = ring.m_ring.GetSqe();
+		sqe->opcode = ring.m_fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = file.m_out;
+		sqe->addr = reinterpret_cast<uint64_t>(buffer);
+		sqe->len = file.m_length;
+		sqe->off = file.m_offset;
+		sqe->buf_index = static_cast<uint16_t>(slot);
+		sqe->user_data = UserData(slot, sqe->opcode);
+
+		file.m_pending = 2;
+		file.m_state = eS_COPYING;
+	}
+
+	void Close(SRing& ring, unsigned int slot)
+	{
+		SFile& file = ring.m_files[slot];
+		PhaseEnded(file, CMetrics::eP_COPY);
+
+		// There's no io_uring op for setting attributes; match CopyFileEx() with synchronous calls while we have the fd (the
+		// mode given to openat() is masked by the umask, so it's set again here)
+		struct timespec times[2] = {
+			{ file.m_info.stx_atime.tv_sec, file.m_info.stx_atime.tv_nsec },
+			{ file.m_info.stx_mtime.tv_sec, file.m_info.stx_mtime.tv_nsec },
+		};
+		fchmod(file.m_out, file.m_info.stx_mode & 07777);
+		futimens(file.m_out, times);
+
+		// The data's all written, so closing synchronously is no worse than failing the file for want of entries
+		file.m_state = eS_CLOSING;
+		if (!Reserve(ring, 2))
+		{
+			Finish(ring, slot);
+			return;
+		}
+
+		struct io_uring_sqe* sqe = ring.m_ring.GetSqe();
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = file.m_in;
+		sqe->user_data = UserData(slot, IORING_OP_CLOSE);
+
+		sqe = ring.m_ring.GetSqe();
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = file.m_out;
+		sqe->user_data = UserData(slot, IORING_OP_CLOSE);
+
+		file.m_in = file.m_out = -1;
+		file.m_pending = 2;
+	}
+
+	// Releases the slot; anything that failed is handed to the fallback rather than retried on the ring
+	void Finish(SRing& ring, unsigned int slot)
+	{
+		SFile& file = ring.m_files[slot];
+		if (file.m_in >= 0)
+		{
+			close(file.m_in);
+		}
+		if (file.m_out >= 0)
+		{
+			close(file.m_out);
+		}
+
+		// Reading the file back stalls the ring, but the files it gets are small
+		if ((file.m_error == 0) && !file.m_skipped && !file.m_sparse && (m_backend.Verifying() != CCopyBackend::eV_NONE))
+		{
+			m_backend.Verify(file.m_destination, file.m_info.stx_size, file.m_checksum, file.m_error);
+		}
+
+		if ((file.m_error == 0) && !file.m_sparse)
+		{
+			if (file.m_state == eS_CLOSING)
+			{
+				PhaseEnded(file, CMetrics::eP_CLOSE);
+			}
+
+			if (file.m_skipped)
+			{
+				m_backend.RecordSkipped(file.m_info.stx_size);
+			}
+			else
+			{
+				++m_filesCopied;
+				m_backend.RecordCopied(CCopyBackend::eCM_IO_URING, file.m_info.stx_size);
+			}
+			m_copied(file.m_id, file.m_destination);
+		}
+		else
+		{
+			if (file.m_sparse)
+			{
+				LOG_DEBUG("[%s] is sparse; handing it to the thread pool to copy just its data", file.m_source.c_str());
+			}
+			else
+			{
+				LOG_DEBUG("io_uring copy of [%s] to [%s] failed: [%s]; falling back", file.m_source.c_str(), file.m_destination.c_str(), strerror(file.m_error));
+				g_metrics.Error();
+			}
+			++m_fallenBack;
+			m_fallback(std::move(file.m_source), std::move(file.m_destination), file.m_id);
+		}
+
+		file.m_state = eS_FREE;
+		ring.m_free.push_back(slot);
+		--ring.m_inFlight;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_outstanding;
+		}
+		m_progress.notify_all();
+	}
+
+	static inline void PhaseEnded(SFile& file, CMetrics::EPhase phase)
+	{
+		CMetrics::Clock::time_point now = CMetrics::Clock::now();
+		g_metrics.Latency(phase, file.m_info.stx_size, now - file.m_phase);
+		file.m_phase = now;
+	}
+
+	static inline uint64_t UserData(unsigned int slot, uint8_t op)
+	{
+		return (static_cast<uint64_t>(slot) << 8) | op;
+	}
+
+	CCopyBackend& m_backend;
+	Fallback m_fallback;
+	Copied m_copied;
+	const bool m_incremental;
+	std::vector<std::unique_ptr<SRing>> m_rings;
+	std::vector<std::unique_ptr<CThread>> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_available;
+	std::condition_variable m_progress;
+	std::deque<SPending> m_pending;
+	size_t m_outstanding = 0;
+	bool m_terminate = false;
+
+	std::atomic_size_t m_filesCopied{ 0 };
+	std::atomic_size_t m_fallenBack{ 0 };
+};
+#endif // !defined(_WIN32)
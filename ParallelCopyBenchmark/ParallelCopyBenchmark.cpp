@@ -0,0 +1,1008 @@
+// ParallelCopyBenchmark.cpp : Benchmarks for the job system, the checksum kernels and end to end copies with
+// ParallelCopy, writing results as CSV and/or JSON so runs on different commits can be diffed.
+//
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+CLog g_log(CLog::eS_INFORMATION, "benchmark.log");
+
+#include "checksum.h"
+#include "commandlineoptions.h"
+#include "jobsystem.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+typedef std::chrono::steady_clock Clock;
+
+// Counting allocator: every heap allocation in the process goes through here, so a benchmark can check how many its
+// code path makes
+std::atomic<uint64_t> g_allocations{ 0 };
+
+// Kept out of line, so GCC can't see operator new's malloc() from the delete that frees it and call them mismatched
+#if defined(_MSC_VER)
+#define ALLOCATOR_NOINLINE __declspec(noinline)
+#else
+#define ALLOCATOR_NOINLINE __attribute__((noinline))
+#endif // defined(_MSC_VER)
+
+ALLOCATOR_NOINLINE void* operator new(size_t size)
+{
+	++g_allocations;
+	void* memory = malloc((size > 0) ? size : 1);
+	if (memory == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+// Every form of delete goes through the one that frees, so each matches the new that allocated it
+ALLOCATOR_NOINLINE void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	operator delete(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	operator delete(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	operator delete(memory);
+}
+
+class CResults
+{
+public:
+	void Add(const char* suite, const char* benchmark, const std::string& parameters, double value, const char* unit)
+	{
+		m_results.emplace_back(SResult{ suite, benchmark, parameters, value, unit });
+		LOG_INFORMATION("[%s] %s (%s): %.3f %s", suite, benchmark, parameters.c_str(), value, unit);
+	}
+
+	bool WriteCsv(const char* path, const char* label) const
+	{
+		FILE* file = fopen(path, "wb");
+		if (file == nullptr)
+		{
+			LOG_ERROR("Unable to write [%s]", path);
+			return false;
+		}
+
+		fprintf(file, "label,suite,benchmark,parameters,value,unit\n");
+		for (const SResult& result : m_results)
+		{
+			fprintf(file, "%s,%s,%s,\"%s\",%.6f,%s\n", label, result.m_suite.c_str(), result.m_benchmark.c_str(), result.m_parameters.c_str(), result.m_value, result.m_unit.c_str());
+		}
+		return fclose(file) == 0;
+	}
+
+	bool WriteJson(const char* path, const char* label) const
+	{
+		FILE* file = fopen(path, "wb");
+		if (file == nullptr)
+		{
+			LOG_ERROR("Unable to write [%s]", path);
+			return false;
+		}
+
+		fprintf(file, "{\n  \"label\": \"%s\",\n  \"results\": [\n", label);
+		for (size_t index = 0; index < m_results.size(); ++index)
+		{
+			const SResult& result = m_results[index];
+			fprintf(file, "    {\"suite\": \"%s\", \"benchmark\": \"%s\", \"parameters\": \"%s\", \"value\": %.6f, \"unit\": \"%s\"}%s\n", result.m_suite.c_str(), result.m_benchmark.c_str(), result.m_parameters.c_str(), result.m_value, result.m_unit.c_str(), (index + 1 < m_results.size()) ? "," : "");
+		}
+		fprintf(file, "  ]\n}\n");
+		return fclose(file) == 0;
+	}
+
+private:
+	struct SResult
+	{
+		std::string m_suite;
+		std::string m_benchmark;
+		std::string m_parameters;
+		double m_value;
+		std::string m_unit;
+	};
+
+	std::vector<SResult> m_results;
+};
+
+CResults g_results;
+
+template<typename... Args>
+std::string Format(const char* format, Args... args)
+{
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), format, args...);
+	return std::string(buffer);
+}
+
+double Seconds(Clock::duration elapsed)
+{
+	return std::chrono::duration<double>(elapsed).count();
+}
+
+// CPU time the whole process has used so far, across all its threads
+double ProcessSeconds()
+{
+#if defined(_WIN32)
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		return 0.0;
+	}
+	auto seconds = [](const FILETIME& time) { return static_cast<double>((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+	return seconds(kernel) + seconds(user);
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0.0;
+	}
+	return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + (static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+#endif // defined(_WIN32)
+}
+
+double Median(std::vector<double> values)
+{
+	if (values.empty())
+	{
+		return 0.0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Job system: the cost of getting an empty job from AddJob() to a worker and back to idle
+//////////////////////////////////////////////////////////////////////////
+
+// Empty jobs pushed from the main thread, i.e. through the injection queue
+void BenchmarkPush(size_t threads, size_t jobs)
+{
+	CJobSystem jobSystem(threads);
+	std::atomic_size_t executed{ 0 };
+	Clock::time_point start = Clock::now();
+	for (size_t job = 0; job < jobs; ++job)
+	{
+		jobSystem.AddJob([&executed]() { ++executed; });
+	}
+	double pushed = Seconds(Clock::now() - start);
+	jobSystem.WaitForIdle();
+	double elapsed = Seconds(Clock::now() - start);
+
+	std::string parameters = Format("threads=%d", static_cast<int>(threads));
+	g_results.Add("jobs", "push", parameters, (pushed * 1e9) / jobs, "ns/job");
+	g_results.Add("jobs", "push+run", parameters, (elapsed * 1e9) / jobs, "ns/job");
+}
+
+// Jobs spawned by jobs, which go through the workers' own deques and get stolen to spread them out
+void BenchmarkSpawn(size_t threads, size_t jobs)
+{
+	CJobSystem jobSystem(threads);
+	std::atomic_size_t executed{ 0 };
+	size_t perRoot = std::max<size_t>(jobs / threads, 1);
+	Clock::time_point start = Clock::now();
+	for (size_t root = 0; root < threads; ++root)
+	{
+		jobSystem.AddJob([&jobSystem, &executed, perRoot]() {
+			for (size_t job = 0; job < perRoot; ++job)
+			{
+				jobSystem.AddJob([&executed]() { ++executed; });
+			}
+		});
+	}
+	jobSystem.WaitForIdle();
+	double elapsed = Seconds(Clock::now() - start);
+
+	g_results.Add("jobs", "spawn+run", Format("threads=%d", static_cast<int>(threads)), (elapsed * 1e9) / (perRoot * threads), "ns/job");
+}
+
+// One job at a time, so the time is dominated by waking a worker and waking the waiter again
+void BenchmarkRoundTrip(size_t threads, size_t trips)
+{
+	CJobSystem jobSystem(threads);
+	std::vector<double> latencies;
+	latencies.reserve(trips);
+	for (size_t trip = 0; trip < trips; ++trip)
+	{
+		Clock::time_point start = Clock::now();
+		jobSystem.AddJob([]() {});
+		jobSystem.WaitForIdle();
+		latencies.push_back(Seconds(Clock::now() - start) * 1e6);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	std::string parameters = Format("threads=%d", static_cast<int>(threads));
+	g_results.Add("jobs", "round trip p50", parameters, latencies[latencies.size() / 2], "us");
+	g_results.Add("jobs", "round trip p99", parameters, latencies[(latencies.size() * 99) / 100], "us");
+}
+
+// What idle workers cost and how quickly they wake: the CPU used while the job system sits empty, then the delay from
+// AddJob() to the job starting for jobs trickling in one at a time, far enough apart that the workers are asleep again
+// by the time each arrives (the case where a job system that polls looks good)
+void BenchmarkIdle(size_t threads, size_t jobs)
+{
+	CJobSystem jobSystem(threads);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // for the workers to start and go to sleep
+	double cpu = ProcessSeconds();
+	Clock::time_point start = Clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	double idle = (ProcessSeconds() - cpu) / Seconds(Clock::now() - start);
+
+	std::vector<double> latencies(jobs, 0.0);
+	for (size_t job = 0; job < jobs; ++job)
+	{
+		double* latency = &latencies[job];
+		Clock::time_point queued = Clock::now();
+		jobSystem.AddJob([latency, queued]() { *latency = Seconds(Clock::now() - queued) * 1e6; });
+		std::this_thread::sleep_for(std::chrono::microseconds(500));
+	}
+	jobSystem.WaitForIdle();
+
+	double total = 0.0;
+	for (double latency : latencies)
+	{
+		total += latency;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	std::string parameters = Format("threads=%d", static_cast<int>(threads));
+	g_results.Add("jobs", "idle cpu", parameters, idle * 100.0, "% of a core");
+	g_results.Add("jobs", "enqueue to start mean", parameters, total / jobs, "us");
+	g_results.Add("jobs", "enqueue to start p50", parameters, latencies[latencies.size() / 2], "us");
+	g_results.Add("jobs", "enqueue to start p99", parameters, latencies[(latencies.size() * 99) / 100], "us");
+}
+
+// Three stage pipelines: two jobs, each a continuation of the one before, then a callback on the main thread (serviced
+// by WaitForIdle()), per item
+void BenchmarkPipeline(size_t threads, size_t items)
+{
+	CJobSystem jobSystem(threads);
+	std::atomic_size_t executed{ 0 };
+	size_t completed = 0;
+	Clock::time_point start = Clock::now();
+	for (size_t item = 0; item < items; ++item)
+	{
+		CJobSystem::CJobHandle first = jobSystem.CreateJob([&executed]() { ++executed; });
+		CJobSystem::CJobHandle second = jobSystem.Then(first, [&executed]() { ++executed; });
+		jobSystem.ThenOnMainThread(second, [&completed]() { ++completed; });
+		jobSystem.Submit(first);
+	}
+	jobSystem.WaitForIdle();
+	double elapsed = Seconds(Clock::now() - start);
+
+	if ((completed != items) || (executed.load() != 2 * items))
+	{
+		LOG_ERROR("Pipeline benchmark completed [%d] of [%d] items", completed, items);
+	}
+	g_results.Add("jobs", "pipeline", Format("threads=%d", static_cast<int>(threads)), (elapsed * 1e9) / items, "ns/item");
+}
+
+// Heap allocations per job once the job system has warmed up, for jobs the size of a copy job (views of a manifest
+// entry) going through the injection queue, the workers' deques and the device queues.  Which worker's deque sees the
+// most jobs varies from round to round, and each grows the first time it does, so rounds are repeated until one
+// allocates nothing; anything allocating per job never gets there, and fails the run (returns false).
+bool BenchmarkAllocations(size_t threads, size_t jobs)
+{
+	static const int MAX_ROUNDS = 10;
+
+	struct SPayload
+	{
+		const char* m_source;
+		size_t m_sourceLength;
+		const char* m_destination;
+		size_t m_destinationLength;
+		size_t m_line;
+	};
+
+	CJobSystem jobSystem(threads);
+	jobSystem.SetDeviceLimit(2);
+	std::atomic_size_t executed{ 0 };
+	SPayload payload = { "source", 6, "destination", 11, 1 };
+	auto round = [&]() {
+		for (size_t job = 0; job < jobs; ++job)
+		{
+			jobSystem.AddJob([&executed, payload]() { executed += payload.m_line; });
+		}
+		jobSystem.WaitForIdle();
+		for (size_t root = 0; root < threads; ++root)
+		{
+			jobSystem.AddJob([&jobSystem, &executed, payload, jobs, threads]() {
+				for (size_t job = 0; job < jobs / threads; ++job)
+				{
+					jobSystem.AddJob([&executed, payload]() { executed += payload.m_line; });
+				}
+			});
+		}
+		jobSystem.WaitForIdle();
+		for (size_t job = 0; job < jobs; ++job)
+		{
+			jobSystem.AddDeviceJob([&executed, payload]() { executed += payload.m_line; }, job % 3, 3);
+		}
+		jobSystem.WaitForIdle();
+	};
+
+	round(); // warm up: the slabs and the device queues are allocated as they're first needed
+	uint64_t allocations = 0;
+	int rounds = 0;
+	do
+	{
+		uint64_t before = g_allocations.load();
+		round();
+		allocations = g_allocations.load() - before;
+	} while ((allocations != 0) && (++rounds < MAX_ROUNDS));
+
+	std::string parameters = Format("threads=%d", static_cast<int>(threads));
+	g_results.Add("jobs", "allocations", parameters, static_cast<double>(allocations) / (3 * jobs), "allocations/job");
+	g_results.Add("jobs", "allocation warm up", parameters, static_cast<double>(rounds + 1), "rounds");
+	if (allocations != 0)
+	{
+		LOG_ERROR("[%llu] heap allocations for [%d] jobs with [%d] threads after [%d] rounds; there should be none once warmed up", static_cast<unsigned long long>(allocations), 3 * jobs, threads, MAX_ROUNDS + 1);
+		return false;
+	}
+	return true;
+}
+
+// Returns false if any of the checks made along the way failed
+bool BenchmarkJobSystem(const std::vector<size_t>& threadCounts, size_t jobs)
+{
+	bool ok = true;
+	for (size_t threads : threadCounts)
+	{
+		BenchmarkPush(threads, jobs);
+		BenchmarkSpawn(threads, jobs);
+		BenchmarkRoundTrip(threads, std::max<size_t>(jobs / 100, 100));
+		BenchmarkIdle(threads, std::min<size_t>(jobs, 2000));
+		BenchmarkPipeline(threads, std::min<size_t>(jobs, 100000));
+		ok = BenchmarkAllocations(threads, std::min<size_t>(jobs, 100000)) && ok;
+	}
+	return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Checksum kernels
+//////////////////////////////////////////////////////////////////////////
+
+// False if combining checksums or skipping zeros doesn't give what running over the data does
+bool BenchmarkChecksum()
+{
+	bool ok = CCrc32c::SelfTest();
+	LOG_INFORMATION("crc32c combining and skipping zeros: %s", ok ? "ok" : "FAILED");
+
+	static const size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+	static const uint64_t BYTES = 1024ULL * 1024 * 1024;
+	std::vector<unsigned char> buffer(sizes[2]);
+	for (size_t index = 0; index < buffer.size(); ++index)
+	{
+		buffer[index] = static_cast<unsigned char>(index * 2654435761u >> 13);
+	}
+
+	struct SKernel
+	{
+		const char* m_name;
+		CCrc32c::Function m_function;
+	} kernels[] = { { "crc32c scalar", CCrc32c::UpdateScalar }, { "crc32c hardware", CCrc32c::UpdateHardware } };
+	for (const SKernel& kernel : kernels)
+	{
+		for (size_t size : sizes)
+		{
+			volatile uint32_t crc = 0;
+			Clock::time_point start = Clock::now();
+			for (uint64_t done = 0; done < BYTES; done += size)
+			{
+				crc = kernel.m_function(crc, buffer.data(), size);
+			}
+			g_results.Add("checksum", kernel.m_name, Format("buffer=%dK", static_cast<int>(size / 1024)), (BYTES / Seconds(Clock::now() - start)) / 1e9, "GB/s");
+		}
+	}
+	return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Synthetic trees and end to end copies
+//////////////////////////////////////////////////////////////////////////
+
+enum ETree : char
+{
+	eT_TINY,	// lots of files of a few KB, spread over a hundred directories
+	eT_HUGE,	// a handful of very large files
+	eT_DEEP,	// small files down long chains of directories
+	eT_MIXED,	// mostly small, some medium and a few large, roughly like a source tree with assets
+	eT_SPARSE,	// a few files that are mostly holes of 512MB and more, like VM images; copied with --verify
+	eT_COUNT,
+};
+
+const char* TreeToString(ETree tree)
+{
+	static const char* names[eT_COUNT] = { "tiny", "huge", "deep", "mixed", "sparse" };
+	return (tree < eT_COUNT) ? names[tree] : "???";
+}
+
+// Arguments a tree is always copied with, on top of --arguments
+const char* TreeArguments(ETree tree)
+{
+	// Checksumming a hole combines the crc32c of that many zeros rather than reading them, which has to agree with what
+	// --verify reads back
+	return (tree == eT_SPARSE) ? "-v" : "";
+}
+
+// Deterministic, so the same scale always generates the same tree
+class CRandom
+{
+public:
+	CRandom(uint64_t seed) : m_state{ seed | 1 } {}
+
+	inline uint64_t Next()
+	{
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 7;
+		m_state ^= m_state << 17;
+		return m_state;
+	}
+
+	inline uint64_t Range(uint64_t low, uint64_t high)
+	{
+		return low + (Next() % (high - low + 1));
+	}
+
+private:
+	uint64_t m_state;
+};
+
+bool MakeDirectory(const std::string& path)
+{
+#if defined(_WIN32)
+	return CreateDirectoryA(path.c_str(), nullptr) || (GetLastError() == ERROR_ALREADY_EXISTS);
+#else
+	return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+#endif // defined(_WIN32)
+}
+
+bool Exists(const std::string& path)
+{
+#if defined(_WIN32)
+	return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+	struct stat info;
+	return stat(path.c_str(), &info) == 0;
+#endif // defined(_WIN32)
+}
+
+#if !defined(_WIN32)
+int RemoveEntry(const char* path, const struct stat* info, int type, struct FTW* ftw)
+{
+	return remove(path);
+}
+#endif // !defined(_WIN32)
+
+void RemoveTree(const std::string& path)
+{
+	if (!Exists(path))
+	{
+		return;
+	}
+#if defined(_WIN32)
+	std::string from = path + '\0'; // double null terminated
+	SHFILEOPSTRUCTA operation = {};
+	operation.wFunc = FO_DELETE;
+	operation.pFrom = from.c_str();
+	operation.fFlags = FOF_NO_UI;
+	SHFileOperationA(&operation);
+#else
+	nftw(path.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+#endif // defined(_WIN32)
+}
+
+bool WriteData(FILE* file, uint64_t size, CRandom& random, std::vector<uint64_t>& buffer)
+{
+	bool ok = true;
+	while (ok && (size > 0))
+	{
+		size_t length = static_cast<size_t>(std::min<uint64_t>(size, buffer.size() * sizeof(uint64_t)));
+		for (size_t word = 0; word < (length + sizeof(uint64_t) - 1) / sizeof(uint64_t); ++word)
+		{
+			buffer[word] = random.Next();
+		}
+		ok = (fwrite(buffer.data(), 1, length, file) == length);
+		size -= length;
+	}
+	return ok;
+}
+
+bool WriteFile(const std::string& path, uint64_t size, CRandom& random, std::vector<uint64_t>& buffer)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		LOG_ERROR("Unable to create [%s]", path.c_str());
+		return false;
+	}
+
+	bool ok = WriteData(file, size, random, buffer);
+	return (fclose(file) == 0) && ok;
+}
+
+// head bytes of data, a hole of hole bytes seeked over rather than written, then tail bytes of data.  On Windows the
+// file isn't marked sparse, so the hole is allocated as zeros, but it still checks the copy.
+bool WriteSparseFile(const std::string& path, uint64_t head, uint64_t hole, uint64_t tail, CRandom& random, std::vector<uint64_t>& buffer)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		LOG_ERROR("Unable to create [%s]", path.c_str());
+		return false;
+	}
+
+	bool ok = WriteData(file, head, random, buffer);
+#if defined(_WIN32)
+	ok = ok && (_fseeki64(file, static_cast<__int64>(hole), SEEK_CUR) == 0);
+#else
+	ok = ok && (fseeko(file, static_cast<off_t>(hole), SEEK_CUR) == 0);
+#endif // defined(_WIN32)
+	ok = ok && WriteData(file, tail, random, buffer);
+	return (fclose(file) == 0) && ok;
+}
+
+struct STreeStats
+{
+	size_t m_files = 0;
+	size_t m_directories = 0;
+	uint64_t m_bytes = 0;
+};
+
+// Writes the tree under '<root>/src/<tree>' with the manifest '<root>/<tree>.txt' copying it to '<root>/dst/<tree>'
+bool GenerateTree(const std::string& root, ETree tree, double scale, STreeStats& stats)
+{
+	const char* name = TreeToString(tree);
+	std::string source = root + "/src/" + name;
+	std::string destination = root + "/dst/" + name;
+	std::string manifestName = root + "/" + name + ".txt";
+	if (!MakeDirectory(root) || !MakeDirectory(root + "/src") || !MakeDirectory(source))
+	{
+		LOG_ERROR("Unable to create [%s]", source.c_str());
+		return false;
+	}
+
+	FILE* manifest = fopen(manifestName.c_str(), "wb");
+	if (manifest == nullptr)
+	{
+		LOG_ERROR("Unable to create [%s]", manifestName.c_str());
+		return false;
+	}
+
+	CRandom random(0x9E3779B97F4A7C15ULL + tree);
+	std::vector<uint64_t> buffer(128 * 1024);
+	auto addFile = [&](const std::string& relative, uint64_t size) -> bool {
+		if (!WriteFile(source + relative, size, random, buffer))
+		{
+			return false;
+		}
+		fprintf(manifest, "%s%s|%s%s\n", source.c_str(), relative.c_str(), destination.c_str(), relative.c_str());
+		++stats.m_files;
+		stats.m_bytes += size;
+		return true;
+	};
+	auto addSparseFile = [&](const std::string& relative, uint64_t head, uint64_t hole, uint64_t tail) -> bool {
+		if (!WriteSparseFile(source + relative, head, hole, tail, random, buffer))
+		{
+			return false;
+		}
+		fprintf(manifest, "%s%s|%s%s\n", source.c_str(), relative.c_str(), destination.c_str(), relative.c_str());
+		++stats.m_files;
+		stats.m_bytes += head + hole + tail;
+		return true;
+	};
+	auto addDirectory = [&](const std::string& relative) -> bool {
+		++stats.m_directories;
+		return MakeDirectory(source + relative);
+	};
+
+	bool ok = true;
+	switch (tree)
+	{
+	case eT_TINY:
+	{
+		size_t files = std::max<size_t>(static_cast<size_t>(20000 * scale), 1);
+		for (size_t file = 0; ok && (file < files); ++file)
+		{
+			std::string directory = Format("/d%03d", static_cast<int>(file % 100));
+			ok = ((file >= 100) || addDirectory(directory)) && addFile(Format("%s/f%06d", directory.c_str(), static_cast<int>(file)), random.Range(0, 4096));
+		}
+		break;
+	}
+	case eT_HUGE:
+	{
+		uint64_t size = std::max<uint64_t>(static_cast<uint64_t>(256.0 * 1024 * 1024 * scale), 1024 * 1024);
+		for (int file = 0; ok && (file < 4); ++file)
+		{
+			ok = addFile(Format("/huge%d", file), size);
+		}
+		break;
+	}
+	case eT_DEEP:
+	{
+		// 8 chains 32 directories deep, with 8 files at each level
+		int levels = std::max(static_cast<int>(32 * std::min(scale, 1.0)), 2);
+		for (int chain = 0; ok && (chain < 8); ++chain)
+		{
+			std::string directory;
+			for (int level = 0; ok && (level < levels); ++level)
+			{
+				directory += Format("/c%dl%02d", chain, level);
+				ok = addDirectory(directory);
+				for (int file = 0; ok && (file < 8); ++file)
+				{
+					ok = addFile(Format("%s/f%d", directory.c_str(), file), random.Range(1024, 16 * 1024));
+				}
+			}
+		}
+		break;
+	}
+	case eT_MIXED:
+	{
+		// 90% up to 16KB, 9% up to 1MB, 1% up to 64MB
+		size_t files = std::max<size_t>(static_cast<size_t>(2000 * scale), 1);
+		for (size_t file = 0; ok && (file < files); ++file)
+		{
+			std::string directory = Format("/d%02d", static_cast<int>(file % 20));
+			uint64_t band = random.Range(0, 99);
+			uint64_t size = (band < 90) ? random.Range(0, 16 * 1024) : (band < 99) ? random.Range(16 * 1024, 1024 * 1024) : random.Range(1024 * 1024, 64 * 1024 * 1024);
+			ok = ((file >= 20) || addDirectory(directory)) && addFile(Format("%s/f%05d", directory.c_str(), static_cast<int>(file)), size);
+		}
+		break;
+	}
+	case eT_SPARSE:
+	{
+		// The holes don't scale: whatever the scale, they have to reach 512MB (2^32 bits), where combining checksums gets
+		// harder; they cost nothing to write or copy
+		uint64_t data = std::max<uint64_t>(static_cast<uint64_t>(4.0 * 1024 * 1024 * scale), 4096);
+		static const uint64_t holes[] = { 512ULL * 1024 * 1024, 768ULL * 1024 * 1024, 1536ULL * 1024 * 1024 };
+		for (int file = 0; ok && (file < 3); ++file)
+		{
+			ok = addSparseFile(Format("/sparse%d", file), data, holes[file], data);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	ok = (fclose(manifest) == 0) && ok;
+	if (!ok)
+	{
+		remove(manifestName.c_str()); // so the next run regenerates it
+	}
+	return ok;
+}
+
+// Pulls a number out of the metrics JSON ParallelCopy writes with -M
+uint64_t ReadMetric(const std::string& path, const char* name)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return 0;
+	}
+
+	char text[4096];
+	size_t length = fread(text, 1, sizeof(text) - 1, file);
+	fclose(file);
+	text[length] = 0;
+
+	std::string key = std::string("\"") + name + "\":";
+	const char* found = strstr(text, key.c_str());
+	return (found != nullptr) ? strtoull(found + key.length(), nullptr, 10) : 0;
+}
+
+// Lines in a manifest, which is how many files a copy of it should report
+uint64_t CountLines(const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return 0;
+	}
+
+	uint64_t lines = 0;
+	char text[64 * 1024];
+	for (size_t length; (length = fread(text, 1, sizeof(text), file)) > 0; )
+	{
+		lines += std::count(text, text + length, '\n');
+	}
+	fclose(file);
+	return lines;
+}
+
+// False if any run didn't copy every file in its manifest (e.g. the copy failed --verify)
+bool BenchmarkCopy(const char* executable, const std::vector<std::string>& targets, const std::vector<ETree>& trees, const std::vector<size_t>& threadCounts, double scale, int repeats, const char* extraArguments, bool generateOnly)
+{
+	bool ok = true;
+	for (const std::string& target : targets)
+	{
+		for (ETree tree : trees)
+		{
+			const char* name = TreeToString(tree);
+			std::string manifest = target + "/" + name + ".txt";
+			if (!Exists(manifest))
+			{
+				LOG_INFORMATION("Generating [%s] tree in [%s]...", name, target.c_str());
+				STreeStats stats;
+				Clock::time_point start = Clock::now();
+				if (!GenerateTree(target, tree, scale, stats))
+				{
+					continue;
+				}
+				LOG_INFORMATION("Generated [%d] files in [%d] directories, [%llu] bytes, in %.1fs", stats.m_files, stats.m_directories, stats.m_bytes, Seconds(Clock::now() - start));
+			}
+
+			if (generateOnly || (executable == nullptr))
+			{
+				continue;
+			}
+
+			uint64_t expected = CountLines(manifest);
+			for (size_t threads : threadCounts)
+			{
+				std::vector<double> times;
+				uint64_t files = 0;
+				uint64_t bytes = 0;
+				for (int repeat = 0; repeat < repeats; ++repeat)
+				{
+					RemoveTree(target + "/dst/" + name);
+					remove((manifest + ".journal").c_str());
+					std::string metrics = target + "/metrics";
+#if defined(_WIN32)
+					std::string command = Format("\"\"%s\" -t %d -M \"%s\" %s %s \"%s\" > NUL\"", executable, static_cast<int>(threads), metrics.c_str(), TreeArguments(tree), extraArguments, manifest.c_str());
+#else
+					std::string command = Format("'%s' -t %d -M '%s' %s %s '%s' > /dev/null", executable, static_cast<int>(threads), metrics.c_str(), TreeArguments(tree), extraArguments, manifest.c_str());
+#endif // defined(_WIN32)
+					Clock::time_point start = Clock::now();
+					int status = system(command.c_str());
+					times.push_back(Seconds(Clock::now() - start));
+					if (status != 0)
+					{
+						LOG_WARNING("[%s] returned [%d]", command.c_str(), status);
+					}
+					files = ReadMetric(metrics + ".json", "files");
+					bytes = ReadMetric(metrics + ".json", "bytes");
+					uint64_t skipped = ReadMetric(metrics + ".json", "skipped");
+					if (files + skipped != expected)
+					{
+						LOG_ERROR("[%s] copied [%llu] of [%llu] files in [%s]", command.c_str(), files + skipped, expected, manifest.c_str());
+						ok = false;
+					}
+				}
+
+				double seconds = Median(times);
+				std::string parameters = Format("target=%s tree=%s threads=%d%s%s", target.c_str(), name, static_cast<int>(threads), (*extraArguments != 0) ? " args=" : "", extraArguments);
+				g_results.Add("copy", "wall time", parameters, seconds, "s");
+				g_results.Add("copy", "files", parameters, files / seconds, "files/s");
+				g_results.Add("copy", "throughput", parameters, (bytes / seconds) / (1024 * 1024), "MB/s");
+			}
+			RemoveTree(target + "/dst/" + name);
+		}
+	}
+	return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+std::vector<size_t> ParseList(const char* text)
+{
+	std::vector<size_t> values;
+	for (const char* next = text; *next != 0; )
+	{
+		char* end = nullptr;
+		unsigned long value = strtoul(next, &end, 10);
+		if (end == next)
+		{
+			break;
+		}
+		if (value > 0)
+		{
+			values.push_back(value);
+		}
+		next = (*end == ',') ? end + 1 : end;
+	}
+	return values;
+}
+
+void Help()
+{
+	LOG_INFORMATION("ParallelCopyBenchmark.exe [options]");
+	LOG_INFORMATION("--suite  -s  jobs, checksum, copy or all (default all)");
+	LOG_INFORMATION("--threads  -t  comma separated thread counts to run the job system and copy suites with (default 1,2,4,... up to 2*<cores>)");
+	LOG_INFORMATION("--jobs  -j  number of empty jobs per job system benchmark (default 1000000)");
+	LOG_INFORMATION("--copy  -c  path to the ParallelCopy executable for the copy suite");
+	LOG_INFORMATION("--arguments  -a  extra arguments passed to ParallelCopy, e.g. \"-v\" (default none)");
+	LOG_INFORMATION("--target  -d  directory to generate trees and copy in; repeat for several (e.g. a tmpfs and a local disk)");
+	LOG_INFORMATION("--tree  -p  tiny, huge, deep, mixed, sparse or all (default all)");
+	LOG_INFORMATION("--scale  -x  scales the size of the generated trees (default 1: 20000 tiny files, 4x256MB, 2048 deep, 2000 mixed, 3 sparse with 4MB either side of their holes)");
+	LOG_INFORMATION("--generate  -g  only generate the trees (existing trees are reused, so delete '<target>/<tree>.txt' to regenerate)");
+	LOG_INFORMATION("--repeat  -n  runs of each copy benchmark; the median is reported (default 3)");
+	LOG_INFORMATION("--csv  -o  write results to this CSV file");
+	LOG_INFORMATION("--json  -J  write results to this JSON file");
+	LOG_INFORMATION("--label  -l  label for this run in the results, e.g. the commit (default 'run')");
+	LOG_INFORMATION("--help  -h  help");
+}
+
+int main(const int argc, const char* argv[])
+{
+	struct SOptions
+	{
+		bool m_jobs = true;
+		bool m_checksum = true;
+		bool m_copy = true;
+		std::vector<size_t> m_threads;
+		size_t m_jobCount = 1000000;
+		const char* m_executable = nullptr;
+		const char* m_arguments = "";
+		std::vector<std::string> m_targets;
+		std::vector<ETree> m_trees;
+		double m_scale = 1.0;
+		bool m_generate = false;
+		int m_repeat = 3;
+		const char* m_csv = nullptr;
+		const char* m_json = nullptr;
+		const char* m_label = "run";
+	} options;
+
+	CCommandLineOptions opts(argc, argv, [&](int argc, const char* argv[], int& index) -> bool {
+		LOG_ERROR("Unexpected argument [%s]", argv[index]);
+		return false;
+	});
+	opts.AddOption("suite", 's', [&](int argc, const char* argv[], int& index) -> bool {
+		const char* suite = argv[++index];
+		bool all = (_stricmp(suite, "all") == 0);
+		options.m_jobs = all || (_stricmp(suite, "jobs") == 0);
+		options.m_checksum = all || (_stricmp(suite, "checksum") == 0);
+		options.m_copy = all || (_stricmp(suite, "copy") == 0);
+		return true;
+	});
+	opts.AddOption("threads", 't', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_threads = ParseList(argv[++index]);
+		return true;
+	});
+	opts.AddOption("jobs", 'j', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_jobCount = std::max<size_t>(strtoull(argv[++index], nullptr, 10), 1);
+		return true;
+	});
+	opts.AddOption("copy", 'c', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_executable = argv[++index];
+		return true;
+	});
+	opts.AddOption("arguments", 'a', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_arguments = argv[++index];
+		return true;
+	});
+	opts.AddOption("target", 'd', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_targets.push_back(argv[++index]);
+		return true;
+	});
+	opts.AddOption("tree", 'p', [&](int argc, const char* argv[], int& index) -> bool {
+		const char* tree = argv[++index];
+		for (int candidate = 0; candidate < eT_COUNT; ++candidate)
+		{
+			if ((_stricmp(tree, "all") == 0) || (_stricmp(tree, TreeToString(static_cast<ETree>(candidate))) == 0))
+			{
+				options.m_trees.push_back(static_cast<ETree>(candidate));
+			}
+		}
+		return true;
+	});
+	opts.AddOption("scale", 'x', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_scale = std::max(atof(argv[++index]), 0.0001);
+		return true;
+	});
+	opts.AddOption("generate", 'g', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_generate = true;
+		return true;
+	});
+	opts.AddOption("repeat", 'n', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_repeat = std::max(atoi(argv[++index]), 1);
+		return true;
+	});
+	opts.AddOption("csv", 'o', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_csv = argv[++index];
+		return true;
+	});
+	opts.AddOption("json", 'J', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_json = argv[++index];
+		return true;
+	});
+	opts.AddOption("label", 'l', [&](int argc, const char* argv[], int& index) -> bool {
+		options.m_label = argv[++index];
+		return true;
+	});
+	opts.AddOption("help", 'h', [&](int argc, const char* argv[], int& index) -> bool {
+		Help();
+		return false;
+	});
+
+	if (!opts.Parse())
+	{
+		return 1;
+	}
+
+	if (options.m_threads.empty())
+	{
+		size_t maxThreads = std::max<size_t>(std::thread::hardware_concurrency() * 2, 1);
+		for (size_t threads = 1; threads < maxThreads; threads *= 2)
+		{
+			options.m_threads.push_back(threads);
+		}
+		options.m_threads.push_back(maxThreads);
+	}
+	if (options.m_trees.empty())
+	{
+		for (int tree = 0; tree < eT_COUNT; ++tree)
+		{
+			options.m_trees.push_back(static_cast<ETree>(tree));
+		}
+	}
+
+	if (options.m_generate)
+	{
+		options.m_jobs = options.m_checksum = false;
+	}
+
+	bool ok = true;
+	if (options.m_jobs)
+	{
+		ok = BenchmarkJobSystem(options.m_threads, options.m_jobCount);
+	}
+	if (options.m_checksum)
+	{
+		ok = BenchmarkChecksum() && ok;
+	}
+	if ((options.m_copy || options.m_generate) && !options.m_targets.empty())
+	{
+		if ((options.m_executable == nullptr) && !options.m_generate)
+		{
+			LOG_WARNING("No ParallelCopy executable given (--copy); only generating trees");
+		}
+		ok = BenchmarkCopy(options.m_executable, options.m_targets, options.m_trees, options.m_threads, options.m_scale, options.m_repeat, options.m_arguments, options.m_generate) && ok;
+	}
+
+	if (options.m_csv != nullptr)
+	{
+		ok = g_results.WriteCsv(options.m_csv, options.m_label) && ok;
+	}
+	if (options.m_json != nullptr)
+	{
+		ok = g_results.WriteJson(options.m_json, options.m_label) && ok;
+	}
+	return ok ? 0 : 1;
+}